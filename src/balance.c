@@ -48,8 +48,10 @@ typedef struct {
     UINT64 address;
     UINT64 size;
     UINT64 new_address;
+    chunk* oldchunk;
     chunk* newchunk;
     EXTENT_ITEM* ei;
+    UINT32* csum;
     LIST_ENTRY refs;
     LIST_ENTRY list_entry;
 } data_reloc;
@@ -72,6 +74,36 @@ typedef struct {
 #endif
 
 #define BALANCE_UNIT 0x100000 // only read 1 MB at a time
+#define BALANCE_COPY_THREADS 4 // minimum number of copies in flight at once
+#define BALANCE_MAX_CONCURRENCY 16 // upper limit for BalanceConcurrency
+
+#define COMPACT_IDLE_TIME 600000000 // only compact after a minute without any other I/O
+#define COMPACT_HEALTHY_PERCENT 10 // stop once this much of the volume is unallocated
+#define COMPACT_LATENCY_TARGET 20000 // us
+
+typedef struct {
+    UINT64 address;
+    UINT64 new_address;
+    UINT32 length;
+    UINT32* csum;
+    chunk* c;
+    chunk* newchunk;
+    LIST_ENTRY list_entry;
+} balance_copy;
+
+typedef struct {
+    device_extension* Vcb;
+    balance_copy** copies;
+    LONG num_copies;
+    LONG next;
+    NTSTATUS Status;
+} balance_copy_context;
+
+typedef struct {
+    balance_copy_context* bcc;
+    HANDLE thread;
+    KEVENT finished;
+} balance_copy_worker;
 
 static NTSTATUS add_metadata_reloc(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, LIST_ENTRY* items, traverse_ptr* tp,
                                    BOOL skinny, metadata_reloc** mr2, chunk* c, LIST_ENTRY* rollback) {
@@ -631,23 +663,12 @@ static NTSTATUS write_metadata_items(_Requires_exclusive_lock_held_(_Curr_->tree
 
             if (ref->type == TYPE_TREE_BLOCK_REF) {
                 KEY* firstitem;
-                root* r = NULL;
-                LIST_ENTRY* le3;
+                root* r;
                 tree* t;
 
                 firstitem = (KEY*)&mr->data[1];
 
-                le3 = Vcb->roots.Flink;
-                while (le3 != &Vcb->roots) {
-                    root* r2 = CONTAINING_RECORD(le3, root, list_entry);
-
-                    if (r2->id == ref->tbr.offset) {
-                        r = r2;
-                        break;
-                    }
-
-                    le3 = le3->Flink;
-                }
+                r = find_root(Vcb, ref->tbr.offset);
 
                 if (!r) {
                     ERR("could not find subvol with id %llx\n", ref->tbr.offset);
@@ -844,22 +865,11 @@ static NTSTATUS write_metadata_items(_Requires_exclusive_lock_held_(_Curr_->tree
                             }
                         }
                     } else if (ref->top && ref->type == TYPE_TREE_BLOCK_REF) {
-                        LIST_ENTRY* le3;
-                        root* r = NULL;
+                        root* r;
 
                         // alter ROOT_ITEM
 
-                        le3 = Vcb->roots.Flink;
-                        while (le3 != &Vcb->roots) {
-                            root* r2 = CONTAINING_RECORD(le3, root, list_entry);
-
-                            if (r2->id == ref->tbr.offset) {
-                                r = r2;
-                                break;
-                            }
-
-                            le3 = le3->Flink;
-                        }
+                        r = find_root(Vcb, ref->tbr.offset);
 
                         if (r) {
                             r->treeholder.address = mr->new_address;
@@ -1174,6 +1184,9 @@ static NTSTATUS balance_metadata_chunk(device_extension* Vcb, chunk* c, BOOL* ch
         goto end;
     }
 
+    // each tree is read and then written out again
+    throttle_charge(&Vcb->balance.throttle, (UINT64)loaded * Vcb->superblock.node_size * 2, loaded * 2);
+
     Status = STATUS_SUCCESS;
 
     Vcb->need_write = TRUE;
@@ -1212,25 +1225,14 @@ end:
 static NTSTATUS data_reloc_add_tree_edr(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, LIST_ENTRY* metadata_items,
                                         data_reloc* dr, EXTENT_DATA_REF* edr, LIST_ENTRY* rollback) {
     NTSTATUS Status;
-    LIST_ENTRY* le;
     KEY searchkey;
     traverse_ptr tp;
-    root* r = NULL;
+    root* r;
     metadata_reloc* mr;
     UINT64 last_tree = 0;
     data_reloc_ref* ref;
 
-    le = Vcb->roots.Flink;
-    while (le != &Vcb->roots) {
-        root* r2 = CONTAINING_RECORD(le, root, list_entry);
-
-        if (r2->id == edr->root) {
-            r = r2;
-            break;
-        }
-
-        le = le->Flink;
-    }
+    r = find_root(Vcb, edr->root);
 
     if (!r) {
         ERR("could not find subvol %llx\n", edr->count);
@@ -1326,6 +1328,8 @@ static NTSTATUS add_data_reloc(_Requires_exclusive_lock_held_(_Curr_->tree_lock)
     dr->address = tp->item->key.obj_id;
     dr->size = tp->item->key.offset;
     dr->ei = (EXTENT_ITEM*)tp->item->data;
+    dr->oldchunk = c;
+    dr->csum = NULL;
     InitializeListHead(&dr->refs);
 
     Status = delete_tree_item(Vcb, tp);
@@ -1663,92 +1667,310 @@ static NTSTATUS add_data_reloc_extent_item(_Requires_exclusive_lock_held_(_Curr_
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* changed) {
+static NTSTATUS add_balance_copies(device_extension* Vcb, LIST_ENTRY* copies, data_reloc* dr, ULONG off, ULONG size, BOOL csum) {
+    do {
+        balance_copy* bc;
+        ULONG rl;
+
+        if (size * Vcb->superblock.sector_size > BALANCE_UNIT)
+            rl = BALANCE_UNIT / Vcb->superblock.sector_size;
+        else
+            rl = size;
+
+        bc = ExAllocatePoolWithTag(PagedPool, sizeof(balance_copy), ALLOC_TAG);
+        if (!bc) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        bc->address = dr->address + (off * Vcb->superblock.sector_size);
+        bc->new_address = dr->new_address + (off * Vcb->superblock.sector_size);
+        bc->length = rl * Vcb->superblock.sector_size;
+        bc->csum = csum ? &dr->csum[off] : NULL;
+        bc->c = dr->oldchunk;
+        bc->newchunk = dr->newchunk;
+
+        InsertTailList(copies, &bc->list_entry);
+
+        size -= rl;
+        off += rl;
+    } while (size > 0);
+
+    return STATUS_SUCCESS;
+}
+
+// Each stream reads into its own buffer and writes it out again, so with several of them going
+// the reads from the old chunk overlap the writes to the new one. Checksums are verified by
+// read_data, which hands large runs to the calc threads.
+static void balance_copy_extents(balance_copy_context* bcc) {
+    NTSTATUS Status;
+    UINT8* data;
+
+    data = ExAllocatePoolWithTag(PagedPool, BALANCE_UNIT, ALLOC_TAG);
+    if (!data) {
+        ERR("out of memory\n");
+        InterlockedCompareExchange(&bcc->Status, STATUS_INSUFFICIENT_RESOURCES, STATUS_SUCCESS);
+        return;
+    }
+
+    while (NT_SUCCESS(bcc->Status)) {
+        LONG i = InterlockedIncrement(&bcc->next) - 1;
+        balance_copy* bc;
+
+        if (i >= bcc->num_copies)
+            break;
+
+        bc = bcc->copies[i];
+
+        Status = read_data(bcc->Vcb, bc->address, bc->length, bc->csum, FALSE, data, bc->c, NULL, NULL, 0, FALSE, NormalPagePriority);
+        if (!NT_SUCCESS(Status)) {
+            ERR("read_data returned %08x\n", Status);
+            InterlockedCompareExchange(&bcc->Status, Status, STATUS_SUCCESS);
+            break;
+        }
+
+        Status = write_data_complete(bcc->Vcb, bc->new_address, data, bc->length, NULL, bc->newchunk, FALSE, 0, NormalPagePriority);
+        if (!NT_SUCCESS(Status)) {
+            ERR("write_data_complete returned %08x\n", Status);
+            InterlockedCompareExchange(&bcc->Status, Status, STATUS_SUCCESS);
+            break;
+        }
+    }
+
+    ExFreePool(data);
+}
+
+_Function_class_(KSTART_ROUTINE)
+static void balance_copy_thread(void* context) {
+    balance_copy_worker* bcw = context;
+
+    balance_copy_extents(bcw->bcc);
+
+    KeSetEvent(&bcw->finished, 0, FALSE);
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// The copies are interleaved between the chunks they come from, so that each chunk's devices
+// get a share of the streams from the start. However many chunks there are, the number of streams
+// stays the same - one per calc thread, but at least BALANCE_COPY_THREADS.
+static NTSTATUS do_balance_copies(device_extension* Vcb, LIST_ENTRY* copies, chunk** chunks, ULONG num_chunks) {
+    NTSTATUS Status;
+    balance_copy_context bcc;
+    balance_copy_worker* workers;
+    ULONG num_workers = 0, max_workers, i;
+    LIST_ENTRY* le;
+    LIST_ENTRY chunk_copies[BALANCE_MAX_CONCURRENCY];
+    BOOL found;
+
+    bcc.Vcb = Vcb;
+    bcc.num_copies = 0;
+    bcc.next = 0;
+    bcc.Status = STATUS_SUCCESS;
+
+    le = copies->Flink;
+    while (le != copies) {
+        bcc.num_copies++;
+        le = le->Flink;
+    }
+
+    if (bcc.num_copies == 0)
+        return STATUS_SUCCESS;
+
+    bcc.copies = ExAllocatePoolWithTag(PagedPool, sizeof(balance_copy*) * bcc.num_copies, ALLOC_TAG);
+    if (!bcc.copies) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    max_workers = min(max(Vcb->calcthreads.num_threads, BALANCE_COPY_THREADS), (ULONG)bcc.num_copies) - 1;
+
+    if (max_workers > 0) {
+        workers = ExAllocatePoolWithTag(NonPagedPool, sizeof(balance_copy_worker) * max_workers, ALLOC_TAG);
+        if (!workers) {
+            ERR("out of memory\n");
+            ExFreePool(bcc.copies);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    } else
+        workers = NULL;
+
+    // sort the copies by chunk, keeping their order, then take the next one from each chunk in turn
+
+    for (i = 0; i < num_chunks; i++) {
+        InitializeListHead(&chunk_copies[i]);
+    }
+
+    while (!IsListEmpty(copies)) {
+        balance_copy* bc = CONTAINING_RECORD(RemoveHeadList(copies), balance_copy, list_entry);
+
+        for (i = 0; i < num_chunks - 1; i++) {
+            if (bc->c == chunks[i])
+                break;
+        }
+
+        InsertTailList(&chunk_copies[i], &bc->list_entry);
+    }
+
+    i = 0;
+
+    do {
+        ULONG j;
+
+        found = FALSE;
+
+        for (j = 0; j < num_chunks; j++) {
+            if (!IsListEmpty(&chunk_copies[j])) {
+                bcc.copies[i] = CONTAINING_RECORD(RemoveHeadList(&chunk_copies[j]), balance_copy, list_entry);
+                i++;
+                found = TRUE;
+            }
+        }
+    } while (found);
+
+    // put them back, so that the caller can free them
+    for (i = 0; i < (ULONG)bcc.num_copies; i++) {
+        InsertTailList(copies, &bcc.copies[i]->list_entry);
+    }
+
+    // this thread runs one of the streams itself
+
+    while (num_workers < max_workers) {
+        balance_copy_worker* bcw = &workers[num_workers];
+
+        bcw->bcc = &bcc;
+        KeInitializeEvent(&bcw->finished, NotificationEvent, FALSE);
+
+        Status = PsCreateSystemThread(&bcw->thread, 0, NULL, NULL, NULL, balance_copy_thread, bcw);
+        if (!NT_SUCCESS(Status)) {
+            WARN("PsCreateSystemThread returned %08x\n", Status);
+            break;
+        }
+
+        num_workers++;
+    }
+
+    balance_copy_extents(&bcc);
+
+    for (i = 0; i < num_workers; i++) {
+        KeWaitForSingleObject(&workers[i].finished, Executive, KernelMode, FALSE, NULL);
+        ZwClose(workers[i].thread);
+    }
+
+    if (workers)
+        ExFreePool(workers);
+
+    ExFreePool(bcc.copies);
+
+    return bcc.Status;
+}
+
+static BOOL address_in_chunks(chunk** chunks, ULONG num_chunks, UINT64 address) {
+    ULONG i;
+
+    for (i = 0; i < num_chunks; i++) {
+        if (address >= chunks[i]->offset && address < chunks[i]->offset + chunks[i]->chunk_item->size)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+// Moves the next batch of extents out of each of the chunks given. These are on different
+// devices, so the copies out of one overlap with those out of the others.
+static NTSTATUS balance_data_chunks(device_extension* Vcb, chunk** chunks, ULONG num_chunks, BOOL* changed) {
     KEY searchkey;
     traverse_ptr tp;
     NTSTATUS Status;
     BOOL b;
-    LIST_ENTRY items, metadata_items, rollback, *le;
-    UINT64 loaded = 0, num_loaded = 0;
+    LIST_ENTRY items, metadata_items, copies, rollback, *le;
+    UINT64 total_loaded = 0, total_num_loaded = 0;
     chunk* newchunk = NULL;
-    UINT8* data = NULL;
-
-    TRACE("chunk %llx\n", c->offset);
+    ULONG i;
 
     InitializeListHead(&rollback);
     InitializeListHead(&items);
     InitializeListHead(&metadata_items);
+    InitializeListHead(&copies);
 
     ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
 
-    searchkey.obj_id = c->offset;
-    searchkey.obj_type = TYPE_EXTENT_ITEM;
-    searchkey.offset = 0xffffffffffffffff;
+    for (i = 0; i < num_chunks; i++) {
+        chunk* c = chunks[i];
+        UINT64 loaded = 0, num_loaded = 0;
 
-    Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE, NULL);
-    if (!NT_SUCCESS(Status)) {
-        ERR("find_item returned %08x\n", Status);
-        goto end;
-    }
+        TRACE("chunk %llx\n", c->offset);
 
-    do {
-        traverse_ptr next_tp;
+        changed[i] = FALSE;
 
-        if (tp.item->key.obj_id >= c->offset + c->chunk_item->size)
-            break;
+        searchkey.obj_id = c->offset;
+        searchkey.obj_type = TYPE_EXTENT_ITEM;
+        searchkey.offset = 0xffffffffffffffff;
 
-        if (tp.item->key.obj_id >= c->offset && tp.item->key.obj_type == TYPE_EXTENT_ITEM) {
-            BOOL tree = FALSE;
+        Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE, NULL);
+        if (!NT_SUCCESS(Status)) {
+            ERR("find_item returned %08x\n", Status);
+            goto end;
+        }
 
-            if (tp.item->key.obj_type == TYPE_EXTENT_ITEM && tp.item->size >= sizeof(EXTENT_ITEM)) {
-                EXTENT_ITEM* ei = (EXTENT_ITEM*)tp.item->data;
+        do {
+            traverse_ptr next_tp;
 
-                if (ei->flags & EXTENT_ITEM_TREE_BLOCK)
-                    tree = TRUE;
-            }
+            if (tp.item->key.obj_id >= c->offset + c->chunk_item->size)
+                break;
 
-            if (!tree) {
-                Status = add_data_reloc(Vcb, &items, &metadata_items, &tp, c, &rollback);
+            if (tp.item->key.obj_id >= c->offset && tp.item->key.obj_type == TYPE_EXTENT_ITEM) {
+                BOOL tree = FALSE;
 
-                if (!NT_SUCCESS(Status)) {
-                    ERR("add_data_reloc returned %08x\n", Status);
-                    goto end;
+                if (tp.item->key.obj_type == TYPE_EXTENT_ITEM && tp.item->size >= sizeof(EXTENT_ITEM)) {
+                    EXTENT_ITEM* ei = (EXTENT_ITEM*)tp.item->data;
+
+                    if (ei->flags & EXTENT_ITEM_TREE_BLOCK)
+                        tree = TRUE;
                 }
 
-                loaded += tp.item->key.offset;
-                num_loaded++;
+                if (!tree) {
+                    Status = add_data_reloc(Vcb, &items, &metadata_items, &tp, c, &rollback);
 
-                if (loaded >= 0x1000000 || num_loaded >= 100) // only do so much at a time, so we don't block too obnoxiously
-                    break;
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("add_data_reloc returned %08x\n", Status);
+                        goto end;
+                    }
+
+                    changed[i] = TRUE;
+
+                    loaded += tp.item->key.offset;
+                    num_loaded++;
+
+                    // only do so much at a time, so we don't block too obnoxiously
+                    if (loaded >= throttle_batch_size(&Vcb->balance.throttle, 0x1000000) || num_loaded >= 100)
+                        break;
+                }
             }
-        }
 
-        b = find_next_item(Vcb, &tp, &next_tp, FALSE, NULL);
+            b = find_next_item(Vcb, &tp, &next_tp, FALSE, NULL);
 
-        if (b)
-            tp = next_tp;
-    } while (b);
+            if (b)
+                tp = next_tp;
+        } while (b);
+
+        total_loaded += loaded;
+        total_num_loaded += num_loaded;
+    }
 
     if (IsListEmpty(&items)) {
-        *changed = FALSE;
         Status = STATUS_SUCCESS;
         goto end;
-    } else
-        *changed = TRUE;
-
-    data = ExAllocatePoolWithTag(PagedPool, BALANCE_UNIT, ALLOC_TAG);
-    if (!data) {
-        ERR("out of memory\n");
-        Status = STATUS_INSUFFICIENT_RESOURCES;
-        goto end;
     }
 
+    // each extent is read and then written out again
+    throttle_charge(&Vcb->balance.throttle, total_loaded * 2, (ULONG)(total_num_loaded * 2));
+
     le = items.Flink;
     while (le != &items) {
         data_reloc* dr = CONTAINING_RECORD(le, data_reloc, list_entry);
         BOOL done = FALSE;
         LIST_ENTRY* le2;
-        UINT32* csum;
         RTL_BITMAP bmp;
         ULONG* bmparr;
         ULONG runlength, index, lastoff;
@@ -1832,8 +2054,8 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* change
             goto end;
         }
 
-        csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(dr->size * sizeof(UINT32) / Vcb->superblock.sector_size), ALLOC_TAG);
-        if (!csum) {
+        dr->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(dr->size * sizeof(UINT32) / Vcb->superblock.sector_size), ALLOC_TAG);
+        if (!dr->csum) {
             ERR("out of memory\n");
             ExFreePool(bmparr);
             Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -1850,7 +2072,6 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* change
         Status = find_item(Vcb, Vcb->checksum_root, &tp, &searchkey, FALSE, NULL);
         if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND) {
             ERR("find_item returned %08x\n", Status);
-            ExFreePool(csum);
             ExFreePool(bmparr);
             goto end;
         }
@@ -1866,7 +2087,7 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* change
                         UINT64 cs = max(dr->address, tp.item->key.offset);
                         UINT64 ce = min(dr->address + dr->size, tp.item->key.offset + (tp.item->size * Vcb->superblock.sector_size / sizeof(UINT32)));
 
-                        RtlCopyMemory(csum + ((cs - dr->address) / Vcb->superblock.sector_size),
+                        RtlCopyMemory(dr->csum + ((cs - dr->address) / Vcb->superblock.sector_size),
                                       tp.item->data + ((cs - tp.item->key.offset) * sizeof(UINT32) / Vcb->superblock.sector_size),
                                       (ULONG)((ce - cs) * sizeof(UINT32) / Vcb->superblock.sector_size));
 
@@ -1889,119 +2110,53 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* change
 
         while (runlength != 0) {
             if (index > lastoff) {
-                ULONG off = lastoff;
-                ULONG size = index - lastoff;
-
-                // handle no csum run
-                do {
-                    ULONG rl;
-
-                    if (size * Vcb->superblock.sector_size > BALANCE_UNIT)
-                        rl = BALANCE_UNIT / Vcb->superblock.sector_size;
-                    else
-                        rl = size;
-
-                    Status = read_data(Vcb, dr->address + (off * Vcb->superblock.sector_size), rl * Vcb->superblock.sector_size, NULL, FALSE, data,
-                                       c, NULL, NULL, 0, FALSE, NormalPagePriority);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("read_data returned %08x\n", Status);
-                        ExFreePool(csum);
-                        ExFreePool(bmparr);
-                        goto end;
-                    }
-
-                    Status = write_data_complete(Vcb, dr->new_address + (off * Vcb->superblock.sector_size), data, rl * Vcb->superblock.sector_size,
-                                                 NULL, newchunk, FALSE, 0, NormalPagePriority);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("write_data_complete returned %08x\n", Status);
-                        ExFreePool(csum);
-                        ExFreePool(bmparr);
-                        goto end;
-                    }
-
-                    size -= rl;
-                    off += rl;
-                } while (size > 0);
-            }
-
-            add_checksum_entry(Vcb, dr->new_address + (index * Vcb->superblock.sector_size), runlength, &csum[index], NULL);
-            add_checksum_entry(Vcb, dr->address + (index * Vcb->superblock.sector_size), runlength, NULL, NULL);
-
-            // handle csum run
-            do {
-                ULONG rl;
-
-                if (runlength * Vcb->superblock.sector_size > BALANCE_UNIT)
-                    rl = BALANCE_UNIT / Vcb->superblock.sector_size;
-                else
-                    rl = runlength;
-
-                Status = read_data(Vcb, dr->address + (index * Vcb->superblock.sector_size), rl * Vcb->superblock.sector_size, &csum[index], FALSE, data,
-                                   c, NULL, NULL, 0, FALSE, NormalPagePriority);
+                // no csum run
+                Status = add_balance_copies(Vcb, &copies, dr, lastoff, index - lastoff, FALSE);
                 if (!NT_SUCCESS(Status)) {
-                    ERR("read_data returned %08x\n", Status);
-                    ExFreePool(csum);
+                    ERR("add_balance_copies returned %08x\n", Status);
                     ExFreePool(bmparr);
                     goto end;
                 }
+            }
 
-                Status = write_data_complete(Vcb, dr->new_address + (index * Vcb->superblock.sector_size), data, rl * Vcb->superblock.sector_size,
-                                             NULL, newchunk, FALSE, 0, NormalPagePriority);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("write_data_complete returned %08x\n", Status);
-                    ExFreePool(csum);
-                    ExFreePool(bmparr);
-                    goto end;
-                }
+            add_checksum_entry(Vcb, dr->new_address + (index * Vcb->superblock.sector_size), runlength, &dr->csum[index], NULL);
+            add_checksum_entry(Vcb, dr->address + (index * Vcb->superblock.sector_size), runlength, NULL, NULL);
 
-                runlength -= rl;
-                index += rl;
-            } while (runlength > 0);
+            // csum run
+            Status = add_balance_copies(Vcb, &copies, dr, index, runlength, TRUE);
+            if (!NT_SUCCESS(Status)) {
+                ERR("add_balance_copies returned %08x\n", Status);
+                ExFreePool(bmparr);
+                goto end;
+            }
 
+            index += runlength;
             lastoff = index;
             runlength = RtlFindNextForwardRunClear(&bmp, index, &index);
         }
 
-        ExFreePool(csum);
         ExFreePool(bmparr);
 
-        // handle final nocsum run
+        // final nocsum run
         if (lastoff < dr->size / Vcb->superblock.sector_size) {
-            ULONG off = lastoff;
-            ULONG size = (ULONG)((dr->size / Vcb->superblock.sector_size) - lastoff);
-
-            do {
-                ULONG rl;
-
-                if (size * Vcb->superblock.sector_size > BALANCE_UNIT)
-                    rl = BALANCE_UNIT / Vcb->superblock.sector_size;
-                else
-                    rl = size;
-
-                Status = read_data(Vcb, dr->address + (off * Vcb->superblock.sector_size), rl * Vcb->superblock.sector_size, NULL, FALSE, data,
-                                   c, NULL, NULL, 0, FALSE, NormalPagePriority);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("read_data returned %08x\n", Status);
-                    goto end;
-                }
-
-                Status = write_data_complete(Vcb, dr->new_address + (off * Vcb->superblock.sector_size), data, rl * Vcb->superblock.sector_size,
-                                             NULL, newchunk, FALSE, 0, NormalPagePriority);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("write_data_complete returned %08x\n", Status);
-                    goto end;
-                }
-
-                size -= rl;
-                off += rl;
-            } while (size > 0);
+            Status = add_balance_copies(Vcb, &copies, dr, lastoff, (ULONG)((dr->size / Vcb->superblock.sector_size) - lastoff), FALSE);
+            if (!NT_SUCCESS(Status)) {
+                ERR("add_balance_copies returned %08x\n", Status);
+                goto end;
+            }
         }
 
         le = le->Flink;
     }
 
-    ExFreePool(data);
-    data = NULL;
+    // The copying is done in one go once all the new addresses are known, so that it can be
+    // spread over several threads. We still hold tree_lock exclusively, as nocow writes go
+    // straight to the old extents.
+    Status = do_balance_copies(Vcb, &copies, chunks, num_chunks);
+    if (!NT_SUCCESS(Status)) {
+        ERR("do_balance_copies returned %08x\n", Status);
+        goto end;
+    }
 
     Status = write_metadata_items(Vcb, &metadata_items, &items, NULL, &rollback);
     if (!NT_SUCCESS(Status)) {
@@ -2022,28 +2177,30 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* change
         le = le->Flink;
     }
 
-    le = c->changed_extents.Flink;
-    while (le != &c->changed_extents) {
-        LIST_ENTRY *le2, *le3;
-        changed_extent* ce = CONTAINING_RECORD(le, changed_extent, list_entry);
+    for (i = 0; i < num_chunks; i++) {
+        le = chunks[i]->changed_extents.Flink;
+        while (le != &chunks[i]->changed_extents) {
+            LIST_ENTRY *le2, *le3;
+            changed_extent* ce = CONTAINING_RECORD(le, changed_extent, list_entry);
 
-        le3 = le->Flink;
+            le3 = le->Flink;
 
-        le2 = items.Flink;
-        while (le2 != &items) {
-            data_reloc* dr = CONTAINING_RECORD(le2, data_reloc, list_entry);
+            le2 = items.Flink;
+            while (le2 != &items) {
+                data_reloc* dr = CONTAINING_RECORD(le2, data_reloc, list_entry);
 
-            if (ce->address == dr->address) {
-                ce->address = dr->new_address;
-                RemoveEntryList(&ce->list_entry);
-                InsertTailList(&dr->newchunk->changed_extents, &ce->list_entry);
-                break;
+                if (ce->address == dr->address) {
+                    ce->address = dr->new_address;
+                    RemoveEntryList(&ce->list_entry);
+                    InsertTailList(&dr->newchunk->changed_extents, &ce->list_entry);
+                    break;
+                }
+
+                le2 = le2->Flink;
             }
 
-            le2 = le2->Flink;
+            le = le3;
         }
-
-        le = le3;
     }
 
     Status = STATUS_SUCCESS;
@@ -2070,7 +2227,7 @@ end:
                         if (ext->extent_data.type == EXTENT_TYPE_REGULAR || ext->extent_data.type == EXTENT_TYPE_PREALLOC) {
                             EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ext->extent_data.data;
 
-                            if (ed2->size > 0 && ed2->address >= c->offset && ed2->address < c->offset + c->chunk_item->size) {
+                            if (ed2->size > 0 && address_in_chunks(chunks, num_chunks, ed2->address)) {
                                 LIST_ENTRY* le3 = items.Flink;
                                 while (le3 != &items) {
                                     data_reloc* dr = CONTAINING_RECORD(le3, data_reloc, list_entry);
@@ -2123,7 +2280,7 @@ end:
                     if (ext->extent_data.type == EXTENT_TYPE_REGULAR || ext->extent_data.type == EXTENT_TYPE_PREALLOC) {
                         EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ext->extent_data.data;
 
-                        if (ed2->size > 0 && ed2->address >= c->offset && ed2->address < c->offset + c->chunk_item->size) {
+                        if (ed2->size > 0 && address_in_chunks(chunks, num_chunks, ed2->address)) {
                             LIST_ENTRY* le3 = items.Flink;
                             while (le3 != &items) {
                                 data_reloc* dr = CONTAINING_RECORD(le3, data_reloc, list_entry);
@@ -2155,12 +2312,18 @@ end:
 
     ExReleaseResourceLite(&Vcb->tree_lock);
 
-    if (data)
-        ExFreePool(data);
+    while (!IsListEmpty(&copies)) {
+        balance_copy* bc = CONTAINING_RECORD(RemoveHeadList(&copies), balance_copy, list_entry);
+
+        ExFreePool(bc);
+    }
 
     while (!IsListEmpty(&items)) {
         data_reloc* dr = CONTAINING_RECORD(RemoveHeadList(&items), data_reloc, list_entry);
 
+        if (dr->csum)
+            ExFreePool(dr->csum);
+
         while (!IsListEmpty(&dr->refs)) {
             data_reloc_ref* ref = CONTAINING_RECORD(RemoveHeadList(&dr->refs), data_reloc_ref, list_entry);
 
@@ -2926,15 +3089,17 @@ static NTSTATUS try_consolidation(device_extension* Vcb, UINT64 flags, chunk** n
         do {
             changed = FALSE;
 
-            Status = balance_data_chunk(Vcb, rc, &changed);
+            Status = balance_data_chunks(Vcb, &rc, 1, &changed);
             if (!NT_SUCCESS(Status)) {
-                ERR("balance_data_chunk returned %08x\n", Status);
+                ERR("balance_data_chunks returned %08x\n", Status);
                 Vcb->balance.status = Status;
                 rc->list_entry_balance.Flink = NULL;
                 rc->reloc = FALSE;
                 return Status;
             }
 
+            throttle_wait(Vcb, &Vcb->balance.throttle, &Vcb->balance.stopping);
+
             KeWaitForSingleObject(&Vcb->balance.event, Executive, KernelMode, FALSE, NULL);
 
             if (Vcb->readonly)
@@ -3022,19 +3187,190 @@ static NTSTATUS regenerate_space_list(device_extension* Vcb, device* dev) {
     return STATUS_SUCCESS;
 }
 
-_Function_class_(KSTART_ROUTINE)
-void balance_thread(void* context) {
-    device_extension* Vcb = (device_extension*)context;
-    LIST_ENTRY chunks;
+// Called with tree_lock held.
+static UINT64 get_unallocated_space(device_extension* Vcb) {
     LIST_ENTRY* le;
-    UINT64 num_chunks[3], okay_metadata_chunks = 0, okay_data_chunks = 0, okay_system_chunks = 0;
-    UINT64 old_data_flags = 0, old_metadata_flags = 0, old_system_flags = 0;
-    NTSTATUS Status;
+    UINT64 unallocated = 0;
 
-    Vcb->balance.balance_num++;
+    le = Vcb->devices.Flink;
+    while (le != &Vcb->devices) {
+        device* dev = CONTAINING_RECORD(le, device, list_entry);
 
-    Vcb->balance.stopping = FALSE;
-    KeInitializeEvent(&Vcb->balance.finished, NotificationEvent, FALSE);
+        if (dev->devobj && !dev->readonly && !dev->reloc && dev->devitem.num_bytes > dev->devitem.bytes_used)
+            unallocated += dev->devitem.num_bytes - dev->devitem.bytes_used;
+
+        le = le->Flink;
+    }
+
+    return unallocated;
+}
+
+// Compaction gives way to everything else - it stops as soon as there's been any foreground I/O,
+// or once enough space has been given back.
+static BOOL auto_compact_done(device_extension* Vcb) {
+    LARGE_INTEGER time;
+    UINT64 unallocated;
+
+    KeQuerySystemTime(&time);
+
+    if (time.QuadPart - Vcb->fg_latency_time < COMPACT_IDLE_TIME)
+        return TRUE;
+
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+    unallocated = get_unallocated_space(Vcb);
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    return unallocated >= Vcb->superblock.total_bytes * COMPACT_HEALTHY_PERCENT / 100;
+}
+
+static BOOL chunks_share_device(chunk* c1, chunk* c2) {
+    UINT16 i, j;
+
+    for (i = 0; i < c1->chunk_item->num_stripes; i++) {
+        if (!c1->devices[i])
+            continue;
+
+        for (j = 0; j < c2->chunk_item->num_stripes; j++) {
+            if (c1->devices[i] == c2->devices[j])
+                return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+// Relocates the data chunks on the list, up to BalanceConcurrency of them at a time. A chunk is
+// only added to the set if it has no devices in common with those already in it, so that each
+// device is read by one chunk at once. Chunks which still have metadata to move are put back on
+// the list for the metadata pass; the others are taken off it as they finish.
+static NTSTATUS balance_data(device_extension* Vcb, LIST_ENTRY* chunks) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    LIST_ENTRY pending, *le;
+    chunk* active[BALANCE_MAX_CONCURRENCY];
+    BOOL changed[BALANCE_MAX_CONCURRENCY];
+    UINT64 used[BALANCE_MAX_CONCURRENCY];
+    ULONG num_active = 0, max_active, i;
+
+    max_active = min(max(Vcb->options.balance_concurrency, 1), BALANCE_MAX_CONCURRENCY);
+
+    InitializeListHead(&pending);
+
+    le = chunks->Flink;
+    while (le != chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry_balance);
+        LIST_ENTRY* le2 = le->Flink;
+
+        if (c->chunk_item->type & BLOCK_FLAG_DATA) {
+            RemoveEntryList(&c->list_entry_balance);
+            InsertTailList(&pending, &c->list_entry_balance);
+        }
+
+        le = le2;
+    }
+
+    while (TRUE) {
+        le = pending.Flink;
+        while (le != &pending && num_active < max_active) {
+            chunk* c = CONTAINING_RECORD(le, chunk, list_entry_balance);
+            LIST_ENTRY* le2 = le->Flink;
+            BOOL clash = FALSE;
+
+            for (i = 0; i < num_active; i++) {
+                if (chunks_share_device(c, active[i])) {
+                    clash = TRUE;
+                    break;
+                }
+            }
+
+            if (!clash) {
+                RemoveEntryList(&c->list_entry_balance);
+                active[num_active] = c;
+                used[num_active] = c->used;
+                num_active++;
+            }
+
+            le = le2;
+        }
+
+        if (num_active == 0)
+            break;
+
+        Status = balance_data_chunks(Vcb, active, num_active, changed);
+        if (!NT_SUCCESS(Status)) {
+            ERR("balance_data_chunks returned %08x\n", Status);
+            break;
+        }
+
+        throttle_wait(Vcb, &Vcb->balance.throttle, &Vcb->balance.stopping);
+
+        KeWaitForSingleObject(&Vcb->balance.event, Executive, KernelMode, FALSE, NULL);
+
+        if (Vcb->readonly)
+            Vcb->balance.stopping = TRUE;
+
+        if (Vcb->balance.stopping)
+            break;
+
+        i = 0;
+        while (i < num_active) {
+            chunk* c = active[i];
+
+            if (changed[i]) {
+                i++;
+                continue;
+            }
+
+            c->changed = TRUE;
+            c->space_changed = TRUE;
+
+            if (Vcb->balance.opts[BALANCE_OPTS_METADATA].flags & BTRFS_BALANCE_OPTS_ENABLED && c->chunk_item->type & BLOCK_FLAG_METADATA)
+                InsertTailList(chunks, &c->list_entry_balance);
+            else {
+                c->list_entry_balance.Flink = NULL;
+                Vcb->balance.chunks_left--;
+            }
+
+            if (Vcb->balance.compacting) {
+                Vcb->balance.compact.chunks_relocated++;
+                Vcb->balance.compact.bytes_relocated += used[i];
+            }
+
+            num_active--;
+            active[i] = active[num_active];
+            used[i] = used[num_active];
+        }
+
+        if (Vcb->balance.compacting && auto_compact_done(Vcb)) {
+            Vcb->balance.stopping = TRUE;
+            break;
+        }
+    }
+
+    // if we're stopping, put everything back so that balance_thread can clear the reloc flags
+    for (i = 0; i < num_active; i++) {
+        active[i]->changed = TRUE;
+        active[i]->space_changed = TRUE;
+        InsertTailList(chunks, &active[i]->list_entry_balance);
+    }
+
+    while (!IsListEmpty(&pending)) {
+        le = RemoveHeadList(&pending);
+        InsertTailList(chunks, le);
+    }
+
+    return Status;
+}
+
+_Function_class_(KSTART_ROUTINE)
+void balance_thread(void* context) {
+    device_extension* Vcb = (device_extension*)context;
+    LIST_ENTRY chunks;
+    LIST_ENTRY* le;
+    UINT64 num_chunks[3], okay_metadata_chunks = 0, okay_data_chunks = 0, okay_system_chunks = 0;
+    UINT64 old_data_flags = 0, old_metadata_flags = 0, old_system_flags = 0;
+    NTSTATUS Status;
+
+    Vcb->balance.balance_num++;
 
     if (Vcb->balance.opts[BALANCE_OPTS_DATA].flags & BTRFS_BALANCE_OPTS_ENABLED && Vcb->balance.opts[BALANCE_OPTS_DATA].flags & BTRFS_BALANCE_OPTS_CONVERT) {
         old_data_flags = Vcb->data_flags;
@@ -3068,7 +3404,7 @@ void balance_thread(void* context) {
     // FIXME - what are we supposed to do with limit_start?
 
     if (!Vcb->readonly) {
-        if (!Vcb->balance.removing && !Vcb->balance.shrinking) {
+        if (!Vcb->balance.removing && !Vcb->balance.shrinking && !Vcb->balance.compacting) {
             Status = add_balance_item(Vcb);
             if (!NT_SUCCESS(Status)) {
                 ERR("add_balance_item returned %08x\n", Status);
@@ -3262,51 +3598,16 @@ void balance_thread(void* context) {
     ExReleaseResourceLite(&Vcb->chunk_lock);
 
     // do data chunks before metadata
-    le = chunks.Flink;
-    while (le != &chunks) {
-        chunk* c = CONTAINING_RECORD(le, chunk, list_entry_balance);
-        LIST_ENTRY* le2 = le->Flink;
-
-        if (c->chunk_item->type & BLOCK_FLAG_DATA) {
-            BOOL changed;
-
-            do {
-                changed = FALSE;
-
-                Status = balance_data_chunk(Vcb, c, &changed);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("balance_data_chunk returned %08x\n", Status);
-                    Vcb->balance.status = Status;
-                    goto end;
-                }
-
-                KeWaitForSingleObject(&Vcb->balance.event, Executive, KernelMode, FALSE, NULL);
-
-                if (Vcb->readonly)
-                    Vcb->balance.stopping = TRUE;
-
-                if (Vcb->balance.stopping)
-                    break;
-            } while (changed);
-
-            c->changed = TRUE;
-            c->space_changed = TRUE;
-        }
-
-        if (Vcb->balance.stopping)
-            goto end;
-
-        if (c->chunk_item->type & BLOCK_FLAG_DATA &&
-            (!(Vcb->balance.opts[BALANCE_OPTS_METADATA].flags & BTRFS_BALANCE_OPTS_ENABLED) || !(c->chunk_item->type & BLOCK_FLAG_METADATA))) {
-            RemoveEntryList(&c->list_entry_balance);
-            c->list_entry_balance.Flink = NULL;
-
-            Vcb->balance.chunks_left--;
-        }
-
-        le = le2;
+    Status = balance_data(Vcb, &chunks);
+    if (!NT_SUCCESS(Status)) {
+        ERR("balance_data returned %08x\n", Status);
+        Vcb->balance.status = Status;
+        goto end;
     }
 
+    if (Vcb->balance.stopping)
+        goto end;
+
     // do metadata chunks
     while (!IsListEmpty(&chunks)) {
         chunk* c;
@@ -3324,6 +3625,8 @@ void balance_thread(void* context) {
                     goto end;
                 }
 
+                throttle_wait(Vcb, &Vcb->balance.throttle, &Vcb->balance.stopping);
+
                 KeWaitForSingleObject(&Vcb->balance.event, Executive, KernelMode, FALSE, NULL);
 
                 if (Vcb->readonly)
@@ -3455,7 +3758,7 @@ end:
 
             if (!Vcb->balance.stopping && NT_SUCCESS(Vcb->balance.status))
                 FsRtlNotifyVolumeEvent(Vcb->root_file, FSRTL_VOLUME_CHANGE_SIZE);
-        } else {
+        } else if (!Vcb->balance.compacting) {
             Status = remove_balance_item(Vcb);
             if (!NT_SUCCESS(Status)) {
                 ERR("remove_balance_item returned %08x\n", Status);
@@ -3480,10 +3783,24 @@ end:
         }
     }
 
+    // under tree_lock, so that nobody can start a new balance between us clearing the handle and signalling finished
+    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
+
+    if (Vcb->balance.compacting) {
+        KeQuerySystemTime(&Vcb->balance.compact.last_finish);
+
+        WARN("automatic compaction finished (status %08x): %llu chunks and %llx bytes relocated in total\n", Vcb->balance.status,
+             Vcb->balance.compact.chunks_relocated, Vcb->balance.compact.bytes_relocated);
+
+        Vcb->balance.compacting = FALSE;
+    }
+
     ZwClose(Vcb->balance.thread);
     Vcb->balance.thread = NULL;
 
     KeSetEvent(&Vcb->balance.finished, 0, FALSE);
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
 }
 
 NTSTATUS start_balance(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode) {
@@ -3491,7 +3808,7 @@ NTSTATUS start_balance(device_extension* Vcb, void* data, ULONG length, KPROCESS
     btrfs_start_balance* bsb = (btrfs_start_balance*)data;
     UINT8 i;
 
-    if (length < sizeof(btrfs_start_balance) || !data)
+    if (length < offsetof(btrfs_start_balance, throttle) || !data)
         return STATUS_INVALID_PARAMETER;
 
     if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_MANAGE_VOLUME_PRIVILEGE), processor_mode))
@@ -3502,16 +3819,6 @@ NTSTATUS start_balance(device_extension* Vcb, void* data, ULONG length, KPROCESS
         return STATUS_DEVICE_NOT_READY;
     }
 
-    if (Vcb->scrub.thread) {
-        WARN("cannot start balance while scrub running\n");
-        return STATUS_DEVICE_NOT_READY;
-    }
-
-    if (Vcb->balance.thread) {
-        WARN("balance already running\n");
-        return STATUS_DEVICE_NOT_READY;
-    }
-
     if (Vcb->readonly)
         return STATUS_MEDIA_WRITE_PROTECTED;
 
@@ -3579,6 +3886,20 @@ NTSTATUS start_balance(device_extension* Vcb, void* data, ULONG length, KPROCESS
         }
     }
 
+    stop_auto_compact_and_lock(Vcb);
+
+    if (Vcb->scrub.thread) {
+        ExReleaseResourceLite(&Vcb->tree_lock);
+        WARN("cannot start balance while scrub running\n");
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (Vcb->balance.thread) {
+        ExReleaseResourceLite(&Vcb->tree_lock);
+        WARN("balance already running\n");
+        return STATUS_DEVICE_NOT_READY;
+    }
+
     RtlCopyMemory(&Vcb->balance.opts[BALANCE_OPTS_DATA], &bsb->opts[BALANCE_OPTS_DATA], sizeof(btrfs_balance_opts));
     RtlCopyMemory(&Vcb->balance.opts[BALANCE_OPTS_METADATA], &bsb->opts[BALANCE_OPTS_METADATA], sizeof(btrfs_balance_opts));
     RtlCopyMemory(&Vcb->balance.opts[BALANCE_OPTS_SYSTEM], &bsb->opts[BALANCE_OPTS_SYSTEM], sizeof(btrfs_balance_opts));
@@ -3589,7 +3910,16 @@ NTSTATUS start_balance(device_extension* Vcb, void* data, ULONG length, KPROCESS
     Vcb->balance.status = STATUS_SUCCESS;
     KeInitializeEvent(&Vcb->balance.event, NotificationEvent, !Vcb->balance.paused);
 
+    // older callers don't pass a throttle
+    init_throttle(&Vcb->balance.throttle, length >= sizeof(btrfs_start_balance) ? &bsb->throttle : NULL);
+
+    Vcb->balance.stopping = FALSE;
+    KeInitializeEvent(&Vcb->balance.finished, NotificationEvent, FALSE);
+
     Status = PsCreateSystemThread(&Vcb->balance.thread, 0, NULL, NULL, NULL, balance_thread, Vcb);
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
     if (!NT_SUCCESS(Status)) {
         ERR("PsCreateSystemThread returned %08x\n", Status);
         return Status;
@@ -3669,6 +3999,11 @@ NTSTATUS look_for_balance_item(_Requires_lock_held_(_Curr_->tree_lock) device_ex
     Vcb->balance.status = STATUS_SUCCESS;
     KeInitializeEvent(&Vcb->balance.event, NotificationEvent, !Vcb->balance.paused);
 
+    init_throttle(&Vcb->balance.throttle, NULL);
+
+    Vcb->balance.stopping = FALSE;
+    KeInitializeEvent(&Vcb->balance.finished, NotificationEvent, FALSE);
+
     Status = PsCreateSystemThread(&Vcb->balance.thread, 0, NULL, NULL, NULL, balance_thread, Vcb);
     if (!NT_SUCCESS(Status)) {
         ERR("PsCreateSystemThread returned %08x\n", Status);
@@ -3686,6 +4021,7 @@ NTSTATUS query_balance(device_extension* Vcb, void* data, ULONG length) {
 
     if (!Vcb->balance.thread) {
         bqb->status = BTRFS_BALANCE_STOPPED;
+        RtlZeroMemory(&bqb->throttle, sizeof(btrfs_throttle_state));
 
         if (!NT_SUCCESS(Vcb->balance.status)) {
             bqb->status |= BTRFS_BALANCE_ERROR;
@@ -3703,6 +4039,9 @@ NTSTATUS query_balance(device_extension* Vcb, void* data, ULONG length) {
     if (Vcb->balance.shrinking)
         bqb->status |= BTRFS_BALANCE_SHRINKING;
 
+    if (Vcb->balance.compacting)
+        bqb->status |= BTRFS_BALANCE_COMPACTING;
+
     if (!NT_SUCCESS(Vcb->balance.status))
         bqb->status |= BTRFS_BALANCE_ERROR;
 
@@ -3713,6 +4052,8 @@ NTSTATUS query_balance(device_extension* Vcb, void* data, ULONG length) {
     RtlCopyMemory(&bqb->metadata_opts, &Vcb->balance.opts[BALANCE_OPTS_METADATA], sizeof(btrfs_balance_opts));
     RtlCopyMemory(&bqb->system_opts, &Vcb->balance.opts[BALANCE_OPTS_SYSTEM], sizeof(btrfs_balance_opts));
 
+    get_throttle_state(Vcb, &Vcb->balance.throttle, &bqb->throttle);
+
     return STATUS_SUCCESS;
 }
 
@@ -3784,7 +4125,7 @@ NTSTATUS remove_device(device_extension* Vcb, void* data, ULONG length, KPROCESS
 
     devid = *(UINT64*)data;
 
-    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+    stop_auto_compact_and_lock(Vcb);
 
     if (Vcb->readonly) {
         ExReleaseResourceLite(&Vcb->tree_lock);
@@ -3844,9 +4185,8 @@ NTSTATUS remove_device(device_extension* Vcb, void* data, ULONG length, KPROCESS
         }
     }
 
-    ExReleaseResourceLite(&Vcb->tree_lock);
-
     if (Vcb->balance.thread) {
+        ExReleaseResourceLite(&Vcb->tree_lock);
         WARN("balance already running\n");
         return STATUS_DEVICE_NOT_READY;
     }
@@ -3866,12 +4206,191 @@ NTSTATUS remove_device(device_extension* Vcb, void* data, ULONG length, KPROCESS
     Vcb->balance.status = STATUS_SUCCESS;
     KeInitializeEvent(&Vcb->balance.event, NotificationEvent, !Vcb->balance.paused);
 
+    init_throttle(&Vcb->balance.throttle, NULL);
+
+    Vcb->balance.stopping = FALSE;
+    KeInitializeEvent(&Vcb->balance.finished, NotificationEvent, FALSE);
+
     Status = PsCreateSystemThread(&Vcb->balance.thread, 0, NULL, NULL, NULL, balance_thread, Vcb);
     if (!NT_SUCCESS(Status)) {
         ERR("PsCreateSystemThread returned %08x\n", Status);
         dev->reloc = FALSE;
+    }
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    if (!NT_SUCCESS(Status))
         return Status;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS throttle_balance(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode) {
+    if (!data || length < sizeof(btrfs_throttle))
+        return STATUS_INVALID_PARAMETER;
+
+    if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_MANAGE_VOLUME_PRIVILEGE), processor_mode))
+        return STATUS_PRIVILEGE_NOT_HELD;
+
+    if (!Vcb->balance.thread)
+        return STATUS_DEVICE_NOT_READY;
+
+    set_throttle(&Vcb->balance.throttle, (btrfs_throttle*)data);
+
+    return STATUS_SUCCESS;
+}
+
+// Called from the flush thread. If the volume has been idle for a while and is short of
+// unallocated space, starts a balance of the data chunks whose usage is below the AutoCompact
+// threshold. This runs under a fixed bandwidth budget and doesn't leave a balance item behind.
+void check_auto_compact(device_extension* Vcb) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    UINT32 threshold = min(Vcb->options.auto_compact, 100);
+    ULONG candidates = 0;
+    btrfs_throttle throttle;
+
+    if (threshold == 0 || Vcb->readonly || Vcb->locked || Vcb->removing || Vcb->balance.thread || Vcb->scrub.thread)
+        return;
+
+    if (auto_compact_done(Vcb))
+        return;
+
+    // check again under tree_lock, as a user balance or scrub may have been started in the meantime
+    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
+
+    // lock_volume sets Vcb->locked before dropping locks_pending, so check them in this order
+    if (Vcb->locks_pending > 0 || Vcb->locked || Vcb->readonly || Vcb->removing || Vcb->balance.thread || Vcb->scrub.thread) {
+        ExReleaseResourceLite(&Vcb->tree_lock);
+        return;
     }
 
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, TRUE);
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+
+        if (!c->readonly && !c->reloc && c->chunk_item->type == Vcb->data_flags && c->used * 100 / c->chunk_item->size < threshold)
+            candidates++;
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+
+    // moving a single chunk would only fill up another one
+    if (candidates < 2) {
+        ExReleaseResourceLite(&Vcb->tree_lock);
+        return;
+    }
+
+    RtlZeroMemory(Vcb->balance.opts, sizeof(btrfs_balance_opts) * 3);
+
+    Vcb->balance.opts[BALANCE_OPTS_DATA].flags = BTRFS_BALANCE_OPTS_ENABLED | BTRFS_BALANCE_OPTS_USAGE;
+    Vcb->balance.opts[BALANCE_OPTS_DATA].usage_start = 0;
+    Vcb->balance.opts[BALANCE_OPTS_DATA].usage_end = (UINT8)(threshold - 1);
+
+    Vcb->balance.paused = FALSE;
+    Vcb->balance.removing = FALSE;
+    Vcb->balance.shrinking = FALSE;
+    Vcb->balance.compacting = TRUE;
+    Vcb->balance.status = STATUS_SUCCESS;
+    KeInitializeEvent(&Vcb->balance.event, NotificationEvent, !Vcb->balance.paused);
+
+    throttle.bandwidth = Vcb->options.auto_compact_bandwidth;
+    throttle.iops = 0;
+    throttle.latency_target = COMPACT_LATENCY_TARGET;
+
+    init_throttle(&Vcb->balance.throttle, &throttle);
+
+    Vcb->balance.compact.runs++;
+    KeQuerySystemTime(&Vcb->balance.compact.last_start);
+
+    WARN("starting automatic compaction: %u data chunks below %u%% usage\n", candidates, threshold);
+
+    Vcb->balance.stopping = FALSE;
+    KeInitializeEvent(&Vcb->balance.finished, NotificationEvent, FALSE);
+
+    Status = PsCreateSystemThread(&Vcb->balance.thread, 0, NULL, NULL, NULL, balance_thread, Vcb);
+    if (!NT_SUCCESS(Status)) {
+        ERR("PsCreateSystemThread returned %08x\n", Status);
+        Vcb->balance.compacting = FALSE;
+    }
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+}
+
+// Compaction is opportunistic, so anything else that wants the balance thread takes precedence.
+// Must not be called with tree_lock held.
+void stop_auto_compact(device_extension* Vcb) {
+    UINT64 run;
+    LARGE_INTEGER timeout;
+    BOOL done;
+
+    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
+
+    if (!Vcb->balance.thread || !Vcb->balance.compacting) {
+        ExReleaseResourceLite(&Vcb->tree_lock);
+        return;
+    }
+
+    run = Vcb->balance.compact.runs;
+
+    Vcb->balance.paused = FALSE;
+    Vcb->balance.stopping = TRUE;
+    KeSetEvent(&Vcb->balance.event, 0, FALSE);
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    // Someone else may start a new balance as soon as ours finishes, reinitializing the finished
+    // event, so don't rely on it alone - recheck now and again whether our run is still going.
+    timeout.QuadPart = -10000000; // 1 second
+
+    do {
+        KeWaitForSingleObject(&Vcb->balance.finished, Executive, KernelMode, FALSE, &timeout);
+
+        ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+        done = !Vcb->balance.thread || !Vcb->balance.compacting || Vcb->balance.compact.runs != run;
+        ExReleaseResourceLite(&Vcb->tree_lock);
+    } while (!done);
+}
+
+// Stops any automatic compaction and returns holding tree_lock exclusively, so that the caller can
+// check for a running balance or scrub and start its own without the flush thread getting in first.
+_Acquires_exclusive_lock_(Vcb->tree_lock)
+void stop_auto_compact_and_lock(device_extension* Vcb) {
+    while (TRUE) {
+        stop_auto_compact(Vcb);
+
+        ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
+
+        if (!Vcb->balance.thread || !Vcb->balance.compacting)
+            return;
+
+        ExReleaseResourceLite(&Vcb->tree_lock);
+    }
+}
+
+NTSTATUS query_compact(device_extension* Vcb, void* data, ULONG length) {
+    btrfs_query_compact* bqc = (btrfs_query_compact*)data;
+
+    if (length < sizeof(btrfs_query_compact) || !data)
+        return STATUS_INVALID_PARAMETER;
+
+    bqc->threshold = min(Vcb->options.auto_compact, 100);
+    bqc->bandwidth = Vcb->options.auto_compact_bandwidth;
+    bqc->running = Vcb->balance.thread && Vcb->balance.compacting;
+    bqc->runs = Vcb->balance.compact.runs;
+    bqc->chunks_relocated = Vcb->balance.compact.chunks_relocated;
+    bqc->bytes_relocated = Vcb->balance.compact.bytes_relocated;
+    bqc->last_start = Vcb->balance.compact.last_start;
+    bqc->last_finish = Vcb->balance.compact.last_finish;
+    bqc->total_size = Vcb->superblock.total_bytes;
+
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+    bqc->unallocated = get_unallocated_space(Vcb);
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
     return STATUS_SUCCESS;
 }
@@ -60,6 +60,7 @@ PDEVICE_OBJECT master_devobj;
 BOOL have_sse42 = FALSE, have_sse2 = FALSE;
 UINT64 num_reads = 0;
 LIST_ENTRY uid_map_list, gid_map_list;
+LIST_ENTRY uid_map_hash[MAPPING_HASH_SIZE], uid_map_sid_hash[MAPPING_HASH_SIZE], gid_map_sid_hash[MAPPING_HASH_SIZE];
 LIST_ENTRY VcbList;
 ERESOURCE global_loading_lock;
 UINT32 debug_log_level = 0;
@@ -76,6 +77,10 @@ UINT32 mount_no_trim = 0;
 UINT32 mount_clear_cache = 0;
 UINT32 mount_allow_degraded = 0;
 UINT32 mount_readonly = 0;
+UINT32 mount_scrub_queue_depth = 1;
+UINT32 mount_balance_concurrency = 1;
+UINT32 mount_auto_compact = 0;
+UINT32 mount_auto_compact_bandwidth = 0x800000;
 UINT32 no_pnp = 0;
 BOOL log_started = FALSE;
 UNICODE_STRING log_device, log_file, registry_path;
@@ -93,6 +98,8 @@ HANDLE degraded_wait_handle = NULL, mountmgr_thread_handle = NULL;
 BOOL degraded_wait = TRUE;
 KEVENT mountmgr_thread_event;
 BOOL shutting_down = FALSE;
+PKEVENT low_memory_event = NULL;
+HANDLE low_memory_handle = NULL;
 
 #ifdef _DEBUG
 PFILE_OBJECT comfo = NULL;
@@ -283,21 +290,10 @@ static void DriverUnload(_In_ PDRIVER_OBJECT DriverObject) {
     IoDeleteSymbolicLink(&dosdevice_nameW);
     IoDeleteDevice(DriverObject->DeviceObject);
 
-    while (!IsListEmpty(&uid_map_list)) {
-        LIST_ENTRY* le = RemoveHeadList(&uid_map_list);
-        uid_map* um = CONTAINING_RECORD(le, uid_map, listentry);
+    clear_user_mappings();
+    clear_group_mappings();
 
-        ExFreePool(um->sid);
-
-        ExFreePool(um);
-    }
-
-    while (!IsListEmpty(&gid_map_list)) {
-        gid_map* gm = CONTAINING_RECORD(RemoveHeadList(&gid_map_list), gid_map, listentry);
-
-        ExFreePool(gm->sid);
-        ExFreePool(gm);
-    }
+    uninit_comp_contexts();
 
     // FIXME - free volumes and their devpaths
 
@@ -309,6 +305,9 @@ static void DriverUnload(_In_ PDRIVER_OBJECT DriverObject) {
         ZwClose(log_handle);
 #endif
 
+    if (low_memory_handle)
+        ZwClose(low_memory_handle);
+
     ExDeleteResourceLite(&global_loading_lock);
     ExDeleteResourceLite(&pdo_list_lock);
 
@@ -369,7 +368,7 @@ static BOOL get_last_inode(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock
 }
 
 _Success_(return)
-static BOOL extract_xattr(_In_reads_bytes_(size) void* item, _In_ USHORT size, _In_z_ char* name, _Out_ UINT8** data, _Out_ UINT16* datalen) {
+BOOL extract_xattr(_In_reads_bytes_(size) void* item, _In_ USHORT size, _In_z_ char* name, _Out_ UINT8** data, _Out_ UINT16* datalen) {
     DIR_ITEM* xa = (DIR_ITEM*)item;
     USHORT xasize;
 
@@ -940,6 +939,24 @@ static NTSTATUS read_completion(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp,
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
+_Ret_maybenull_
+root* find_root(_In_ device_extension* Vcb, _In_ UINT64 id) {
+    LIST_ENTRY* head = &Vcb->roots_hash[id % ROOTS_HASH_SIZE];
+    LIST_ENTRY* le;
+
+    le = head->Flink;
+    while (le != head) {
+        root* r = CONTAINING_RECORD(le, root, list_entry_hash);
+
+        if (r->id == id)
+            return r;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
 NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ UINT64 id,
                      _Out_ root** rootptr, _In_ BOOL no_tree, _In_ UINT64 offset, _In_opt_ PIRP Irp) {
     NTSTATUS Status;
@@ -973,6 +990,7 @@ NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) devi
         t->is_unique = TRUE;
         t->uniqueness_determined = TRUE;
         t->buf = NULL;
+        t->item_array = NULL;
     }
 
     ri = ExAllocatePoolWithTag(PagedPool, sizeof(ROOT_ITEM), ALLOC_TAG);
@@ -1022,6 +1040,7 @@ NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) devi
     ExInitializeResourceLite(&r->nonpaged->load_tree_lock);
 
     InsertTailList(&Vcb->roots, &r->list_entry);
+    InsertTailList(&Vcb->roots_hash[id % ROOTS_HASH_SIZE], &r->list_entry_hash);
 
     if (!no_tree) {
         RtlZeroMemory(&t->header, sizeof(tree_header));
@@ -1426,25 +1445,13 @@ void mark_fileref_dirty(_In_ file_ref* fileref) {
     fileref->fcb->Vcb->need_write = TRUE;
 }
 
-#ifdef DEBUG_FCB_REFCOUNTS
-void _free_fcb(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _Inout_ fcb* fcb, _In_ const char* func) {
-#else
-void free_fcb(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _Inout_ fcb* fcb) {
-#endif
-    LONG rc;
-
-    rc = InterlockedDecrement(&fcb->refcount);
-
-#ifdef DEBUG_FCB_REFCOUNTS
-#ifdef DEBUG_LONG_MESSAGES
-    ERR("fcb %p: refcount now %i (subvol %llx, inode %llx)\n", fcb, rc, fcb->subvol ? fcb->subvol->id : 0, fcb->inode);
-#else
-    ERR("fcb %p: refcount now %i (subvol %llx, inode %llx)\n", fcb, rc, fcb->subvol ? fcb->subvol->id : 0, fcb->inode);
-#endif
-#endif
-
-    if (rc > 0)
-        return;
+static void destroy_fcb(_In_ device_extension* Vcb, _Inout_ fcb* fcb) {
+    if (fcb->list_entry_lru.Flink) {
+        ExAcquireResourceExclusiveLite(&Vcb->fcb_lru_lock, TRUE);
+        RemoveEntryList(&fcb->list_entry_lru);
+        Vcb->num_fcb_lru--;
+        ExReleaseResourceLite(&Vcb->fcb_lru_lock);
+    }
 
     if (fcb->list_entry.Flink)
         RemoveEntryList(&fcb->list_entry);
@@ -1458,8 +1465,7 @@ void free_fcb(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_exten
 
     ExFreeToNPagedLookasideList(&Vcb->fcb_np_lookaside, fcb->nonpaged);
 
-    if (fcb->sd)
-        ExFreePool(fcb->sd);
+    release_sd(Vcb, fcb->sd, fcb->sd_interned);
 
     if (fcb->adsxattr.Buffer)
         ExFreePool(fcb->adsxattr.Buffer);
@@ -1512,6 +1518,10 @@ void free_fcb(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_exten
         ExFreePool(dc->utf8.Buffer);
         ExFreePool(dc->name.Buffer);
         ExFreePool(dc->name_uc.Buffer);
+
+        if (dc->atts)
+            ExFreePool(dc->atts);
+
         ExFreePool(dc);
     }
 
@@ -1521,12 +1531,65 @@ void free_fcb(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_exten
     if (fcb->hash_ptrs_uc)
         ExFreePool(fcb->hash_ptrs_uc);
 
+    if (fcb->neg_cache)
+        ExFreePool(fcb->neg_cache);
+
     FsRtlUninitializeFileLock(&fcb->lock);
 
     if (fcb->pool_type == NonPagedPool)
         ExFreePool(fcb);
     else
         ExFreeToPagedLookasideList(&Vcb->fcb_lookaside, fcb);
+}
+
+#ifdef DEBUG_FCB_REFCOUNTS
+void _free_fcb(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _Inout_ fcb* fcb, _In_ const char* func) {
+#else
+void free_fcb(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _Inout_ fcb* fcb) {
+#endif
+    LONG rc;
+
+    rc = InterlockedDecrement(&fcb->refcount);
+
+#ifdef DEBUG_FCB_REFCOUNTS
+#ifdef DEBUG_LONG_MESSAGES
+    ERR("fcb %p: refcount now %i (subvol %llx, inode %llx)\n", fcb, rc, fcb->subvol ? fcb->subvol->id : 0, fcb->inode);
+#else
+    ERR("fcb %p: refcount now %i (subvol %llx, inode %llx)\n", fcb, rc, fcb->subvol ? fcb->subvol->id : 0, fcb->inode);
+#endif
+#endif
+
+    if (rc > 0)
+        return;
+
+    // Rather than freeing clean fcbs straight away, keep the most recently used ones in their subvol's list
+    // so open_fcb can find them again. Dirty fcbs hold a reference, so anything that gets here is clean.
+    if (!Vcb->removing && fcb->subvol && fcb->subvol != Vcb->root_root && !fcb->deleted && !fcb->ads &&
+        fcb->list_entry.Flink && fcb->list_entry_all.Flink) {
+        struct _fcb* victim = NULL;
+
+        ExAcquireResourceExclusiveLite(&Vcb->fcb_lru_lock, TRUE);
+
+        if (!fcb->list_entry_lru.Flink) {
+            InsertTailList(&Vcb->fcb_lru, &fcb->list_entry_lru);
+            Vcb->num_fcb_lru++;
+        }
+
+        if (Vcb->num_fcb_lru > FCB_LRU_MAX) {
+            victim = CONTAINING_RECORD(RemoveHeadList(&Vcb->fcb_lru), struct _fcb, list_entry_lru);
+            victim->list_entry_lru.Flink = NULL;
+            Vcb->num_fcb_lru--;
+        }
+
+        ExReleaseResourceLite(&Vcb->fcb_lru_lock);
+
+        if (victim && victim->refcount == 0)
+            destroy_fcb(Vcb, victim);
+
+        return;
+    }
+
+    destroy_fcb(Vcb, fcb);
 
 #ifdef DEBUG_FCB_REFCOUNTS
 #ifdef DEBUG_LONG_MESSAGES
@@ -1537,6 +1600,59 @@ void free_fcb(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_exten
 #endif
 }
 
+void revive_fcb(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _In_ fcb* fcb) {
+    if (!fcb->list_entry_lru.Flink)
+        return;
+
+    ExAcquireResourceExclusiveLite(&Vcb->fcb_lru_lock, TRUE);
+
+    if (fcb->list_entry_lru.Flink) {
+        RemoveEntryList(&fcb->list_entry_lru);
+        fcb->list_entry_lru.Flink = NULL;
+        Vcb->num_fcb_lru--;
+
+#ifdef DEBUG_STATS
+        Vcb->stats.fcb_revives++;
+#endif
+    }
+
+    ExReleaseResourceLite(&Vcb->fcb_lru_lock);
+}
+
+// frees the unreferenced fcbs we've been holding on to, either all of them or just those in subvol
+void evict_fcbs(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _In_opt_ root* subvol) {
+    LIST_ENTRY victims, *le;
+
+    InitializeListHead(&victims);
+
+    ExAcquireResourceExclusiveLite(&Vcb->fcb_lru_lock, TRUE);
+
+    le = Vcb->fcb_lru.Flink;
+    while (le != &Vcb->fcb_lru) {
+        LIST_ENTRY* le2 = le->Flink;
+        fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_lru);
+
+        if (!subvol || fcb->subvol == subvol) {
+            RemoveEntryList(&fcb->list_entry_lru);
+            InsertTailList(&victims, &fcb->list_entry_lru);
+            Vcb->num_fcb_lru--;
+        }
+
+        le = le2;
+    }
+
+    ExReleaseResourceLite(&Vcb->fcb_lru_lock);
+
+    while (!IsListEmpty(&victims)) {
+        fcb* fcb = CONTAINING_RECORD(RemoveHeadList(&victims), struct _fcb, list_entry_lru);
+
+        fcb->list_entry_lru.Flink = NULL;
+
+        if (fcb->refcount == 0)
+            destroy_fcb(Vcb, fcb);
+    }
+}
+
 void free_fileref(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _Inout_ file_ref* fr) {
     LONG rc;
 
@@ -1667,6 +1783,10 @@ static NTSTATUS close_file(_In_ PFILE_OBJECT FileObject, _In_ PIRP Irp) {
 
     Vcb = fcb->Vcb;
 
+    // Most closes don't drop the last reference, so avoid serializing them all on fcb_lock
+    if (release_ref_unless_last(fileref ? &fileref->refcount : &fcb->refcount))
+        return STATUS_SUCCESS;
+
     acquire_fcb_lock_exclusive(Vcb);
 
     if (fileref)
@@ -1754,6 +1874,8 @@ void uninit(_In_ device_extension* Vcb, _In_ BOOL flush) {
         ExReleaseResourceLite(&Vcb->tree_lock);
     }
 
+    free_tree_readaheads(Vcb, TRUE);
+
     for (i = 0; i < Vcb->calcthreads.num_threads; i++) {
         Vcb->calcthreads.threads[i].quit = TRUE;
     }
@@ -1776,6 +1898,7 @@ void uninit(_In_ device_extension* Vcb, _In_ BOOL flush) {
     acquire_fcb_lock_exclusive(Vcb);
     free_fcb(Vcb, Vcb->volume_fcb);
     free_fcb(Vcb, Vcb->dummy_fcb);
+    evict_fcbs(Vcb, NULL);
     release_fcb_lock(Vcb);
 
     if (Vcb->root_file)
@@ -1853,6 +1976,8 @@ void uninit(_In_ device_extension* Vcb, _In_ BOOL flush) {
         ExFreePool(dev);
     }
 
+    free_decomp_cache(Vcb);
+
     ExAcquireResourceExclusiveLite(&Vcb->scrub.stats_lock, TRUE);
     while (!IsListEmpty(&Vcb->scrub.errors)) {
         scrub_error* err = CONTAINING_RECORD(RemoveHeadList(&Vcb->scrub.errors), scrub_error, list_entry);
@@ -1864,11 +1989,18 @@ void uninit(_In_ device_extension* Vcb, _In_ BOOL flush) {
     ExDeleteResourceLite(&Vcb->fcb_lock);
     ExDeleteResourceLite(&Vcb->load_lock);
     ExDeleteResourceLite(&Vcb->tree_lock);
+    ExDeleteResourceLite(&Vcb->trees_lock);
+    ExDeleteResourceLite(&Vcb->tree_readahead_lock);
     ExDeleteResourceLite(&Vcb->chunk_lock);
     ExDeleteResourceLite(&Vcb->dirty_fcbs_lock);
+    ExDeleteResourceLite(&Vcb->fcb_lru_lock);
+    ExDeleteResourceLite(&Vcb->sd_hash_lock);
+    ExDeleteResourceLite(&Vcb->decomp_cache_lock);
     ExDeleteResourceLite(&Vcb->dirty_filerefs_lock);
     ExDeleteResourceLite(&Vcb->dirty_subvols_lock);
     ExDeleteResourceLite(&Vcb->scrub.stats_lock);
+    ExDeleteResourceLite(&Vcb->scrub.throttle.lock);
+    ExDeleteResourceLite(&Vcb->balance.throttle.lock);
     ExDeleteResourceLite(&Vcb->send_load_lock);
 
     ExDeletePagedLookasideList(&Vcb->tree_data_lookaside);
@@ -2010,6 +2142,7 @@ NTSTATUS delete_fileref(_In_ file_ref* fileref, _In_opt_ PFILE_OBJECT FileObject
                 // FIXME - we need a lock here
 
                 RemoveEntryList(&fileref->fcb->subvol->list_entry);
+                RemoveEntryList(&fileref->fcb->subvol->list_entry_hash);
 
                 InsertTailList(&fileref->fcb->Vcb->drop_roots, &fileref->fcb->subvol->list_entry);
 
@@ -2055,6 +2188,10 @@ NTSTATUS delete_fileref(_In_ file_ref* fileref, _In_opt_ PFILE_OBJECT FileObject
 
         ExFreePool(fileref->dc->name.Buffer);
         ExFreePool(fileref->dc->name_uc.Buffer);
+
+        if (fileref->dc->atts)
+            ExFreePool(fileref->dc->atts);
+
         ExFreePool(fileref->dc);
 
         fileref->dc = NULL;
@@ -2304,11 +2441,25 @@ ULONG get_file_attributes(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_ex
     UINT16 ealen;
 
     if (!ignore_xa && get_xattr(Vcb, r, inode, EA_DOSATTRIB, EA_DOSATTRIB_HASH, (UINT8**)&eaval, &ealen, Irp)) {
-        ULONG dosnum = 0;
+        att = get_file_attributes_from_dosattrib(r, inode, type, dotfile, eaval, ealen);
 
-        if (get_file_attributes_from_xattr(eaval, ealen, &dosnum)) {
+        if (eaval)
             ExFreePool(eaval);
+    } else
+        att = get_file_attributes_from_dosattrib(r, inode, type, dotfile, NULL, 0);
 
+    return att;
+}
+
+// eaval is the value of the DOSATTRIB xattr, or NULL if the inode doesn't have one
+ULONG get_file_attributes_from_dosattrib(_In_ root* r, _In_ UINT64 inode, _In_ UINT8 type, _In_ BOOL dotfile,
+                                         _In_reads_bytes_opt_(ealen) char* eaval, _In_ UINT16 ealen) {
+    ULONG att;
+
+    if (eaval) {
+        ULONG dosnum = 0;
+
+        if (get_file_attributes_from_xattr(eaval, ealen, &dosnum)) {
             if (type == BTRFS_TYPE_DIRECTORY)
                 dosnum |= FILE_ATTRIBUTE_DIRECTORY;
             else if (type == BTRFS_TYPE_SYMLINK)
@@ -2326,8 +2477,6 @@ ULONG get_file_attributes(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_ex
 
             return dosnum;
         }
-
-        ExFreePool(eaval);
     }
 
     switch (type) {
@@ -2621,6 +2770,7 @@ static NTSTATUS add_root(_Inout_ device_extension* Vcb, _In_ UINT64 id, _In_ UIN
     }
 
     InsertTailList(&Vcb->roots, &r->list_entry);
+    InsertTailList(&Vcb->roots_hash[id % ROOTS_HASH_SIZE], &r->list_entry_hash);
 
     switch (r->id) {
         case BTRFS_ROOT_ROOT:
@@ -3546,21 +3696,15 @@ static NTSTATUS load_sys_chunks(_In_ device_extension* Vcb) {
 
 _Ret_maybenull_
 static root* find_default_subvol(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_opt_ PIRP Irp) {
-    LIST_ENTRY* le;
+    root* r;
 
     static char fn[] = "default";
     static UINT32 crc32 = 0x8dbfc2d2;
 
     if (Vcb->options.subvol_id != 0) {
-        le = Vcb->roots.Flink;
-        while (le != &Vcb->roots) {
-            root* r = CONTAINING_RECORD(le, root, list_entry);
-
-            if (r->id == Vcb->options.subvol_id)
-                return r;
-
-            le = le->Flink;
-        }
+        r = find_root(Vcb, Vcb->options.subvol_id);
+        if (r)
+            return r;
     }
 
     if (Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_DEFAULT_SUBVOL) {
@@ -3606,31 +3750,15 @@ static root* find_default_subvol(_In_ _Requires_lock_held_(_Curr_->tree_lock) de
             goto end;
         }
 
-        le = Vcb->roots.Flink;
-        while (le != &Vcb->roots) {
-            root* r = CONTAINING_RECORD(le, root, list_entry);
-
-            if (r->id == di->key.obj_id)
-                return r;
-
-            le = le->Flink;
-        }
+        r = find_root(Vcb, di->key.obj_id);
+        if (r)
+            return r;
 
         ERR("could not find root %llx, using default instead\n", di->key.obj_id);
     }
 
 end:
-    le = Vcb->roots.Flink;
-    while (le != &Vcb->roots) {
-        root* r = CONTAINING_RECORD(le, root, list_entry);
-
-        if (r->id == BTRFS_ROOT_FSTREE)
-            return r;
-
-        le = le->Flink;
-    }
-
-    return NULL;
+    return find_root(Vcb, BTRFS_ROOT_FSTREE);
 }
 
 void init_file_cache(_In_ PFILE_OBJECT FileObject, _In_ CC_FILE_SIZES* ccfs) {
@@ -3934,6 +4062,7 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     volume_child* vc;
     BOOL no_pnp = FALSE;
     UINT64 readobjsize;
+    ULONG i;
 
     TRACE("(%p, %p)\n", DeviceObject, Irp);
 
@@ -4068,9 +4197,20 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     ExInitializeResourceLite(&Vcb->fcb_lock);
     ExInitializeResourceLite(&Vcb->chunk_lock);
     ExInitializeResourceLite(&Vcb->dirty_fcbs_lock);
+    ExInitializeResourceLite(&Vcb->fcb_lru_lock);
+    ExInitializeResourceLite(&Vcb->sd_hash_lock);
+    ExInitializeResourceLite(&Vcb->decomp_cache_lock);
     ExInitializeResourceLite(&Vcb->dirty_filerefs_lock);
     ExInitializeResourceLite(&Vcb->dirty_subvols_lock);
     ExInitializeResourceLite(&Vcb->scrub.stats_lock);
+    ExInitializeResourceLite(&Vcb->scrub.throttle.lock);
+    ExInitializeResourceLite(&Vcb->balance.throttle.lock);
+
+    ExInitializeResourceLite(&Vcb->trees_lock);
+
+    InitializeListHead(&Vcb->tree_readaheads);
+    ExInitializeResourceLite(&Vcb->tree_readahead_lock);
+    KeInitializeEvent(&Vcb->tree_readaheads_finished, NotificationEvent, TRUE);
 
     ExInitializeResourceLite(&Vcb->load_lock);
     ExAcquireResourceExclusiveLite(&Vcb->load_lock, TRUE);
@@ -4168,6 +4308,14 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     InitializeListHead(&Vcb->roots);
     InitializeListHead(&Vcb->drop_roots);
 
+    for (i = 0; i < ROOTS_HASH_SIZE; i++) {
+        InitializeListHead(&Vcb->roots_hash[i]);
+    }
+
+    for (i = 0; i < SD_HASH_SIZE; i++) {
+        InitializeListHead(&Vcb->sd_hash[i]);
+    }
+
     Vcb->log_to_phys_loaded = FALSE;
 
     add_root(Vcb, BTRFS_ROOT_CHUNK, Vcb->superblock.chunk_tree_addr, Vcb->superblock.chunk_root_generation, NULL);
@@ -4189,6 +4337,8 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     InitializeListHead(&Vcb->trees);
     InitializeListHead(&Vcb->trees_hash);
     InitializeListHead(&Vcb->all_fcbs);
+    InitializeListHead(&Vcb->fcb_lru);
+    InitializeListHead(&Vcb->decomp_cache);
     InitializeListHead(&Vcb->dirty_fcbs);
     InitializeListHead(&Vcb->dirty_filerefs);
     InitializeListHead(&Vcb->dirty_subvols);
@@ -4196,6 +4346,7 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
 
     InitializeListHead(&Vcb->DirNotifyList);
     InitializeListHead(&Vcb->scrub.errors);
+    InitializeListHead(&Vcb->scrub.chunks);
 
     FsRtlNotifyInitializeSync(&Vcb->NotifySync);
 
@@ -4483,6 +4634,10 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND)
         WARN("look_for_balance_item returned %08x\n", Status);
 
+    Status = look_for_scrub_item(Vcb);
+    if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND)
+        WARN("look_for_scrub_item returned %08x\n", Status);
+
     Status = STATUS_SUCCESS;
 
     if (vde)
@@ -4532,14 +4687,32 @@ exit2:
                 release_fcb_lock(Vcb);
             }
 
+            if (Vcb->fcb_lru.Flink) {
+                acquire_fcb_lock_exclusive(Vcb);
+                evict_fcbs(Vcb, NULL);
+                release_fcb_lock(Vcb);
+            }
+
+            free_tree_readaheads(Vcb, TRUE);
+
+            if (Vcb->decomp_cache.Flink)
+                free_decomp_cache(Vcb);
+
             ExDeleteResourceLite(&Vcb->tree_lock);
             ExDeleteResourceLite(&Vcb->load_lock);
             ExDeleteResourceLite(&Vcb->fcb_lock);
+            ExDeleteResourceLite(&Vcb->trees_lock);
+            ExDeleteResourceLite(&Vcb->tree_readahead_lock);
             ExDeleteResourceLite(&Vcb->chunk_lock);
             ExDeleteResourceLite(&Vcb->dirty_fcbs_lock);
+            ExDeleteResourceLite(&Vcb->fcb_lru_lock);
+            ExDeleteResourceLite(&Vcb->sd_hash_lock);
+            ExDeleteResourceLite(&Vcb->decomp_cache_lock);
             ExDeleteResourceLite(&Vcb->dirty_filerefs_lock);
             ExDeleteResourceLite(&Vcb->dirty_subvols_lock);
             ExDeleteResourceLite(&Vcb->scrub.stats_lock);
+            ExDeleteResourceLite(&Vcb->scrub.throttle.lock);
+            ExDeleteResourceLite(&Vcb->balance.throttle.lock);
 
             if (Vcb->devices.Flink) {
                 while (!IsListEmpty(&Vcb->devices)) {
@@ -5367,19 +5540,28 @@ NTSTATUS DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING Regi
     PDEVICE_OBJECT DeviceObject;
     UNICODE_STRING device_nameW;
     UNICODE_STRING dosdevice_nameW;
+    UNICODE_STRING low_memory_name;
     control_device_extension* cde;
     HANDLE regh;
     OBJECT_ATTRIBUTES oa;
-    ULONG dispos;
+    ULONG dispos, i;
 
     InitializeListHead(&uid_map_list);
     InitializeListHead(&gid_map_list);
 
+    for (i = 0; i < MAPPING_HASH_SIZE; i++) {
+        InitializeListHead(&uid_map_hash[i]);
+        InitializeListHead(&uid_map_sid_hash[i]);
+        InitializeListHead(&gid_map_sid_hash[i]);
+    }
+
 #ifdef _DEBUG
     ExInitializeResourceLite(&log_lock);
 #endif
     ExInitializeResourceLite(&mapping_lock);
 
+    init_comp_contexts();
+
     log_device.Buffer = NULL;
     log_device.Length = log_device.MaximumLength = 0;
     log_file.Buffer = NULL;
@@ -5567,6 +5749,12 @@ NTSTATUS DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING Regi
 
     KeInitializeEvent(&mountmgr_thread_event, NotificationEvent, FALSE);
 
+    RtlInitUnicodeString(&low_memory_name, L"\\KernelObjects\\LowMemoryCondition");
+
+    low_memory_event = IoCreateNotificationEvent(&low_memory_name, &low_memory_handle);
+    if (!low_memory_event)
+        WARN("could not open LowMemoryCondition event\n");
+
     Status = PsCreateSystemThread(&mountmgr_thread_handle, 0, NULL, NULL, NULL, mountmgr_thread, NULL);
     if (!NT_SUCCESS(Status))
         WARN("PsCreateSystemThread returned %08x\n", Status);
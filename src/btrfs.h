@@ -81,6 +81,7 @@ static const UINT64 superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0x4
 #define FREE_SPACE_CACHE_ID     0xFFFFFFFFFFFFFFF5
 #define EXTENT_CSUM_ID          0xFFFFFFFFFFFFFFF6
 #define BALANCE_ITEM_ID         0xFFFFFFFFFFFFFFFC
+#define SCRUB_ITEM_ID           0xFFFFFFFFFFFFFF00 // WinBtrfs only - offset of (0,TYPE_DEV_STATS,x) item in dev tree, never a device ID
 
 #define BTRFS_INODE_NODATASUM   0x001
 #define BTRFS_INODE_NODATACOW   0x002
@@ -502,6 +503,24 @@ typedef struct {
     UINT8 reserved[32];
 } BALANCE_ITEM;
 
+#define SCRUB_FLAGS_CANCELLED   0x1
+
+typedef struct {
+    UINT64 chunk;
+    UINT64 offset;
+} SCRUB_ITEM_CHUNK;
+
+typedef struct {
+    UINT64 flags;
+    UINT64 start_time;
+    UINT64 duration;
+    UINT64 data_scrubbed;
+    UINT64 num_errors;
+    UINT64 position; // every chunk below this has been scrubbed
+    UINT32 num_chunks;
+    SCRUB_ITEM_CHUNK chunks[1]; // chunks at or above position which are partly done
+} SCRUB_ITEM;
+
 #define BTRFS_FREE_SPACE_USING_BITMAPS      1
 
 typedef struct {
@@ -537,6 +556,9 @@ typedef struct {
 #define BTRFS_SEND_CMD_UTIMES         20
 #define BTRFS_SEND_CMD_END            21
 #define BTRFS_SEND_CMD_UPDATE_EXTENT  22
+#define BTRFS_SEND_CMD_FALLOCATE      23
+#define BTRFS_SEND_CMD_FILEATTR       24
+#define BTRFS_SEND_CMD_ENCODED_WRITE  25
 
 #define BTRFS_SEND_TLV_UUID             1
 #define BTRFS_SEND_TLV_TRANSID          2
@@ -562,6 +584,18 @@ typedef struct {
 #define BTRFS_SEND_TLV_CLONE_PATH      22
 #define BTRFS_SEND_TLV_CLONE_OFFSET    23
 #define BTRFS_SEND_TLV_CLONE_LENGTH    24
+#define BTRFS_SEND_TLV_FALLOCATE_MODE  25
+#define BTRFS_SEND_TLV_FILEATTR        26
+#define BTRFS_SEND_TLV_UNENCODED_FILE_LEN 27
+#define BTRFS_SEND_TLV_UNENCODED_LEN   28
+#define BTRFS_SEND_TLV_UNENCODED_OFFSET 29
+#define BTRFS_SEND_TLV_COMPRESSION     30
+#define BTRFS_SEND_TLV_ENCRYPTION      31
+
+#define BTRFS_ENCODED_IO_COMPRESSION_NONE   0
+#define BTRFS_ENCODED_IO_COMPRESSION_ZLIB   1
+#define BTRFS_ENCODED_IO_COMPRESSION_ZSTD   2
+#define BTRFS_ENCODED_IO_COMPRESSION_LZO_4K 3 // LZO_8K to LZO_64K follow, for larger sector sizes
 
 #define BTRFS_SEND_MAGIC "btrfs-stream"
 
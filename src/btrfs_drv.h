@@ -95,6 +95,19 @@
 
 #define READ_AHEAD_GRANULARITY COMPRESSED_EXTENT_SIZE // really ought to be a multiple of COMPRESSED_EXTENT_SIZE
 
+#define ROOTS_HASH_SIZE 256
+
+// number of closed fcbs we keep around in case they get opened again
+#define FCB_LRU_MAX 256
+
+#define SD_HASH_SIZE 64
+
+// number of decompressed extents we keep per volume for reads
+#define DECOMP_CACHE_MAX 32
+
+#define TREE_READAHEAD_NODES 8 // number of siblings to read ahead when iterating through a tree
+#define TREE_READAHEAD_MAX 64 // maximum number of tree readaheads to hold at once
+
 #define IO_REPARSE_TAG_LXSS_SYMLINK 0xa000001d // undocumented?
 
 #define BTRFS_VOLUME_PREFIX L"\\Device\\Btrfs{"
@@ -161,6 +174,11 @@ typedef struct _FSCTL_SET_INTEGRITY_INFORMATION_BUFFER {
 #define _Acquires_shared_lock_(a)
 #endif
 
+// Lock order for the trees: Vcb->tree_lock, then a root's load_tree_lock, then Vcb->trees_lock.
+// Holding tree_lock shared lets different roots be loaded in parallel, as each root has its own
+// load_tree_lock; trees_lock only covers the lists of loaded trees that all the roots share.
+// Anything that changes a tree's items still needs tree_lock exclusively.
+
 _Create_lock_level_(tree_lock)
 _Create_lock_level_(fcb_lock)
 _Lock_level_order_(tree_lock, fcb_lock)
@@ -173,6 +191,7 @@ typedef struct _fcb_nonpaged {
     ERESOURCE resource;
     ERESOURCE paging_resource;
     ERESOURCE dir_children_lock;
+    FAST_MUTEX dir_atts_mutex;
 } fcb_nonpaged;
 
 struct _root;
@@ -200,6 +219,26 @@ typedef struct {
 
 struct _file_ref;
 
+// attributes of a directory entry, gathered by query_directory when no fcb is open for it
+typedef struct {
+    UINT64 generation;
+    BOOL missing; // no INODE_ITEM found, so don't look again until the next flush
+    INODE_ITEM inode_item;
+    ULONG atts;
+    ULONG ealen;
+} dir_child_atts;
+
+#define DIR_NEG_CACHE_SIZE 32
+
+// hashes of names which no entry of a directory has, so repeated lookups of missing files
+// can fail straight away - 0 marks an empty slot
+typedef struct {
+    LONG next;
+    LONG next_uc;
+    UINT32 hash[DIR_NEG_CACHE_SIZE];
+    UINT32 hash_uc[DIR_NEG_CACHE_SIZE];
+} dir_neg_cache;
+
 typedef struct {
     KEY key;
     UINT64 index;
@@ -211,6 +250,7 @@ typedef struct {
     UNICODE_STRING name_uc;
     ULONG size;
     struct _file_ref* fileref;
+    dir_child_atts* atts;
     LIST_ENTRY list_entry_index;
     LIST_ENTRY list_entry_hash;
     LIST_ENTRY list_entry_hash_uc;
@@ -242,6 +282,7 @@ typedef struct _fcb {
     UINT8 type;
     INODE_ITEM inode_item;
     SECURITY_DESCRIPTOR* sd;
+    BOOL sd_interned;
     FILE_LOCK lock;
     BOOL deleted;
     PKTHREAD lazy_writer_thread;
@@ -264,6 +305,7 @@ typedef struct _fcb {
     LIST_ENTRY dir_children_hash_uc;
     LIST_ENTRY** hash_ptrs;
     LIST_ENTRY** hash_ptrs_uc;
+    dir_neg_cache* neg_cache;
 
     BOOL dirty;
     BOOL sd_dirty, sd_deleted;
@@ -284,6 +326,7 @@ typedef struct _fcb {
     LIST_ENTRY list_entry;
     LIST_ENTRY list_entry_all;
     LIST_ENTRY list_entry_dirty;
+    LIST_ENTRY list_entry_lru;
 } fcb;
 
 typedef struct {
@@ -317,6 +360,10 @@ typedef struct {
     struct _ccb* ccb;
     void* context;
     KEVENT cleared_event;
+    KEVENT buffer_event;
+    KSPIN_LOCK buffer_lock;
+    LIST_ENTRY full_buffers;
+    LIST_ENTRY free_buffers;
     BOOL cancelling;
     LIST_ENTRY list_entry;
 } send_info;
@@ -355,11 +402,14 @@ typedef struct {
     struct _tree* tree;
 } tree_holder;
 
+struct _tree_data_array;
+
 typedef struct _tree_data {
     KEY key;
     LIST_ENTRY list_entry;
     BOOL ignore;
     BOOL inserted;
+    struct _tree_data_array* array;
 
     union {
         tree_holder treeholder;
@@ -371,6 +421,13 @@ typedef struct _tree_data {
     };
 } tree_data;
 
+// all the items of a tree loaded from disk, allocated in one go
+typedef struct _tree_data_array {
+    LONG refcount;
+    ULONG num_items;
+    tree_data items[1];
+} tree_data_array;
+
 typedef struct _tree {
     tree_header header;
     UINT32 hash;
@@ -390,8 +447,21 @@ typedef struct _tree {
     BOOL is_unique;
     BOOL uniqueness_determined;
     UINT8* buf;
+    tree_data_array* item_array;
 } tree;
 
+typedef struct {
+    UINT64 address;
+    UINT64 generation;
+    UINT8* buf;
+    NTSTATUS Status;
+    BOOL done;
+    BOOL abandoned; // taken off the list because the node was loaded first - frees itself when done
+    struct _device_extension* Vcb;
+    WORK_QUEUE_ITEM item;
+    LIST_ENTRY list_entry;
+} tree_readahead;
+
 typedef struct {
     ERESOURCE load_tree_lock;
 } root_nonpaged;
@@ -409,6 +479,7 @@ typedef struct _root {
     LONG send_ops;
     LIST_ENTRY fcbs;
     LIST_ENTRY list_entry;
+    LIST_ENTRY list_entry_hash;
     LIST_ENTRY list_entry_dirty;
 } root;
 
@@ -439,6 +510,7 @@ typedef struct {
 typedef struct {
     root* r;
     LIST_ENTRY items;
+    BOOL unsorted;
     LIST_ENTRY list_entry;
 } batch_root;
 
@@ -477,6 +549,8 @@ typedef struct {
     LIST_ENTRY list_entry;
     ULONG num_trim_entries;
     LIST_ENTRY trim_list;
+    UINT64 scrub_data;
+    ULONG scrub_active;
 } device;
 
 typedef struct {
@@ -560,11 +634,22 @@ typedef struct {
     LIST_ENTRY list_entry;
 } sys_chunk;
 
+enum calc_job_type {
+    calc_job_csum,
+    calc_job_compress
+};
+
 typedef struct {
+    enum calc_job_type type;
     UINT8* data;
     UINT32* csum;
     UINT32 sectors;
     LONG pos, done;
+    UINT8 compression;
+    UINT32 inlen;
+    UINT8* out;
+    UINT32 outlen;
+    NTSTATUS Status;
     KEVENT event;
     LONG refcount;
     LIST_ENTRY list_entry;
@@ -601,6 +686,10 @@ typedef struct {
     BOOL no_trim;
     BOOL clear_cache;
     BOOL allow_degraded;
+    UINT32 scrub_queue_depth;
+    UINT32 balance_concurrency;
+    UINT32 auto_compact;
+    UINT32 auto_compact_bandwidth;
 } mount_options;
 
 #define VCB_TYPE_FS         1
@@ -627,6 +716,15 @@ typedef struct {
     UINT64 open_fileref_child_calls;
     UINT64 open_fileref_child_time;
     UINT64 fcb_lock_time;
+
+    UINT64 tree_loads;
+    UINT64 tree_readaheads;
+    UINT64 tree_readahead_hits;
+
+    UINT64 neg_lookup_hits;
+    UINT64 neg_lookup_misses;
+    UINT64 fcb_revives;
+    UINT64 decomp_cache_hits;
 } debug_stats;
 #endif
 
@@ -634,6 +732,24 @@ typedef struct {
 #define BALANCE_OPTS_METADATA   1
 #define BALANCE_OPTS_SYSTEM     2
 
+typedef struct {
+    ERESOURCE lock;
+    btrfs_throttle limits;
+    LARGE_INTEGER last_refill;
+    LONG64 byte_tokens;
+    LONG64 io_tokens;
+    UINT32 backoff;
+    UINT64 time_throttled;
+} throttle_info;
+
+typedef struct {
+    UINT64 runs;
+    UINT64 chunks_relocated;
+    UINT64 bytes_relocated;
+    LARGE_INTEGER last_start;
+    LARGE_INTEGER last_finish;
+} compact_info;
+
 typedef struct {
     HANDLE thread;
     UINT64 total_chunks;
@@ -643,11 +759,14 @@ typedef struct {
     BOOL stopping;
     BOOL removing;
     BOOL shrinking;
+    BOOL compacting;
     BOOL dev_readonly;
     ULONG balance_num;
     NTSTATUS status;
     KEVENT event;
     KEVENT finished;
+    throttle_info throttle;
+    compact_info compact;
 } balance_info;
 
 typedef struct {
@@ -690,7 +809,14 @@ typedef struct {
     UINT64 data_scrubbed;
     NTSTATUS error;
     ULONG num_errors;
+    ULONG previous_errors;
     LIST_ENTRY errors;
+    LIST_ENTRY chunks;
+    throttle_info throttle;
+    struct _scrub_worker* workers;
+    ULONG num_workers;
+    SCRUB_ITEM* resume;
+    LARGE_INTEGER last_checkpoint;
 } scrub_info;
 
 struct _volume_device_extension;
@@ -710,6 +836,7 @@ typedef struct _device_extension {
     BOOL removing;
     BOOL locked;
     BOOL lock_paused_balance;
+    LONG locks_pending;
     BOOL disallow_dismount;
     BOOL trim;
     PFILE_OBJECT locked_fileobj;
@@ -728,6 +855,7 @@ typedef struct _device_extension {
     UINT64 metadata_flags;
     UINT64 system_flags;
     LIST_ENTRY roots;
+    LIST_ENTRY roots_hash[ROOTS_HASH_SIZE];
     LIST_ENTRY drop_roots;
     root* chunk_root;
     root* root_root;
@@ -744,7 +872,21 @@ typedef struct _device_extension {
     LIST_ENTRY trees;
     LIST_ENTRY trees_hash;
     LIST_ENTRY* trees_ptrs[256];
+    ERESOURCE trees_lock;
+    LIST_ENTRY tree_readaheads;
+    ERESOURCE tree_readahead_lock;
+    ULONG num_tree_readaheads;
+    ULONG tree_readaheads_pending;
+    KEVENT tree_readaheads_finished;
     LIST_ENTRY all_fcbs;
+    LIST_ENTRY fcb_lru;
+    ULONG num_fcb_lru;
+    ERESOURCE fcb_lru_lock;
+    LIST_ENTRY sd_hash[SD_HASH_SIZE];
+    ERESOURCE sd_hash_lock;
+    LIST_ENTRY decomp_cache;
+    ULONG num_decomp_cache;
+    ERESOURCE decomp_cache_lock;
     LIST_ENTRY dirty_fcbs;
     ERESOURCE dirty_fcbs_lock;
     LIST_ENTRY dirty_filerefs;
@@ -758,6 +900,8 @@ typedef struct _device_extension {
     drv_calc_threads calcthreads;
     balance_info balance;
     scrub_info scrub;
+    LONG fg_latency;
+    LONG64 fg_latency_time;
     ERESOURCE send_load_lock;
     LONG running_sends;
     LIST_ENTRY send_ops;
@@ -827,15 +971,22 @@ typedef struct pdo_device_extension {
     LIST_ENTRY list_entry;
 } pdo_device_extension;
 
+#define MAPPING_HASH_SIZE 256
+
 typedef struct {
     LIST_ENTRY listentry;
+    LIST_ENTRY list_entry_uid_hash;
+    LIST_ENTRY list_entry_sid_hash;
     PSID sid;
+    UINT32 sid_hash;
     UINT32 uid;
 } uid_map;
 
 typedef struct {
     LIST_ENTRY listentry;
+    LIST_ENTRY list_entry_sid_hash;
     PSID sid;
+    UINT32 sid_hash;
     UINT32 gid;
 } gid_map;
 
@@ -859,6 +1010,8 @@ typedef struct {
     IO_STATUS_BLOCK iosb;
     enum write_data_status status;
     LIST_ENTRY list_entry;
+    device_extension* Vcb;
+    LARGE_INTEGER start_time;
 } write_data_stripe;
 
 typedef struct _write_data_context {
@@ -929,6 +1082,28 @@ static __inline void release_fcb_lock(device_extension* Vcb) {
     ExReleaseResourceLite(&Vcb->fcb_lock);
 }
 
+// Drops a reference to an fcb or file_ref without needing fcb_lock, provided it isn't the
+// last one. Returns FALSE if it might be, in which case the caller has to take the lock
+// exclusively and call free_fcb or free_fileref, so nobody can find the object while it's freed.
+static __inline BOOL release_ref_unless_last(LONG* refcount) {
+#ifndef DEBUG_FCB_REFCOUNTS
+    LONG rc = *refcount;
+
+    while (rc > 1) {
+        LONG rc2 = InterlockedCompareExchange(refcount, rc - 1, rc);
+
+        if (rc2 == rc)
+            return TRUE;
+
+        rc = rc2;
+    }
+#else
+    UNUSED(refcount);
+#endif
+
+    return FALSE;
+}
+
 static __inline void* map_user_buffer(PIRP Irp, ULONG priority) {
     if (!Irp->MdlAddress) {
         return Irp->UserBuffer;
@@ -1058,6 +1233,12 @@ BOOL get_file_attributes_from_xattr(_In_reads_bytes_(len) char* val, _In_ UINT16
 ULONG get_file_attributes(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ root* r, _In_ UINT64 inode,
                           _In_ UINT8 type, _In_ BOOL dotfile, _In_ BOOL ignore_xa, _In_opt_ PIRP Irp);
 
+ULONG get_file_attributes_from_dosattrib(_In_ root* r, _In_ UINT64 inode, _In_ UINT8 type, _In_ BOOL dotfile,
+                                         _In_reads_bytes_opt_(ealen) char* eaval, _In_ UINT16 ealen);
+
+_Success_(return)
+BOOL extract_xattr(_In_reads_bytes_(size) void* item, _In_ USHORT size, _In_z_ char* name, _Out_ UINT8** data, _Out_ UINT16* datalen);
+
 _Success_(return)
 BOOL get_xattr(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ root* subvol, _In_ UINT64 inode, _In_z_ char* name, _In_ UINT32 crc32,
                _Out_ UINT8** data, _Out_ UINT16* datalen, _In_opt_ PIRP Irp);
@@ -1065,9 +1246,14 @@ BOOL get_xattr(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vc
 #ifndef DEBUG_FCB_REFCOUNTS
 void free_fcb(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _Inout_ fcb* fcb);
 #endif
+void revive_fcb(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _In_ fcb* fcb);
+void evict_fcbs(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _In_opt_ root* subvol);
 void free_fileref(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _Inout_ file_ref* fr);
 void protect_superblocks(_Inout_ chunk* c);
 BOOL is_top_level(_In_ PIRP Irp);
+_Ret_maybenull_
+root* find_root(_In_ device_extension* Vcb, _In_ UINT64 id);
+
 NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ UINT64 id,
                      _Out_ root** rootptr, _In_ BOOL no_tree, _In_ UINT64 offset, _In_opt_ PIRP Irp);
 void uninit(_In_ device_extension* Vcb, _In_ BOOL flush);
@@ -1115,7 +1301,12 @@ extern UINT32 mount_no_trim;
 extern UINT32 mount_clear_cache;
 extern UINT32 mount_allow_degraded;
 extern UINT32 mount_readonly;
+extern UINT32 mount_scrub_queue_depth;
+extern UINT32 mount_balance_concurrency;
+extern UINT32 mount_auto_compact;
+extern UINT32 mount_auto_compact_bandwidth;
 extern UINT32 no_pnp;
+extern PKEVENT low_memory_event;
 
 #ifdef _DEBUG
 
@@ -1204,6 +1395,8 @@ NTSTATUS insert_tree_item(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock)
                           _In_ UINT16 size, _Out_opt_ traverse_ptr* ptp, _In_opt_ PIRP Irp);
 NTSTATUS delete_tree_item(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _Inout_ traverse_ptr* tp);
 tree* free_tree(tree* t);
+void free_tree_data(device_extension* Vcb, tree_data* td);
+void free_tree_readaheads(device_extension* Vcb, BOOL wait);
 NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT64 generation, PIRP Irp);
 NTSTATUS do_load_tree(device_extension* Vcb, tree_holder* th, root* r, tree* t, tree_data* td, BOOL* loaded, PIRP Irp);
 void clear_rollback(LIST_ENTRY* rollback);
@@ -1291,8 +1484,12 @@ _Function_class_(DRIVER_DISPATCH)
 NTSTATUS drv_set_security(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
 
 void fcb_get_sd(fcb* fcb, struct _fcb* parent, BOOL look_for_xattr, PIRP Irp);
+void fcb_intern_sd(fcb* fcb);
+void release_sd(device_extension* Vcb, SECURITY_DESCRIPTOR* sd, BOOL interned);
 void add_user_mapping(WCHAR* sidstring, ULONG sidstringlength, UINT32 uid);
 void add_group_mapping(WCHAR* sidstring, ULONG sidstringlength, UINT32 gid);
+void clear_user_mappings();
+void clear_group_mappings();
 UINT32 sid_to_uid(PSID sid);
 NTSTATUS uid_to_sid(UINT32 uid, PSID* sid);
 NTSTATUS fcb_get_new_sd(fcb* fcb, file_ref* parfileref, ACCESS_STATE* as);
@@ -1389,6 +1586,8 @@ NTSTATUS read_file(fcb* fcb, UINT8* data, UINT64 start, UINT64 length, ULONG* pb
 NTSTATUS read_stream(fcb* fcb, UINT8* data, UINT64 start, ULONG length, ULONG* pbr);
 NTSTATUS do_read(PIRP Irp, BOOLEAN wait, ULONG* bytes_read);
 NTSTATUS check_csum(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32* csum);
+void invalidate_decomp_cache(device_extension* Vcb, UINT64 address, UINT64 length);
+void free_decomp_cache(device_extension* Vcb);
 void raid6_recover2(UINT8* sectors, UINT16 num_stripes, ULONG sector_size, UINT16 missing1, UINT16 missing2, UINT8* out);
 
 // in pnp.c
@@ -1448,7 +1647,14 @@ void watch_registry(HANDLE regh);
 NTSTATUS zlib_decompress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen);
 NTSTATUS lzo_decompress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen, UINT32 inpageoff);
 NTSTATUS zstd_decompress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen);
-NTSTATUS write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, BOOL* compressed, PIRP Irp, LIST_ENTRY* rollback);
+void init_comp_contexts();
+void free_comp_contexts();
+void uninit_comp_contexts();
+void get_comp_context_stats(ULONG* num, UINT64* mem);
+UINT8 get_compression_type(fcb* fcb);
+NTSTATUS compress_extent(device_extension* Vcb, UINT8 type, UINT8* data, UINT32 len, UINT8** comp_data, UINT32* comp_length);
+NTSTATUS write_compressed_extent(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, UINT8 compression, UINT8* comp_data, UINT32 comp_length,
+                                 PIRP Irp, LIST_ENTRY* rollback);
 
 // in galois.c
 void galois_double(UINT8* data, UINT32 len);
@@ -1469,6 +1675,7 @@ _Function_class_(KSTART_ROUTINE)
 void calc_thread(void* context);
 
 NTSTATUS add_calc_job(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32* csum, calc_job** pcj);
+NTSTATUS add_calc_job_comp(device_extension* Vcb, UINT8 compression, UINT8* data, UINT32 inlen, calc_job** pcj);
 void free_calc_job(calc_job* cj);
 
 // in balance.c
@@ -1477,8 +1684,15 @@ NTSTATUS query_balance(device_extension* Vcb, void* data, ULONG length);
 NTSTATUS pause_balance(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
 NTSTATUS resume_balance(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
 NTSTATUS stop_balance(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
+NTSTATUS throttle_balance(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode);
 NTSTATUS look_for_balance_item(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb);
 NTSTATUS remove_device(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode);
+void check_auto_compact(device_extension* Vcb);
+void stop_auto_compact(device_extension* Vcb);
+NTSTATUS query_compact(device_extension* Vcb, void* data, ULONG length);
+
+_Acquires_exclusive_lock_(Vcb->tree_lock)
+void stop_auto_compact_and_lock(device_extension* Vcb);
 
 _Function_class_(KSTART_ROUTINE)
 void balance_thread(void* context);
@@ -1511,11 +1725,22 @@ _Function_class_(DRIVER_NOTIFICATION_CALLBACK_ROUTINE)
 NTSTATUS pnp_removal(PVOID NotificationStructure, PVOID Context);
 
 // in scrub.c
-NTSTATUS start_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
+NTSTATUS start_scrub(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode);
 NTSTATUS query_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode, void* data, ULONG length);
 NTSTATUS pause_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
 NTSTATUS resume_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
 NTSTATUS stop_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
+NTSTATUS throttle_scrub(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode);
+NTSTATUS look_for_scrub_item(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb);
+
+// in throttle.c
+void set_throttle(throttle_info* ti, btrfs_throttle* limits);
+void init_throttle(throttle_info* ti, btrfs_throttle* limits);
+void throttle_charge(throttle_info* ti, UINT64 bytes, ULONG ios);
+void throttle_wait(device_extension* Vcb, throttle_info* ti, BOOL* stopping);
+UINT64 throttle_batch_size(throttle_info* ti, UINT64 def);
+void get_throttle_state(device_extension* Vcb, throttle_info* ti, btrfs_throttle_state* state);
+void record_fg_latency(device_extension* Vcb, LARGE_INTEGER start);
 
 // in send.c
 NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJECT FileObject, PIRP Irp);
@@ -37,6 +37,10 @@
 #define FSCTL_BTRFS_SEND_SUBVOL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x846, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define FSCTL_BTRFS_READ_SEND_BUFFER CTL_CODE(FILE_DEVICE_UNKNOWN, 0x847, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
 #define FSCTL_BTRFS_RESIZE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x848, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_THROTTLE_SCRUB CTL_CODE(FILE_DEVICE_UNKNOWN, 0x849, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_THROTTLE_BALANCE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84a, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_QUERY_COMPACT CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84b, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_WRITE_ENCODED CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84c, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
 
 typedef struct {
     UINT64 subvol;
@@ -166,12 +170,26 @@ typedef struct {
     UINT64 convert;
 } btrfs_balance_opts;
 
+typedef struct {
+    UINT64 bandwidth;      // bytes per second, 0 for no limit
+    UINT32 iops;           // I/Os per second, 0 for no limit
+    UINT32 latency_target; // in microseconds - back off when foreground I/O is slower than this, 0 to disable
+} btrfs_throttle;
+
+typedef struct {
+    btrfs_throttle limits;
+    BOOL backing_off;
+    UINT32 foreground_latency; // in microseconds
+    UINT64 time_throttled;     // in 100-nanosecond units
+} btrfs_throttle_state;
+
 #define BTRFS_BALANCE_STOPPED   0
 #define BTRFS_BALANCE_RUNNING   1
 #define BTRFS_BALANCE_PAUSED    2
 #define BTRFS_BALANCE_REMOVAL   4
 #define BTRFS_BALANCE_ERROR     8
 #define BTRFS_BALANCE_SHRINKING 16
+#define BTRFS_BALANCE_COMPACTING 32
 
 typedef struct {
     UINT32 status;
@@ -181,10 +199,25 @@ typedef struct {
     btrfs_balance_opts data_opts;
     btrfs_balance_opts metadata_opts;
     btrfs_balance_opts system_opts;
+    btrfs_throttle_state throttle;
 } btrfs_query_balance;
 
+typedef struct {
+    UINT32 threshold; // usage percentage below which data chunks are compacted, or 0 if disabled
+    UINT32 bandwidth; // bytes per second
+    BOOL running;
+    UINT64 runs;
+    UINT64 chunks_relocated;
+    UINT64 bytes_relocated;
+    LARGE_INTEGER last_start;
+    LARGE_INTEGER last_finish;
+    UINT64 unallocated;
+    UINT64 total_size;
+} btrfs_query_compact;
+
 typedef struct {
     btrfs_balance_opts opts[3];
+    btrfs_throttle throttle; // optional
 } btrfs_start_balance;
 
 typedef struct {
@@ -229,6 +262,16 @@ typedef struct {
     };
 } btrfs_scrub_error;
 
+typedef struct {
+    UINT64 dev_id;
+    UINT64 data_scrubbed;
+} btrfs_scrub_device;
+
+typedef struct {
+    btrfs_throttle throttle;
+    BOOL resume; // carry on from where a stopped or interrupted scrub left off
+} btrfs_start_scrub;
+
 typedef struct {
     UINT32 status;
     LARGE_INTEGER start_time;
@@ -238,6 +281,10 @@ typedef struct {
     UINT64 data_scrubbed;
     UINT64 duration;
     NTSTATUS error;
+    btrfs_throttle_state throttle;
+    UINT32 previous_errors; // found before the scrub was resumed, and not included in errors
+    UINT32 num_devices;
+    UINT32 devices_offset; // from start of structure, after the errors
     UINT32 num_errors;
     btrfs_scrub_error errors;
 } btrfs_query_scrub;
@@ -273,18 +320,32 @@ typedef struct {
     UINT64 ctransid;
 } btrfs_find_subvol;
 
+#define BTRFS_SEND_FLAG_COMPRESSED  1 // send compressed extents as-is, using a v2 stream
+
 typedef struct {
     HANDLE parent;
     ULONG num_clones;
+    ULONG flags;
     HANDLE clones[1];
 } btrfs_send_subvol;
 
 typedef struct {
     void* POINTER_32 parent;
     ULONG num_clones;
+    ULONG flags;
     void* POINTER_32 clones[1];
 } btrfs_send_subvol32;
 
+typedef struct {
+    UINT64 offset;
+    UINT64 unencoded_file_len;
+    UINT64 unencoded_len;
+    UINT64 unencoded_offset;
+    UINT32 compression;
+    UINT32 length;
+    UINT8 data[1];
+} btrfs_write_encoded;
+
 typedef struct {
     UINT64 device;
     UINT64 size;
@@ -28,6 +28,7 @@ NTSTATUS add_calc_job(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    cj->type = calc_job_csum;
     cj->data = data;
     cj->sectors = sectors;
     cj->csum = csum;
@@ -50,6 +51,39 @@ NTSTATUS add_calc_job(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32
     return STATUS_SUCCESS;
 }
 
+NTSTATUS add_calc_job_comp(device_extension* Vcb, UINT8 compression, UINT8* data, UINT32 inlen, calc_job** pcj) {
+    calc_job* cj;
+
+    cj = ExAllocatePoolWithTag(NonPagedPool, sizeof(calc_job), ALLOC_TAG);
+    if (!cj) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    cj->type = calc_job_compress;
+    cj->data = data;
+    cj->compression = compression;
+    cj->inlen = inlen;
+    cj->out = NULL;
+    cj->outlen = 0;
+    cj->Status = STATUS_SUCCESS;
+    cj->refcount = 1;
+    KeInitializeEvent(&cj->event, NotificationEvent, FALSE);
+
+    ExAcquireResourceExclusiveLite(&Vcb->calcthreads.lock, TRUE);
+
+    InsertTailList(&Vcb->calcthreads.job_list, &cj->list_entry);
+
+    KeSetEvent(&Vcb->calcthreads.event, 0, FALSE);
+    KeClearEvent(&Vcb->calcthreads.event);
+
+    ExReleaseResourceLite(&Vcb->calcthreads.lock);
+
+    *pcj = cj;
+
+    return STATUS_SUCCESS;
+}
+
 void free_calc_job(calc_job* cj) {
     LONG rc = InterlockedDecrement(&cj->refcount);
 
@@ -63,6 +97,14 @@ static BOOL do_calc(device_extension* Vcb, calc_job* cj) {
     UINT8* data;
     ULONG blocksize, i;
 
+    if (cj->type == calc_job_compress) {
+        cj->Status = compress_extent(Vcb, cj->compression, cj->data, cj->inlen, &cj->out, &cj->outlen);
+
+        KeSetEvent(&cj->event, 0, FALSE);
+
+        return TRUE;
+    }
+
     pos = InterlockedIncrement(&cj->pos) - 1;
 
     if ((UINT32)pos * SECTOR_BLOCK >= cj->sectors)
@@ -115,6 +157,10 @@ void calc_thread(void* context) {
             cj = CONTAINING_RECORD(Vcb->calcthreads.job_list.Flink, calc_job, list_entry);
             cj->refcount++;
 
+            // compression jobs are done in one go, so take them off the list straight away
+            if (cj->type == calc_job_compress)
+                RemoveEntryList(&cj->list_entry);
+
             ExReleaseResourceLite(&Vcb->calcthreads.lock);
 
             b = do_calc(Vcb, cj);
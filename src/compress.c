@@ -87,10 +87,149 @@ typedef struct {
 // needs to be the same as Linux (fs/btrfs/zstd.c)
 #define ZSTD_BTRFS_MAX_WINDOWLOG 17
 
-static void* zstd_malloc(void* opaque, size_t size);
-static void zstd_free(void* opaque, void* address);
+// Setting up a compression stream costs about as much as compressing a 128 KB extent does with
+// zstd, so rather than doing it for every extent we keep a pool of contexts and reuse them. Each
+// part of a context is only initialized the first time that algorithm needs it.
+typedef struct {
+    LIST_ENTRY list_entry;
+    z_stream deflate_stream;
+    int deflate_level;
+    BOOL deflate_init;
+    z_stream inflate_stream;
+    BOOL inflate_init;
+    ZSTD_CStream* zstd_cstream;
+    ZSTD_DStream* zstd_dstream;
+    void* lzo_wrkmem;
+} comp_context;
+
+static LIST_ENTRY comp_contexts;
+static ERESOURCE comp_contexts_lock;
+static LONG num_comp_contexts = 0;
+static LONG64 comp_contexts_mem = 0;
+
+static void* comp_context_alloc(SIZE_T size, ULONG tag) {
+    SIZE_T* p = ExAllocatePoolWithTag(PagedPool, size + MEMORY_ALLOCATION_ALIGNMENT, tag);
+
+    if (!p)
+        return NULL;
+
+    *p = size;
+    InterlockedExchangeAdd64(&comp_contexts_mem, size);
+
+    return (UINT8*)p + MEMORY_ALLOCATION_ALIGNMENT;
+}
+
+static void comp_context_free(void* ptr) {
+    SIZE_T* p = (SIZE_T*)((UINT8*)ptr - MEMORY_ALLOCATION_ALIGNMENT);
+
+    InterlockedExchangeAdd64(&comp_contexts_mem, -(LONG64)*p);
+    ExFreePool(p);
+}
+
+static void* comp_context_zlib_alloc(void* opaque, unsigned int items, unsigned int size) {
+    UNUSED(opaque);
+
+    return comp_context_alloc(items * size, ALLOC_TAG_ZLIB);
+}
+
+static void comp_context_zlib_free(void* opaque, void* ptr) {
+    UNUSED(opaque);
+
+    comp_context_free(ptr);
+}
+
+static void* comp_context_zstd_malloc(void* opaque, size_t size) {
+    UNUSED(opaque);
+
+    return comp_context_alloc(size, ZSTD_ALLOC_TAG);
+}
+
+static void comp_context_zstd_free(void* opaque, void* address) {
+    UNUSED(opaque);
+
+    comp_context_free(address);
+}
+
+static ZSTD_customMem comp_context_zstd_mem = { .customAlloc = comp_context_zstd_malloc, .customFree = comp_context_zstd_free, .opaque = NULL };
+
+static comp_context* get_comp_context() {
+    comp_context* ctx = NULL;
+
+    ExAcquireResourceExclusiveLite(&comp_contexts_lock, TRUE);
+
+    if (!IsListEmpty(&comp_contexts))
+        ctx = CONTAINING_RECORD(RemoveHeadList(&comp_contexts), comp_context, list_entry);
 
-ZSTD_customMem zstd_mem = { .customAlloc = zstd_malloc, .customFree = zstd_free, .opaque = NULL };
+    ExReleaseResourceLite(&comp_contexts_lock);
+
+    if (ctx)
+        return ctx;
+
+    ctx = ExAllocatePoolWithTag(PagedPool, sizeof(comp_context), ALLOC_TAG);
+    if (!ctx) {
+        ERR("out of memory\n");
+        return NULL;
+    }
+
+    RtlZeroMemory(ctx, sizeof(comp_context));
+
+    InterlockedIncrement(&num_comp_contexts);
+
+    return ctx;
+}
+
+static void put_comp_context(comp_context* ctx) {
+    ExAcquireResourceExclusiveLite(&comp_contexts_lock, TRUE);
+    InsertHeadList(&comp_contexts, &ctx->list_entry);
+    ExReleaseResourceLite(&comp_contexts_lock);
+}
+
+static void destroy_comp_context(comp_context* ctx) {
+    if (ctx->deflate_init)
+        deflateEnd(&ctx->deflate_stream);
+
+    if (ctx->inflate_init)
+        inflateEnd(&ctx->inflate_stream);
+
+    if (ctx->zstd_cstream)
+        ZSTD_freeCStream(ctx->zstd_cstream);
+
+    if (ctx->zstd_dstream)
+        ZSTD_freeDStream(ctx->zstd_dstream);
+
+    if (ctx->lzo_wrkmem)
+        comp_context_free(ctx->lzo_wrkmem);
+
+    ExFreePool(ctx);
+
+    InterlockedDecrement(&num_comp_contexts);
+}
+
+void init_comp_contexts() {
+    InitializeListHead(&comp_contexts);
+    ExInitializeResourceLite(&comp_contexts_lock);
+}
+
+// frees the contexts which aren't in use at the moment
+void free_comp_contexts() {
+    ExAcquireResourceExclusiveLite(&comp_contexts_lock, TRUE);
+
+    while (!IsListEmpty(&comp_contexts)) {
+        destroy_comp_context(CONTAINING_RECORD(RemoveHeadList(&comp_contexts), comp_context, list_entry));
+    }
+
+    ExReleaseResourceLite(&comp_contexts_lock);
+}
+
+void uninit_comp_contexts() {
+    free_comp_contexts();
+    ExDeleteResourceLite(&comp_contexts_lock);
+}
+
+void get_comp_context_stats(ULONG* num, UINT64* mem) {
+    *num = (ULONG)num_comp_contexts;
+    *mem = (UINT64)comp_contexts_mem;
+}
 
 static UINT8 lzo_nextbyte(lzo_stream* stream) {
     UINT8 c;
@@ -313,209 +452,128 @@ NTSTATUS lzo_decompress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen
     return STATUS_SUCCESS;
 }
 
-static void* zlib_alloc(void* opaque, unsigned int items, unsigned int size) {
-    UNUSED(opaque);
+NTSTATUS zlib_decompress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen) {
+    comp_context* ctx;
+    z_stream* c_stream;
+    int ret;
 
-    return ExAllocatePoolWithTag(PagedPool, items * size, ALLOC_TAG_ZLIB);
-}
+    ctx = get_comp_context();
+    if (!ctx)
+        return STATUS_INSUFFICIENT_RESOURCES;
 
-static void zlib_free(void* opaque, void* ptr) {
-    UNUSED(opaque);
+    c_stream = &ctx->inflate_stream;
 
-    ExFreePool(ptr);
-}
+    if (ctx->inflate_init)
+        ret = inflateReset(c_stream);
+    else {
+        c_stream->zalloc = comp_context_zlib_alloc;
+        c_stream->zfree = comp_context_zlib_free;
+        c_stream->opaque = (voidpf)0;
 
-NTSTATUS zlib_decompress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen) {
-    z_stream c_stream;
-    int ret;
+        ret = inflateInit(c_stream);
 
-    c_stream.zalloc = zlib_alloc;
-    c_stream.zfree = zlib_free;
-    c_stream.opaque = (voidpf)0;
+        if (ret != Z_OK) {
+            ERR("inflateInit returned %08x\n", ret);
+            destroy_comp_context(ctx);
+            return STATUS_INTERNAL_ERROR;
+        }
 
-    ret = inflateInit(&c_stream);
+        ctx->inflate_init = TRUE;
+    }
 
     if (ret != Z_OK) {
-        ERR("inflateInit returned %08x\n", ret);
+        ERR("inflateReset returned %08x\n", ret);
+        destroy_comp_context(ctx);
         return STATUS_INTERNAL_ERROR;
     }
 
-    c_stream.next_in = inbuf;
-    c_stream.avail_in = inlen;
+    c_stream->next_in = inbuf;
+    c_stream->avail_in = inlen;
 
-    c_stream.next_out = outbuf;
-    c_stream.avail_out = outlen;
+    c_stream->next_out = outbuf;
+    c_stream->avail_out = outlen;
 
     do {
-        ret = inflate(&c_stream, Z_NO_FLUSH);
+        ret = inflate(c_stream, Z_NO_FLUSH);
 
         if (ret != Z_OK && ret != Z_STREAM_END) {
             ERR("inflate returned %08x\n", ret);
-            inflateEnd(&c_stream);
+            destroy_comp_context(ctx);
             return STATUS_INTERNAL_ERROR;
         }
 
-        if (c_stream.avail_out == 0)
+        if (c_stream->avail_out == 0)
             break;
     } while (ret != Z_STREAM_END);
 
-    ret = inflateEnd(&c_stream);
-
-    if (ret != Z_OK) {
-        ERR("inflateEnd returned %08x\n", ret);
-        return STATUS_INTERNAL_ERROR;
-    }
+    put_comp_context(ctx);
 
     // FIXME - if we're short, should we zero the end of outbuf so we don't leak information into userspace?
 
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS zlib_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, BOOL* compressed, PIRP Irp, LIST_ENTRY* rollback) {
-    NTSTATUS Status;
-    UINT8 compression;
-    UINT32 comp_length;
-    UINT8* comp_data;
-    UINT32 out_left;
-    LIST_ENTRY* le;
-    chunk* c;
-    z_stream c_stream;
+static NTSTATUS zlib_compress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen, unsigned int level, UINT32* complen) {
+    comp_context* ctx;
+    z_stream* c_stream;
     int ret;
 
-    comp_data = ExAllocatePoolWithTag(PagedPool, (UINT32)(end_data - start_data), ALLOC_TAG);
-    if (!comp_data) {
-        ERR("out of memory\n");
+    ctx = get_comp_context();
+    if (!ctx)
         return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
-    if (!NT_SUCCESS(Status)) {
-        ERR("excise_extents returned %08x\n", Status);
-        ExFreePool(comp_data);
-        return Status;
-    }
-
-    c_stream.zalloc = zlib_alloc;
-    c_stream.zfree = zlib_free;
-    c_stream.opaque = (voidpf)0;
 
-    ret = deflateInit(&c_stream, fcb->Vcb->options.zlib_level);
+    c_stream = &ctx->deflate_stream;
 
-    if (ret != Z_OK) {
-        ERR("deflateInit returned %08x\n", ret);
-        ExFreePool(comp_data);
-        return STATUS_INTERNAL_ERROR;
+    if (ctx->deflate_init && ctx->deflate_level != (int)level) {
+        deflateEnd(c_stream);
+        ctx->deflate_init = FALSE;
     }
 
-    c_stream.avail_in = (UINT32)(end_data - start_data);
-    c_stream.next_in = data;
-    c_stream.avail_out = (UINT32)(end_data - start_data);
-    c_stream.next_out = comp_data;
+    if (ctx->deflate_init)
+        ret = deflateReset(c_stream);
+    else {
+        c_stream->zalloc = comp_context_zlib_alloc;
+        c_stream->zfree = comp_context_zlib_free;
+        c_stream->opaque = (voidpf)0;
 
-    do {
-        ret = deflate(&c_stream, Z_FINISH);
+        ret = deflateInit(c_stream, level);
 
-        if (ret == Z_STREAM_ERROR) {
-            ERR("deflate returned %x\n", ret);
-            ExFreePool(comp_data);
+        if (ret != Z_OK) {
+            ERR("deflateInit returned %08x\n", ret);
+            destroy_comp_context(ctx);
             return STATUS_INTERNAL_ERROR;
         }
-    } while (c_stream.avail_in > 0 && c_stream.avail_out > 0);
 
-    out_left = c_stream.avail_out;
-
-    ret = deflateEnd(&c_stream);
+        ctx->deflate_init = TRUE;
+        ctx->deflate_level = level;
+    }
 
     if (ret != Z_OK) {
-        ERR("deflateEnd returned %08x\n", ret);
-        ExFreePool(comp_data);
+        ERR("deflateReset returned %08x\n", ret);
+        destroy_comp_context(ctx);
         return STATUS_INTERNAL_ERROR;
     }
 
-    if (out_left < fcb->Vcb->superblock.sector_size) { // compressed extent would be larger than or same size as uncompressed extent
-        ExFreePool(comp_data);
-
-        comp_length = (UINT32)(end_data - start_data);
-        comp_data = data;
-        compression = BTRFS_COMPRESSION_NONE;
-
-        *compressed = FALSE;
-    } else {
-        UINT32 cl;
-
-        compression = BTRFS_COMPRESSION_ZLIB;
-        cl = (UINT32)(end_data - start_data - out_left);
-        comp_length = (UINT32)sector_align(cl, fcb->Vcb->superblock.sector_size);
-
-        RtlZeroMemory(comp_data + cl, comp_length - cl);
+    c_stream->avail_in = inlen;
+    c_stream->next_in = inbuf;
+    c_stream->avail_out = outlen;
+    c_stream->next_out = outbuf;
 
-        *compressed = TRUE;
-    }
-
-    ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, TRUE);
-
-    le = fcb->Vcb->chunks.Flink;
-    while (le != &fcb->Vcb->chunks) {
-        c = CONTAINING_RECORD(le, chunk, list_entry);
-
-        if (!c->readonly && !c->reloc) {
-            ExAcquireResourceExclusiveLite(&c->lock, TRUE);
-
-            if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-                if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, Irp, rollback, compression, end_data - start_data, FALSE, 0)) {
-                    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
-
-                    if (compression != BTRFS_COMPRESSION_NONE)
-                        ExFreePool(comp_data);
-
-                    return STATUS_SUCCESS;
-                }
-            }
-
-            ExReleaseResourceLite(&c->lock);
-        }
-
-        le = le->Flink;
-    }
-
-    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
-
-    ExAcquireResourceExclusiveLite(&fcb->Vcb->chunk_lock, TRUE);
-
-    Status = alloc_chunk(fcb->Vcb, fcb->Vcb->data_flags, &c, FALSE);
-
-    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
-
-    if (!NT_SUCCESS(Status)) {
-        ERR("alloc_chunk returned %08x\n", Status);
-
-        if (compression != BTRFS_COMPRESSION_NONE)
-            ExFreePool(comp_data);
-
-        return Status;
-    }
-
-    if (c) {
-        ExAcquireResourceExclusiveLite(&c->lock, TRUE);
-
-        if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-            if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, Irp, rollback, compression, end_data - start_data, FALSE, 0)) {
-                if (compression != BTRFS_COMPRESSION_NONE)
-                    ExFreePool(comp_data);
+    do {
+        ret = deflate(c_stream, Z_FINISH);
 
-                return STATUS_SUCCESS;
-            }
+        if (ret == Z_STREAM_ERROR) {
+            ERR("deflate returned %x\n", ret);
+            destroy_comp_context(ctx);
+            return STATUS_INTERNAL_ERROR;
         }
+    } while (c_stream->avail_in > 0 && c_stream->avail_out > 0);
 
-        ExReleaseResourceLite(&c->lock);
-    }
+    *complen = outlen - c_stream->avail_out;
 
-    WARN("couldn't find any data chunks with %llx bytes free\n", comp_length);
+    put_comp_context(ctx);
 
-    if (compression != BTRFS_COMPRESSION_NONE)
-        ExFreePool(comp_data);
-
-    return STATUS_DISK_FULL;
+    return STATUS_SUCCESS;
 }
 
 static NTSTATUS lzo_do_compress(const UINT8* in, UINT32 in_len, UINT8* out, UINT32* out_len, void* wrkmem) {
@@ -759,63 +817,46 @@ static __inline UINT32 lzo_max_outlen(UINT32 inlen) {
     return inlen + (inlen / 16) + 64 + 3; // formula comes from LZO.FAQ
 }
 
-static NTSTATUS lzo_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, BOOL* compressed, PIRP Irp, LIST_ENTRY* rollback) {
+static NTSTATUS lzo_compress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32* complen) {
     NTSTATUS Status;
-    UINT8 compression;
-    UINT64 comp_length;
-    ULONG comp_data_len, num_pages, i;
-    UINT8* comp_data;
-    BOOL skip_compression = FALSE;
+    comp_context* ctx;
+    ULONG num_pages, i;
     lzo_stream stream;
     UINT32* out_size;
-    LIST_ENTRY* le;
-    chunk* c;
-
-    num_pages = (ULONG)((sector_align(end_data - start_data, LINUX_PAGE_SIZE)) / LINUX_PAGE_SIZE);
 
-    // Four-byte overall header
-    // Another four-byte header page
-    // Each page has a maximum size of lzo_max_outlen(LINUX_PAGE_SIZE)
-    // Plus another four bytes for possible padding
-    comp_data_len = sizeof(UINT32) + ((lzo_max_outlen(LINUX_PAGE_SIZE) + (2 * sizeof(UINT32))) * num_pages);
+    num_pages = (ULONG)((sector_align(inlen, LINUX_PAGE_SIZE)) / LINUX_PAGE_SIZE);
 
-    comp_data = ExAllocatePoolWithTag(PagedPool, comp_data_len, ALLOC_TAG);
-    if (!comp_data) {
-        ERR("out of memory\n");
+    ctx = get_comp_context();
+    if (!ctx)
         return STATUS_INSUFFICIENT_RESOURCES;
-    }
 
-    stream.wrkmem = ExAllocatePoolWithTag(PagedPool, LZO1X_MEM_COMPRESS, ALLOC_TAG);
-    if (!stream.wrkmem) {
-        ERR("out of memory\n");
-        ExFreePool(comp_data);
-        return STATUS_INSUFFICIENT_RESOURCES;
+    if (!ctx->lzo_wrkmem) {
+        ctx->lzo_wrkmem = comp_context_alloc(LZO1X_MEM_COMPRESS, ALLOC_TAG);
+        if (!ctx->lzo_wrkmem) {
+            ERR("out of memory\n");
+            put_comp_context(ctx);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
     }
 
-    Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
-    if (!NT_SUCCESS(Status)) {
-        ERR("excise_extents returned %08x\n", Status);
-        ExFreePool(comp_data);
-        ExFreePool(stream.wrkmem);
-        return Status;
-    }
+    stream.wrkmem = ctx->lzo_wrkmem;
 
-    out_size = (UINT32*)comp_data;
+    out_size = (UINT32*)outbuf;
     *out_size = sizeof(UINT32);
 
-    stream.in = data;
-    stream.out = comp_data + (2 * sizeof(UINT32));
+    stream.in = inbuf;
+    stream.out = outbuf + (2 * sizeof(UINT32));
 
     for (i = 0; i < num_pages; i++) {
         UINT32* pagelen = (UINT32*)(stream.out - sizeof(UINT32));
 
-        stream.inlen = (UINT32)min(LINUX_PAGE_SIZE, end_data - start_data - (i * LINUX_PAGE_SIZE));
+        stream.inlen = (UINT32)min(LINUX_PAGE_SIZE, inlen - (i * LINUX_PAGE_SIZE));
 
         Status = lzo1x_1_compress(&stream);
         if (!NT_SUCCESS(Status)) {
             ERR("lzo1x_1_compress returned %08x\n", Status);
-            skip_compression = TRUE;
-            break;
+            put_comp_context(ctx);
+            return Status;
         }
 
         *pagelen = stream.outlen;
@@ -831,189 +872,324 @@ static NTSTATUS lzo_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end
         }
     }
 
-    ExFreePool(stream.wrkmem);
+    put_comp_context(ctx);
 
-    if (skip_compression || *out_size >= end_data - start_data - fcb->Vcb->superblock.sector_size) { // compressed extent would be larger than or same size as uncompressed extent
-        ExFreePool(comp_data);
+    *complen = *out_size;
 
-        comp_length = end_data - start_data;
-        comp_data = data;
-        compression = BTRFS_COMPRESSION_NONE;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS zstd_compress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen, UINT32 level, UINT32* complen) {
+    comp_context* ctx;
+    ZSTD_CStream* stream;
+    size_t init_res, written;
+    ZSTD_inBuffer input;
+    ZSTD_outBuffer output;
+    ZSTD_parameters params;
 
-        *compressed = FALSE;
-    } else {
-        compression = BTRFS_COMPRESSION_LZO;
-        comp_length = sector_align(*out_size, fcb->Vcb->superblock.sector_size);
+    ctx = get_comp_context();
+    if (!ctx)
+        return STATUS_INSUFFICIENT_RESOURCES;
 
-        RtlZeroMemory(comp_data + *out_size, (ULONG)(comp_length - *out_size));
+    if (!ctx->zstd_cstream) {
+        ctx->zstd_cstream = ZSTD_createCStream_advanced(comp_context_zstd_mem);
 
-        *compressed = TRUE;
+        if (!ctx->zstd_cstream) {
+            ERR("ZSTD_createCStream failed.\n");
+            put_comp_context(ctx);
+            return STATUS_INTERNAL_ERROR;
+        }
     }
 
-    ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, TRUE);
+    stream = ctx->zstd_cstream;
 
-    le = fcb->Vcb->chunks.Flink;
-    while (le != &fcb->Vcb->chunks) {
-        c = CONTAINING_RECORD(le, chunk, list_entry);
+    params = ZSTD_getParams(level, inlen, 0);
 
-        if (!c->readonly && !c->reloc) {
-            ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+    if (params.cParams.windowLog > ZSTD_BTRFS_MAX_WINDOWLOG)
+        params.cParams.windowLog = ZSTD_BTRFS_MAX_WINDOWLOG;
 
-            if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-                if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, Irp, rollback, compression, end_data - start_data, FALSE, 0)) {
-                    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+    init_res = ZSTD_initCStream_advanced(stream, NULL, 0, params, inlen);
+
+    if (ZSTD_isError(init_res)) {
+        ERR("ZSTD_initCStream_advanced failed: %s\n", ZSTD_getErrorName(init_res));
+        destroy_comp_context(ctx);
+        return STATUS_INTERNAL_ERROR;
+    }
 
-                    if (compression != BTRFS_COMPRESSION_NONE)
-                        ExFreePool(comp_data);
+    input.src = inbuf;
+    input.size = inlen;
+    input.pos = 0;
 
-                    return STATUS_SUCCESS;
-                }
-            }
+    output.dst = outbuf;
+    output.size = outlen;
+    output.pos = 0;
 
-            ExReleaseResourceLite(&c->lock);
+    while (input.pos < input.size && output.pos < output.size) {
+        written = ZSTD_compressStream(stream, &output, &input);
+
+        if (ZSTD_isError(written)) {
+            ERR("ZSTD_compressStream failed: %s\n", ZSTD_getErrorName(written));
+            destroy_comp_context(ctx);
+            return STATUS_INTERNAL_ERROR;
         }
+    }
 
-        le = le->Flink;
+    written = ZSTD_endStream(stream, &output);
+    if (ZSTD_isError(written)) {
+        ERR("ZSTD_endStream failed: %s\n", ZSTD_getErrorName(written));
+        destroy_comp_context(ctx);
+        return STATUS_INTERNAL_ERROR;
     }
 
-    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+    put_comp_context(ctx);
 
-    ExAcquireResourceExclusiveLite(&fcb->Vcb->chunk_lock, TRUE);
+    *complen = (UINT32)output.pos;
 
-    Status = alloc_chunk(fcb->Vcb, fcb->Vcb->data_flags, &c, FALSE);
+    return STATUS_SUCCESS;
+}
 
-    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+UINT8 get_compression_type(fcb* fcb) {
+    UINT8 type;
 
-    if (!NT_SUCCESS(Status)) {
-        ERR("alloc_chunk returned %08x\n", Status);
+    if (fcb->Vcb->options.compress_type != 0 && fcb->prop_compression == PropCompression_None)
+        type = fcb->Vcb->options.compress_type;
+    else {
+        if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD) && fcb->prop_compression == PropCompression_ZSTD)
+            type = BTRFS_COMPRESSION_ZSTD;
+        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD && fcb->prop_compression != PropCompression_Zlib && fcb->prop_compression != PropCompression_LZO)
+            type = BTRFS_COMPRESSION_ZSTD;
+        else if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO) && fcb->prop_compression == PropCompression_LZO)
+            type = BTRFS_COMPRESSION_LZO;
+        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO && fcb->prop_compression != PropCompression_Zlib)
+            type = BTRFS_COMPRESSION_LZO;
+        else
+            type = BTRFS_COMPRESSION_ZLIB;
+    }
 
-        if (compression != BTRFS_COMPRESSION_NONE)
-            ExFreePool(comp_data);
+    if (type == BTRFS_COMPRESSION_ZSTD)
+        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD;
+    else if (type == BTRFS_COMPRESSION_LZO)
+        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO;
 
-        return Status;
-    }
+    return type;
+}
 
-    if (c) {
-        ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+// The compressibility heuristic is based on btrfs_compress_heuristic in Linux's fs/btrfs/compression.c.
+// We look at 16 bytes out of every 256, which for a full extent gives an 8 KB sample.
+#define SAMPLING_READ_SIZE 16
+#define SAMPLING_INTERVAL 256
 
-        if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-            if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, Irp, rollback, compression, end_data - start_data, FALSE, 0)) {
-                if (compression != BTRFS_COMPRESSION_NONE)
-                    ExFreePool(comp_data);
+#define BYTE_SET_THRESHOLD 64
+#define BYTE_CORE_SET_LOW 64
+#define BYTE_CORE_SET_HIGH 200
 
-                return STATUS_SUCCESS;
-            }
-        }
+#define ENTROPY_LVL_ACCEPTABLE 65
+#define ENTROPY_LVL_HIGH 80
 
-        ExReleaseResourceLite(&c->lock);
+#define PAIRS_HASH_BITS 8192
+#define PAIRS_REPEAT_THRESHOLD 50 // percentage of adjacent byte pairs which have been seen before
+
+static __inline UINT8 sample_byte(UINT8* data, UINT32 i) {
+    return data[((i / SAMPLING_READ_SIZE) * SAMPLING_INTERVAL) + (i % SAMPLING_READ_SIZE)];
+}
+
+// log2(n^4), which is precise enough for the entropy estimate without needing floating point
+static UINT32 log2_4(UINT64 n) {
+    UINT32 r = 0;
+
+    n = n * n * n * n;
+
+    while (n >>= 1) {
+        r++;
     }
 
-    WARN("couldn't find any data chunks with %llx bytes free\n", comp_length);
+    return r;
+}
+
+// For samples whose byte entropy is borderline: data where the same byte pairs keep coming up,
+// such as code or UTF-16 text, compresses better than the byte counts alone would suggest.
+static BOOL pairs_heuristic(UINT8* data, UINT32 sample_size) {
+    UINT8 seen[PAIRS_HASH_BITS / 8];
+    UINT32 i, pairs = 0, repeats = 0;
 
-    if (compression != BTRFS_COMPRESSION_NONE)
-        ExFreePool(comp_data);
+    RtlZeroMemory(seen, sizeof(seen));
 
-    return STATUS_DISK_FULL;
+    for (i = 0; i < sample_size; i++) {
+        UINT32 h;
+
+        // only bytes within the same read are adjacent
+        if ((i + 1) % SAMPLING_READ_SIZE == 0)
+            continue;
+
+        h = ((sample_byte(data, i) << 8) | sample_byte(data, i + 1)) % PAIRS_HASH_BITS;
+
+        if (seen[h / 8] & (1 << (h % 8)))
+            repeats++;
+        else
+            seen[h / 8] |= 1 << (h % 8);
+
+        pairs++;
+    }
+
+    return repeats * 100 >= pairs * PAIRS_REPEAT_THRESHOLD;
 }
 
-static NTSTATUS zstd_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, BOOL* compressed, PIRP Irp, LIST_ENTRY* rollback) {
-    NTSTATUS Status;
-    UINT8 compression;
-    UINT32 comp_length;
-    UINT8* comp_data;
-    UINT32 out_left;
-    LIST_ENTRY* le;
-    chunk* c;
-    ZSTD_CStream* stream;
-    size_t init_res, written;
-    ZSTD_inBuffer input;
-    ZSTD_outBuffer output;
-    ZSTD_parameters params;
+static BOOL compress_heuristic(UINT8* data, UINT32 len) {
+    UINT32 counts[256];
+    UINT32 sample_size, i, j, num, sum, entropy, sz_base;
 
-    comp_data = ExAllocatePoolWithTag(PagedPool, (UINT32)(end_data - start_data), ALLOC_TAG);
-    if (!comp_data) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
+    sample_size = (len / SAMPLING_INTERVAL) * SAMPLING_READ_SIZE;
+
+    if (sample_size == 0) // too small to judge
+        return TRUE;
+
+    // data which repeats itself compresses well
+    for (i = 0; i < sample_size / 2; i++) {
+        if (sample_byte(data, i) != sample_byte(data, i + (sample_size / 2)))
+            break;
     }
 
-    Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
-    if (!NT_SUCCESS(Status)) {
-        ERR("excise_extents returned %08x\n", Status);
-        ExFreePool(comp_data);
-        return Status;
+    if (i == sample_size / 2)
+        return TRUE;
+
+    RtlZeroMemory(counts, sizeof(counts));
+
+    for (i = 0; i < sample_size; i++) {
+        counts[sample_byte(data, i)]++;
+    }
+
+    // only a few distinct byte values, e.g. text
+    num = 0;
+    for (i = 0; i < 256; i++) {
+        if (counts[i] > 0)
+            num++;
     }
 
-    stream = ZSTD_createCStream_advanced(zstd_mem);
+    if (num < BYTE_SET_THRESHOLD)
+        return TRUE;
 
-    if (!stream) {
-        ERR("ZSTD_createCStream failed.\n");
-        ExFreePool(comp_data);
-        return STATUS_INTERNAL_ERROR;
+    // sort counts in descending order
+    for (i = 1; i < 256; i++) {
+        UINT32 c = counts[i];
+
+        j = i;
+        while (j > 0 && counts[j - 1] < c) {
+            counts[j] = counts[j - 1];
+            j--;
+        }
+
+        counts[j] = c;
     }
 
-    params = ZSTD_getParams(fcb->Vcb->options.zstd_level, (UINT32)(end_data - start_data), 0);
+    // the number of byte values which make up 90% of the sample
+    num = 0;
+    sum = 0;
+    while (num < 256 && sum < sample_size * 90 / 100) {
+        sum += counts[num];
+        num++;
+    }
 
-    if (params.cParams.windowLog > ZSTD_BTRFS_MAX_WINDOWLOG)
-        params.cParams.windowLog = ZSTD_BTRFS_MAX_WINDOWLOG;
+    if (num <= BYTE_CORE_SET_LOW)
+        return TRUE;
 
-    init_res = ZSTD_initCStream_advanced(stream, NULL, 0, params, (UINT32)(end_data - start_data));
+    if (num >= BYTE_CORE_SET_HIGH)
+        return FALSE;
 
-    if (ZSTD_isError(init_res)) {
-        ERR("ZSTD_initCStream_advanced failed: %s\n", ZSTD_getErrorName(init_res));
-        ZSTD_freeCStream(stream);
-        ExFreePool(comp_data);
-        return STATUS_INTERNAL_ERROR;
+    // Shannon entropy, as a percentage of the maximum of 8 bits per byte
+    sz_base = log2_4(sample_size);
+    sum = 0;
+
+    for (i = 0; i < 256 && counts[i] > 0; i++) {
+        sum += counts[i] * (sz_base - log2_4(counts[i]));
     }
 
-    input.src = data;
-    input.size = (UINT32)(end_data - start_data);
-    input.pos = 0;
+    entropy = (sum / sample_size) * 100 / (8 * log2_4(2));
 
-    output.dst = comp_data;
-    output.size = (UINT32)(end_data - start_data);
-    output.pos = 0;
+    if (entropy < ENTROPY_LVL_ACCEPTABLE)
+        return TRUE;
 
-    while (input.pos < input.size && output.pos < output.size) {
-        written = ZSTD_compressStream(stream, &output, &input);
+    if (entropy >= ENTROPY_LVL_HIGH)
+        return FALSE;
 
-        if (ZSTD_isError(written)) {
-            ERR("ZSTD_compressStream failed: %s\n", ZSTD_getErrorName(written));
-            ZSTD_freeCStream(stream);
-            ExFreePool(comp_data);
-            return STATUS_INTERNAL_ERROR;
-        }
+    return pairs_heuristic(data, sample_size);
+}
+
+// Compresses one extent's worth of data. This doesn't touch the fcb or the trees, so it can be
+// run on a calc thread. If compressing wouldn't save at least a sector, or the data doesn't look
+// as if it would compress, *comp_data is set to NULL.
+NTSTATUS compress_extent(device_extension* Vcb, UINT8 type, UINT8* data, UINT32 len, UINT8** comp_data, UINT32* comp_length) {
+    NTSTATUS Status;
+    UINT8* buf;
+    UINT32 buflen, cl;
+
+    if (!Vcb->options.compress_force && !compress_heuristic(data, len)) {
+        *comp_data = NULL;
+        *comp_length = len;
+        return STATUS_SUCCESS;
     }
 
-    written = ZSTD_endStream(stream, &output);
-    if (ZSTD_isError(written)) {
-        ERR("ZSTD_endStream failed: %s\n", ZSTD_getErrorName(written));
-        ZSTD_freeCStream(stream);
-        ExFreePool(comp_data);
-        return STATUS_INTERNAL_ERROR;
+    if (type == BTRFS_COMPRESSION_LZO) {
+        ULONG num_pages = (ULONG)((sector_align(len, LINUX_PAGE_SIZE)) / LINUX_PAGE_SIZE);
+
+        // Four-byte overall header
+        // Another four-byte header page
+        // Each page has a maximum size of lzo_max_outlen(LINUX_PAGE_SIZE)
+        // Plus another four bytes for possible padding
+        buflen = sizeof(UINT32) + ((lzo_max_outlen(LINUX_PAGE_SIZE) + (2 * sizeof(UINT32))) * num_pages);
+    } else
+        buflen = len;
+
+    buf = ExAllocatePoolWithTag(PagedPool, buflen, ALLOC_TAG);
+    if (!buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    ZSTD_freeCStream(stream);
+    if (type == BTRFS_COMPRESSION_ZSTD)
+        Status = zstd_compress(data, len, buf, buflen, Vcb->options.zstd_level, &cl);
+    else if (type == BTRFS_COMPRESSION_LZO)
+        Status = lzo_compress(data, len, buf, &cl);
+    else
+        Status = zlib_compress(data, len, buf, buflen, Vcb->options.zlib_level, &cl);
+
+    if (!NT_SUCCESS(Status) && type == BTRFS_COMPRESSION_LZO) // write LZO failures uncompressed, as before
+        cl = len;
+    else if (!NT_SUCCESS(Status)) {
+        ExFreePool(buf);
+        return Status;
+    }
 
-    out_left = output.size - output.pos;
+    if (len < Vcb->superblock.sector_size || cl > len - Vcb->superblock.sector_size) { // compressed extent would be larger than or same size as uncompressed extent
+        ExFreePool(buf);
+        *comp_data = NULL;
+        *comp_length = len;
+        return STATUS_SUCCESS;
+    }
 
-    if (out_left < fcb->Vcb->superblock.sector_size) { // compressed extent would be larger than or same size as uncompressed extent
-        ExFreePool(comp_data);
+    *comp_length = (UINT32)sector_align(cl, Vcb->superblock.sector_size);
+    RtlZeroMemory(buf + cl, *comp_length - cl);
 
-        comp_length = (UINT32)(end_data - start_data);
-        comp_data = data;
-        compression = BTRFS_COMPRESSION_NONE;
+    *comp_data = buf;
 
-        *compressed = FALSE;
-    } else {
-        UINT32 cl;
+    return STATUS_SUCCESS;
+}
 
-        compression = BTRFS_COMPRESSION_ZSTD;
-        cl = (UINT32)(end_data - start_data - out_left);
-        comp_length = (UINT32)sector_align(cl, fcb->Vcb->superblock.sector_size);
+NTSTATUS write_compressed_extent(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, UINT8 compression, UINT8* comp_data, UINT32 comp_length,
+                                 PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    chunk* c;
 
-        RtlZeroMemory(comp_data + cl, comp_length - cl);
+    if (!comp_data) {
+        compression = BTRFS_COMPRESSION_NONE;
+        comp_data = data;
+        comp_length = (UINT32)(end_data - start_data);
+    }
 
-        *compressed = TRUE;
+    Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("excise_extents returned %08x\n", Status);
+        return Status;
     }
 
     ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, TRUE);
@@ -1028,10 +1204,6 @@ static NTSTATUS zstd_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 en
             if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
                 if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, Irp, rollback, compression, end_data - start_data, FALSE, 0)) {
                     ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
-
-                    if (compression != BTRFS_COMPRESSION_NONE)
-                        ExFreePool(comp_data);
-
                     return STATUS_SUCCESS;
                 }
             }
@@ -1052,10 +1224,6 @@ static NTSTATUS zstd_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 en
 
     if (!NT_SUCCESS(Status)) {
         ERR("alloc_chunk returned %08x\n", Status);
-
-        if (compression != BTRFS_COMPRESSION_NONE)
-            ExFreePool(comp_data);
-
         return Status;
     }
 
@@ -1063,85 +1231,44 @@ static NTSTATUS zstd_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 en
         ExAcquireResourceExclusiveLite(&c->lock, TRUE);
 
         if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-            if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, Irp, rollback, compression, end_data - start_data, FALSE, 0)) {
-                if (compression != BTRFS_COMPRESSION_NONE)
-                    ExFreePool(comp_data);
-
+            if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, Irp, rollback, compression, end_data - start_data, FALSE, 0))
                 return STATUS_SUCCESS;
-            }
         }
 
         ExReleaseResourceLite(&c->lock);
     }
 
-    WARN("couldn't find any data chunks with %llx bytes free\n", comp_length);
-
-    if (compression != BTRFS_COMPRESSION_NONE)
-        ExFreePool(comp_data);
+    WARN("couldn't find any data chunks with %x bytes free\n", comp_length);
 
     return STATUS_DISK_FULL;
 }
 
-NTSTATUS write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, BOOL* compressed, PIRP Irp, LIST_ENTRY* rollback) {
-    UINT8 type;
-
-    if (fcb->Vcb->options.compress_type != 0 && fcb->prop_compression == PropCompression_None)
-        type = fcb->Vcb->options.compress_type;
-    else {
-        if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD) && fcb->prop_compression == PropCompression_ZSTD)
-            type = BTRFS_COMPRESSION_ZSTD;
-        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD && fcb->prop_compression != PropCompression_Zlib && fcb->prop_compression != PropCompression_LZO)
-            type = BTRFS_COMPRESSION_ZSTD;
-        else if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO) && fcb->prop_compression == PropCompression_LZO)
-            type = BTRFS_COMPRESSION_LZO;
-        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO && fcb->prop_compression != PropCompression_Zlib)
-            type = BTRFS_COMPRESSION_LZO;
-        else
-            type = BTRFS_COMPRESSION_ZLIB;
-    }
-
-    if (type == BTRFS_COMPRESSION_ZSTD) {
-        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD;
-        return zstd_write_compressed_bit(fcb, start_data, end_data, data, compressed, Irp, rollback);
-    } else if (type == BTRFS_COMPRESSION_LZO) {
-        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO;
-        return lzo_write_compressed_bit(fcb, start_data, end_data, data, compressed, Irp, rollback);
-    } else
-        return zlib_write_compressed_bit(fcb, start_data, end_data, data, compressed, Irp, rollback);
-}
-
-static void* zstd_malloc(void* opaque, size_t size) {
-    UNUSED(opaque);
-
-    return ExAllocatePoolWithTag(PagedPool, size, ZSTD_ALLOC_TAG);
-}
-
-static void zstd_free(void* opaque, void* address) {
-    UNUSED(opaque);
-
-    ExFreePool(address);
-}
-
 NTSTATUS zstd_decompress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen) {
-    NTSTATUS Status;
-    ZSTD_DStream* stream;
+    comp_context* ctx;
     size_t init_res, read;
     ZSTD_inBuffer input;
     ZSTD_outBuffer output;
 
-    stream = ZSTD_createDStream_advanced(zstd_mem);
+    ctx = get_comp_context();
+    if (!ctx)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    if (!ctx->zstd_dstream) {
+        ctx->zstd_dstream = ZSTD_createDStream_advanced(comp_context_zstd_mem);
 
-    if (!stream) {
-        ERR("ZSTD_createDStream failed.\n");
-        return STATUS_INTERNAL_ERROR;
+        if (!ctx->zstd_dstream) {
+            ERR("ZSTD_createDStream failed.\n");
+            put_comp_context(ctx);
+            return STATUS_INTERNAL_ERROR;
+        }
     }
 
-    init_res = ZSTD_initDStream(stream);
+    init_res = ZSTD_initDStream(ctx->zstd_dstream);
 
     if (ZSTD_isError(init_res)) {
         ERR("ZSTD_initDStream failed: %s\n", ZSTD_getErrorName(init_res));
-        Status = STATUS_INTERNAL_ERROR;
-        goto end;
+        destroy_comp_context(ctx);
+        return STATUS_INTERNAL_ERROR;
     }
 
     input.src = inbuf;
@@ -1152,18 +1279,15 @@ NTSTATUS zstd_decompress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outle
     output.size = outlen;
     output.pos = 0;
 
-    read = ZSTD_decompressStream(stream, &output, &input);
+    read = ZSTD_decompressStream(ctx->zstd_dstream, &output, &input);
 
     if (ZSTD_isError(read)) {
         ERR("ZSTD_decompressStream failed: %s\n", ZSTD_getErrorName(read));
-        Status = STATUS_INTERNAL_ERROR;
-        goto end;
+        destroy_comp_context(ctx);
+        return STATUS_INTERNAL_ERROR;
     }
 
-    Status = STATUS_SUCCESS;
+    put_comp_context(ctx);
 
-end:
-    ZSTD_freeDStream(stream);
-
-    return Status;
+    return STATUS_SUCCESS;
 }
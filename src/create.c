@@ -77,6 +77,7 @@ fcb* create_fcb(device_extension* Vcb, POOL_TYPE pool_type) {
     fcb->Header.Resource = &fcb->nonpaged->resource;
 
     ExInitializeResourceLite(&fcb->nonpaged->dir_children_lock);
+    ExInitializeFastMutex(&fcb->nonpaged->dir_atts_mutex);
 
     FsRtlInitializeFileLock(&fcb->lock, NULL, NULL);
 
@@ -123,13 +124,51 @@ file_ref* create_fileref(device_extension* Vcb) {
     return fr;
 }
 
+static BOOL neg_cache_lookup(dir_neg_cache* nc, UINT32 hash, BOOL case_sensitive) {
+    UINT32* hashes = case_sensitive ? nc->hash : nc->hash_uc;
+    ULONG i;
+
+    for (i = 0; i < DIR_NEG_CACHE_SIZE; i++) {
+        if (hashes[i] == hash)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+// Called with dir_children_lock held, so nothing can be added to the directory meanwhile. Concurrent lookups
+// only ever write whole slots, so we can get away without a lock of our own.
+static void neg_cache_add(fcb* fcb, UINT32 hash, BOOL case_sensitive) {
+    dir_neg_cache* nc = fcb->neg_cache;
+    ULONG i;
+
+    if (!nc) {
+        nc = ExAllocatePoolWithTag(PagedPool, sizeof(dir_neg_cache), ALLOC_TAG);
+        if (!nc) {
+            ERR("out of memory\n");
+            return;
+        }
+
+        RtlZeroMemory(nc, sizeof(dir_neg_cache));
+
+        if (InterlockedCompareExchangePointer((PVOID*)&fcb->neg_cache, nc, NULL)) {
+            ExFreePool(nc);
+            nc = fcb->neg_cache;
+        }
+    }
+
+    i = (ULONG)InterlockedIncrement(case_sensitive ? &nc->next : &nc->next_uc) % DIR_NEG_CACHE_SIZE;
+
+    InterlockedExchange((LONG*)(case_sensitive ? &nc->hash[i] : &nc->hash_uc[i]), (LONG)hash);
+}
+
 NTSTATUS find_file_in_dir(PUNICODE_STRING filename, fcb* fcb, root** subvol, UINT64* inode, dir_child** pdc, BOOL case_sensitive) {
     NTSTATUS Status;
     UNICODE_STRING fnus;
     UINT32 hash;
     LIST_ENTRY* le;
     UINT8 c;
-    BOOL locked = FALSE;
+    BOOL locked = FALSE, hash_seen = FALSE;
 
     if (!case_sensitive) {
         Status = RtlUpcaseUnicodeString(&fnus, filename, TRUE);
@@ -150,11 +189,17 @@ NTSTATUS find_file_in_dir(PUNICODE_STRING filename, fcb* fcb, root** subvol, UIN
         locked = TRUE;
     }
 
+    if (hash != 0 && fcb->neg_cache && neg_cache_lookup(fcb->neg_cache, hash, case_sensitive)) {
+#ifdef DEBUG_STATS
+        fcb->Vcb->stats.neg_lookup_hits++;
+#endif
+        Status = STATUS_OBJECT_NAME_NOT_FOUND;
+        goto end;
+    }
+
     if (case_sensitive) {
-        if (!fcb->hash_ptrs[c]) {
-            Status = STATUS_OBJECT_NAME_NOT_FOUND;
-            goto end;
-        }
+        if (!fcb->hash_ptrs[c])
+            goto notfound;
 
         le = fcb->hash_ptrs[c];
         while (le != &fcb->dir_children_hash) {
@@ -163,21 +208,7 @@ NTSTATUS find_file_in_dir(PUNICODE_STRING filename, fcb* fcb, root** subvol, UIN
             if (dc->hash == hash) {
                 if (dc->name.Length == fnus.Length && RtlCompareMemory(dc->name.Buffer, fnus.Buffer, fnus.Length) == fnus.Length) {
                     if (dc->key.obj_type == TYPE_ROOT_ITEM) {
-                        LIST_ENTRY* le2;
-
-                        *subvol = NULL;
-
-                        le2 = fcb->Vcb->roots.Flink;
-                        while (le2 != &fcb->Vcb->roots) {
-                            root* r2 = CONTAINING_RECORD(le2, root, list_entry);
-
-                            if (r2->id == dc->key.obj_id) {
-                                *subvol = r2;
-                                break;
-                            }
-
-                            le2 = le2->Flink;
-                        }
+                        *subvol = find_root(fcb->Vcb, dc->key.obj_id);
 
                         *inode = SUBVOL_ROOT_INODE;
                     } else {
@@ -190,18 +221,16 @@ NTSTATUS find_file_in_dir(PUNICODE_STRING filename, fcb* fcb, root** subvol, UIN
                     Status = STATUS_SUCCESS;
                     goto end;
                 }
-            } else if (dc->hash > hash) {
-                Status = STATUS_OBJECT_NAME_NOT_FOUND;
-                goto end;
-            }
+
+                hash_seen = TRUE;
+            } else if (dc->hash > hash)
+                goto notfound;
 
             le = le->Flink;
         }
     } else {
-        if (!fcb->hash_ptrs_uc[c]) {
-            Status = STATUS_OBJECT_NAME_NOT_FOUND;
-            goto end;
-        }
+        if (!fcb->hash_ptrs_uc[c])
+            goto notfound;
 
         le = fcb->hash_ptrs_uc[c];
         while (le != &fcb->dir_children_hash_uc) {
@@ -210,21 +239,7 @@ NTSTATUS find_file_in_dir(PUNICODE_STRING filename, fcb* fcb, root** subvol, UIN
             if (dc->hash_uc == hash) {
                 if (dc->name_uc.Length == fnus.Length && RtlCompareMemory(dc->name_uc.Buffer, fnus.Buffer, fnus.Length) == fnus.Length) {
                     if (dc->key.obj_type == TYPE_ROOT_ITEM) {
-                        LIST_ENTRY* le2;
-
-                        *subvol = NULL;
-
-                        le2 = fcb->Vcb->roots.Flink;
-                        while (le2 != &fcb->Vcb->roots) {
-                            root* r2 = CONTAINING_RECORD(le2, root, list_entry);
-
-                            if (r2->id == dc->key.obj_id) {
-                                *subvol = r2;
-                                break;
-                            }
-
-                            le2 = le2->Flink;
-                        }
+                        *subvol = find_root(fcb->Vcb, dc->key.obj_id);
 
                         *inode = SUBVOL_ROOT_INODE;
                     } else {
@@ -237,15 +252,24 @@ NTSTATUS find_file_in_dir(PUNICODE_STRING filename, fcb* fcb, root** subvol, UIN
                     Status = STATUS_SUCCESS;
                     goto end;
                 }
-            } else if (dc->hash_uc > hash) {
-                Status = STATUS_OBJECT_NAME_NOT_FOUND;
-                goto end;
-            }
+
+                hash_seen = TRUE;
+            } else if (dc->hash_uc > hash)
+                goto notfound;
 
             le = le->Flink;
         }
     }
 
+notfound:
+#ifdef DEBUG_STATS
+    fcb->Vcb->stats.neg_lookup_misses++;
+#endif
+
+    // only remember the hash if no entry has it, so that a different name with the same hash can't be wrongly cached
+    if (hash != 0 && !hash_seen)
+        neg_cache_add(fcb, hash, case_sensitive);
+
     Status = STATUS_OBJECT_NAME_NOT_FOUND;
 
 end:
@@ -487,6 +511,7 @@ NTSTATUS load_dir_children(_Requires_lock_held_(_Curr_->tree_lock) device_extens
         dc->index = tp.item->key.offset;
         dc->type = di->type;
         dc->fileref = NULL;
+        dc->atts = NULL;
 
         dc->utf8.MaximumLength = dc->utf8.Length = di->n;
         dc->utf8.Buffer = ExAllocatePoolWithTag(PagedPool, di->n, ALLOC_TAG);
@@ -578,6 +603,8 @@ NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lo
                         InterlockedIncrement(&fcb->refcount);
 #endif
 
+                        revive_fcb(Vcb, fcb);
+
                         *pfcb = fcb;
                         return STATUS_SUCCESS;
                     }
@@ -1084,6 +1111,8 @@ NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lo
     if (!sd_set)
         fcb_get_sd(fcb, parent, FALSE, Irp);
 
+    fcb_intern_sd(fcb);
+
     if (fcb->type == BTRFS_TYPE_DIRECTORY && fcb->atts & FILE_ATTRIBUTE_REPARSE_POINT && fcb->reparse_xattr.Length == 0) {
         fcb->atts &= ~FILE_ATTRIBUTE_REPARSE_POINT;
 
@@ -1594,6 +1623,7 @@ NTSTATUS add_dir_child(fcb* fcb, UINT64 inode, BOOL subvol, PANSI_STRING utf8, P
     dc->key.offset = subvol ? 0xffffffffffffffff : 0;
     dc->type = type;
     dc->fileref = NULL;
+    dc->atts = NULL;
 
     dc->utf8.Length = dc->utf8.MaximumLength = utf8->Length;
     RtlCopyMemory(dc->utf8.Buffer, utf8->Buffer, utf8->Length);
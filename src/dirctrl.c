@@ -23,6 +23,9 @@ enum DirEntryType {
     DirEntryType_Parent
 };
 
+// number of directory entries whose attributes query_directory looks up at once
+#define DIR_ATTS_PREFETCH 64
+
 typedef struct {
     KEY key;
     UNICODE_STRING name;
@@ -81,41 +84,234 @@ end:
     return tag;
 }
 
+static ULONG get_ea_len_from_data(UINT8* eadata, UINT16 len) {
+    ULONG offset;
+    NTSTATUS Status;
+
+    if (!eadata)
+        return 0;
+
+    Status = IoCheckEaBufferValidity((FILE_FULL_EA_INFORMATION*)eadata, len, &offset);
+
+    if (!NT_SUCCESS(Status)) {
+        WARN("IoCheckEaBufferValidity returned %08x (error at offset %u)\n", Status, offset);
+        return 0;
+    } else {
+        FILE_FULL_EA_INFORMATION* eainfo;
+        ULONG ealen;
+
+        ealen = 4;
+        eainfo = (FILE_FULL_EA_INFORMATION*)eadata;
+        do {
+            ealen += 5 + eainfo->EaNameLength + eainfo->EaValueLength;
+
+            if (eainfo->NextEntryOffset == 0)
+                break;
+
+            eainfo = (FILE_FULL_EA_INFORMATION*)(((UINT8*)eainfo) + eainfo->NextEntryOffset);
+        } while (TRUE);
+
+        return ealen;
+    }
+}
+
 static ULONG get_ea_len(device_extension* Vcb, root* subvol, UINT64 inode, PIRP Irp) {
     UINT8* eadata;
     UINT16 len;
 
     if (get_xattr(Vcb, subvol, inode, EA_EA, EA_EA_HASH, &eadata, &len, Irp)) {
-        ULONG offset;
-        NTSTATUS Status;
-
-        Status = IoCheckEaBufferValidity((FILE_FULL_EA_INFORMATION*)eadata, len, &offset);
+        ULONG ealen = get_ea_len_from_data(eadata, len);
 
-        if (!NT_SUCCESS(Status)) {
-            WARN("IoCheckEaBufferValidity returned %08x (error at offset %u)\n", Status, offset);
+        if (eadata)
             ExFreePool(eadata);
-            return 0;
-        } else {
-            FILE_FULL_EA_INFORMATION* eainfo;
-            ULONG ealen;
 
-            ealen = 4;
-            eainfo = (FILE_FULL_EA_INFORMATION*)eadata;
-            do {
-                ealen += 5 + eainfo->EaNameLength + eainfo->EaValueLength;
+        return ealen;
+    } else
+        return 0;
+}
 
-                if (eainfo->NextEntryOffset == 0)
-                    break;
+typedef struct {
+    dir_child* dc;
+    UINT64 inode;
+    BOOL found;
+    INODE_ITEM ii;
+    char* dosattrib;
+    UINT16 dosattrib_len;
+    UINT8* eadata;
+    UINT16 ealen;
+} dir_atts_prefetch;
 
-                eainfo = (FILE_FULL_EA_INFORMATION*)(((UINT8*)eainfo) + eainfo->NextEntryOffset);
-            } while (TRUE);
+static BOOL get_cached_dir_atts(fcb* fcb, dir_child* dc, INODE_ITEM* ii, ULONG* atts, ULONG* ealen, BOOL* cached) {
+    BOOL found = FALSE;
 
-            ExFreePool(eadata);
+    *cached = FALSE;
+
+    ExAcquireFastMutex(&fcb->nonpaged->dir_atts_mutex);
+
+    // the tree only changes when flushing, which bumps the generation
+    if (dc->atts && dc->atts->generation == fcb->Vcb->superblock.generation) {
+        *cached = TRUE;
 
-            return ealen;
+        if (!dc->atts->missing) {
+            *ii = dc->atts->inode_item;
+            *atts = dc->atts->atts;
+            *ealen = dc->atts->ealen;
+            found = TRUE;
         }
-    } else
-        return 0;
+    }
+
+    ExReleaseFastMutex(&fcb->nonpaged->dir_atts_mutex);
+
+    return found;
+}
+
+// Gathers the INODE_ITEMs and xattrs for the next few entries of a directory listing, starting at dc. Rather than
+// searching the tree separately for each item, we sort the entries by inode and pick everything up in one forward pass.
+static void prefetch_dir_atts(fcb* fcb, root* r, dir_child* dc, PIRP Irp) {
+    device_extension* Vcb = fcb->Vcb;
+    dir_atts_prefetch* entries;
+    ULONG num = 0, num_searched = 0, i;
+    LIST_ENTRY* le;
+    traverse_ptr tp, next_tp;
+    BOOL have_tp = FALSE;
+    NTSTATUS Status;
+
+    entries = ExAllocatePoolWithTag(PagedPool, sizeof(dir_atts_prefetch) * DIR_ATTS_PREFETCH, ALLOC_TAG);
+    if (!entries) {
+        ERR("out of memory\n");
+        return;
+    }
+
+    ExAcquireFastMutex(&fcb->nonpaged->dir_atts_mutex);
+
+    le = &dc->list_entry_index;
+    while (le != &fcb->dir_children_index && num < DIR_ATTS_PREFETCH) {
+        dir_child* dc2 = CONTAINING_RECORD(le, dir_child, list_entry_index);
+
+        if (dc2->key.obj_type == TYPE_INODE_ITEM && !dc2->fileref && (!dc2->atts || dc2->atts->generation != Vcb->superblock.generation)) {
+            ULONG j = num;
+
+            while (j > 0 && entries[j - 1].inode > dc2->key.obj_id) {
+                entries[j] = entries[j - 1];
+                j--;
+            }
+
+            RtlZeroMemory(&entries[j], sizeof(dir_atts_prefetch));
+            entries[j].dc = dc2;
+            entries[j].inode = dc2->key.obj_id;
+            num++;
+        }
+
+        le = le->Flink;
+    }
+
+    ExReleaseFastMutex(&fcb->nonpaged->dir_atts_mutex);
+
+    for (i = 0; i < num; i++) {
+        KEY searchkey;
+
+        // hard links to the same inode sort together, and we've already gone past its items
+        if (i > 0 && entries[i].inode == entries[i - 1].inode)
+            continue;
+
+        searchkey.obj_id = entries[i].inode;
+        searchkey.obj_type = TYPE_INODE_ITEM;
+        searchkey.offset = 0;
+
+        // only search from the top again if the inode's items aren't in the leaf we're already in
+        if (have_tp) {
+            tree_data* last = CONTAINING_RECORD(tp.tree->itemlist.Blink, tree_data, list_entry);
+
+            if (keycmp(last->key, searchkey) == -1)
+                have_tp = FALSE;
+        }
+
+        if (!have_tp) {
+            Status = find_item(Vcb, r, &tp, &searchkey, FALSE, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("find_item returned %08x\n", Status);
+                break;
+            }
+
+            have_tp = TRUE;
+        }
+
+        while (keycmp(tp.item->key, searchkey) == -1) {
+            // off the end of the tree, so none of the rest exist
+            if (!find_next_item(Vcb, &tp, &next_tp, FALSE, Irp)) {
+                num_searched = num;
+                goto end;
+            }
+
+            tp = next_tp;
+        }
+
+        while (tp.item->key.obj_id == entries[i].inode && tp.item->key.obj_type <= TYPE_XATTR_ITEM) {
+            if (tp.item->key.obj_type == TYPE_INODE_ITEM) {
+                RtlZeroMemory(&entries[i].ii, sizeof(INODE_ITEM));
+
+                if (tp.item->size > 0)
+                    RtlCopyMemory(&entries[i].ii, tp.item->data, min(sizeof(INODE_ITEM), tp.item->size));
+
+                entries[i].found = TRUE;
+            } else if (tp.item->key.obj_type == TYPE_XATTR_ITEM && tp.item->size >= sizeof(DIR_ITEM)) {
+                if (tp.item->key.offset == EA_DOSATTRIB_HASH && !entries[i].dosattrib)
+                    extract_xattr(tp.item->data, tp.item->size, EA_DOSATTRIB, (UINT8**)&entries[i].dosattrib, &entries[i].dosattrib_len);
+                else if (tp.item->key.offset == EA_EA_HASH && !entries[i].eadata)
+                    extract_xattr(tp.item->data, tp.item->size, EA_EA, &entries[i].eadata, &entries[i].ealen);
+            }
+
+            if (!find_next_item(Vcb, &tp, &next_tp, FALSE, Irp))
+                break;
+
+            tp = next_tp;
+        }
+    }
+
+    // we also cache which inodes weren't found, so that we don't keep looking for them
+    num_searched = i;
+
+end:
+    ExAcquireFastMutex(&fcb->nonpaged->dir_atts_mutex);
+
+    for (i = 0; i < num_searched; i++) {
+        dir_child* dc2 = entries[i].dc;
+        dir_atts_prefetch* src = &entries[i];
+        BOOL dotfile = dc2->name.Length > sizeof(WCHAR) && dc2->name.Buffer[0] == '.';
+
+        // hard links share the results of the first entry for their inode
+        while (src > entries && (src - 1)->inode == entries[i].inode)
+            src--;
+
+        if (!dc2->atts) {
+            dc2->atts = ExAllocatePoolWithTag(PagedPool, sizeof(dir_child_atts), ALLOC_TAG);
+            if (!dc2->atts) {
+                ERR("out of memory\n");
+                continue;
+            }
+        }
+
+        dc2->atts->generation = Vcb->superblock.generation;
+        dc2->atts->missing = !src->found;
+
+        if (src->found) {
+            dc2->atts->inode_item = src->ii;
+            dc2->atts->atts = get_file_attributes_from_dosattrib(r, src->inode, dc2->type, dotfile, src->dosattrib, src->dosattrib_len);
+            dc2->atts->ealen = get_ea_len_from_data(src->eadata, src->ealen);
+        }
+    }
+
+    ExReleaseFastMutex(&fcb->nonpaged->dir_atts_mutex);
+
+    for (i = 0; i < num; i++) {
+        if (entries[i].dosattrib)
+            ExFreePool(entries[i].dosattrib);
+
+        if (entries[i].eadata)
+            ExFreePool(entries[i].eadata);
+    }
+
+    ExFreePool(entries);
 }
 
 static NTSTATUS query_dir_item(fcb* fcb, ccb* ccb, void* buf, LONG* len, PIRP Irp, dir_entry* de, root* r) {
@@ -130,21 +326,7 @@ static NTSTATUS query_dir_item(fcb* fcb, ccb* ccb, void* buf, LONG* len, PIRP Ir
     IrpSp = IoGetCurrentIrpStackLocation(Irp);
 
     if (de->key.obj_type == TYPE_ROOT_ITEM) { // subvol
-        LIST_ENTRY* le;
-
-        r = NULL;
-
-        le = fcb->Vcb->roots.Flink;
-        while (le != &fcb->Vcb->roots) {
-            root* subvol = CONTAINING_RECORD(le, root, list_entry);
-
-            if (subvol->id == de->key.obj_id) {
-                r = subvol;
-                break;
-            }
-
-            le = le->Flink;
-        }
+        r = find_root(fcb->Vcb, de->key.obj_id);
 
         if (r && r->parent != fcb->subvol->id)
             r = NULL;
@@ -169,13 +351,20 @@ static NTSTATUS query_dir_item(fcb* fcb, ccb* ccb, void* buf, LONG* len, PIRP Ir
                     win_time_to_unix(time, &ii.otime);
                     ii.st_atime = ii.st_mtime = ii.st_ctime = ii.otime;
                 } else {
-                    BOOL found = FALSE;
+                    BOOL found = FALSE, cached;
 
                     if (de->dc && de->dc->fileref && de->dc->fileref->fcb) {
                         ii = de->dc->fileref->fcb->inode_item;
                         atts = de->dc->fileref->fcb->atts;
                         ealen = de->dc->fileref->fcb->ealen;
                         found = TRUE;
+                    } else if (de->dc && de->key.obj_type == TYPE_INODE_ITEM) {
+                        found = get_cached_dir_atts(fcb, de->dc, &ii, &atts, &ealen, &cached);
+
+                        if (!cached && !ccb->specific_file && !(IrpSp->Flags & SL_RETURN_SINGLE_ENTRY)) {
+                            prefetch_dir_atts(fcb, r, de->dc, Irp);
+                            found = get_cached_dir_atts(fcb, de->dc, &ii, &atts, &ealen, &cached);
+                        }
                     }
 
                     if (!found) {
@@ -1211,6 +1211,9 @@ void insert_dir_child_into_hash_lists(fcb* fcb, dir_child* dc) {
     LIST_ENTRY* le;
     UINT8 c, d;
 
+    if (fcb->neg_cache)
+        RtlZeroMemory(fcb->neg_cache, sizeof(dir_neg_cache));
+
     c = dc->hash >> 24;
 
     inserted = FALSE;
@@ -3291,8 +3294,7 @@ NTSTATUS open_fileref_by_inode(_Requires_exclusive_lock_held_(_Curr_->fcb_lock)
 
         if (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type == searchkey.obj_type) {
             ROOT_REF* rr = (ROOT_REF*)tp.item->data;
-            LIST_ENTRY* le;
-            root* r = NULL;
+            root* r;
             ULONG stringlen;
 
             if (tp.item->size < sizeof(ROOT_REF)) {
@@ -3309,17 +3311,7 @@ NTSTATUS open_fileref_by_inode(_Requires_exclusive_lock_held_(_Curr_->fcb_lock)
                 return STATUS_INTERNAL_ERROR;
             }
 
-            le = Vcb->roots.Flink;
-            while (le != &Vcb->roots) {
-                root* r2 = CONTAINING_RECORD(le, root, list_entry);
-
-                if (r2->id == tp.item->key.offset) {
-                    r = r2;
-                    break;
-                }
-
-                le = le->Flink;
-            }
+            r = find_root(Vcb, tp.item->key.offset);
 
             if (!r) {
                 ERR("couldn't find subvol %llx\n", tp.item->key.offset);
@@ -2820,6 +2820,7 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
     nt->is_unique = TRUE;
     nt->list_entry_hash.Flink = NULL;
     nt->buf = NULL;
+    nt->item_array = NULL;
     InitializeListHead(&nt->itemlist);
 
     oldlastitem = CONTAINING_RECORD(newfirstitem->list_entry.Blink, tree_data, list_entry);
@@ -2831,6 +2832,7 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
 
     t->itemlist.Blink = &oldlastitem->list_entry;
     t->itemlist.Blink->Flink = &t->itemlist;
+    t->item_array = NULL;
 
     nt->size = t->size - size;
     t->size = size;
@@ -2887,9 +2889,11 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
         td->key = newfirstitem->key;
 
         InsertHeadList(&t->paritem->list_entry, &td->list_entry);
+        nt->parent->item_array = NULL;
 
         td->ignore = FALSE;
         td->inserted = TRUE;
+        td->array = NULL;
         td->treeholder.tree = nt;
         nt->paritem = td;
 
@@ -2931,6 +2935,7 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
     pt->is_unique = TRUE;
     pt->list_entry_hash.Flink = NULL;
     pt->buf = NULL;
+    pt->item_array = NULL;
     InitializeListHead(&pt->itemlist);
 
     InsertTailList(&Vcb->trees, &pt->list_entry);
@@ -2944,6 +2949,7 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
     get_first_item(t, &td->key);
     td->ignore = FALSE;
     td->inserted = FALSE;
+    td->array = NULL;
     td->treeholder.address = 0;
     td->treeholder.generation = Vcb->superblock.generation;
     td->treeholder.tree = t;
@@ -2959,6 +2965,7 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
     td->key = newfirstitem->key;
     td->ignore = FALSE;
     td->inserted = FALSE;
+    td->array = NULL;
     td->treeholder.address = 0;
     td->treeholder.generation = Vcb->superblock.generation;
     td->treeholder.tree = nt;
@@ -3179,6 +3186,8 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, BOOL* done,
             }
         }
 
+        t->item_array = NULL;
+
         t->itemlist.Blink->Flink = next_tree->itemlist.Flink;
         t->itemlist.Blink->Flink->Blink = t->itemlist.Blink;
         t->itemlist.Blink = next_tree->itemlist.Blink;
@@ -3220,8 +3229,9 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, BOOL* done,
         }
 
         RemoveEntryList(&nextparitem->list_entry);
-        ExFreePool(next_tree->paritem);
+        free_tree_data(Vcb, next_tree->paritem);
         next_tree->paritem = NULL;
+        next_tree->parent->item_array = NULL;
 
         next_tree->root->root_item.bytes_used -= Vcb->superblock.node_size;
 
@@ -3253,6 +3263,9 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, BOOL* done,
                 RemoveEntryList(&td->list_entry);
                 InsertTailList(&t->itemlist, &td->list_entry);
 
+                t->item_array = NULL;
+                next_tree->item_array = NULL;
+
                 if (next_tree->header.level > 0 && td->treeholder.tree) {
                     td->treeholder.tree->parent = t;
 #ifdef DEBUG_PARANOID
@@ -3496,8 +3509,9 @@ static NTSTATUS do_splits(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
                         }
 
                         RemoveEntryList(&t->paritem->list_entry);
-                        ExFreePool(t->paritem);
+                        free_tree_data(Vcb, t->paritem);
                         t->paritem = NULL;
+                        t->parent->item_array = NULL;
 
                         free_tree(t);
                     } else if (t->header.level != 0) {
@@ -4223,6 +4237,7 @@ NTSTATUS insert_tree_item_batch(LIST_ENTRY* batchlist, device_extension* Vcb, ro
 
         br->r = r;
         InitializeListHead(&br->items);
+        br->unsorted = FALSE;
         InsertTailList(batchlist, &br->list_entry);
     }
 
@@ -4239,20 +4254,18 @@ NTSTATUS insert_tree_item_batch(LIST_ENTRY* batchlist, device_extension* Vcb, ro
     bi->datalen = datalen;
     bi->operation = operation;
 
-    le = br->items.Blink;
-    while (le != &br->items) {
-        batch_item* bi2 = CONTAINING_RECORD(le, batch_item, list_entry);
-        int cmp = keycmp(bi2->key, bi->key);
+    // Items are sorted in one go by commit_batch_list rather than here, as
+    // insertion sort is quadratic when a flush queues many out-of-order keys.
 
-        if (cmp == -1 || (cmp == 0 && bi->operation >= bi2->operation)) {
-            InsertHeadList(&bi2->list_entry, &bi->list_entry);
-            return STATUS_SUCCESS;
-        }
+    if (!br->unsorted && !IsListEmpty(&br->items)) {
+        batch_item* bi2 = CONTAINING_RECORD(br->items.Blink, batch_item, list_entry);
+        int cmp = keycmp(bi2->key, bi->key);
 
-        le = le->Blink;
+        if (cmp == 1 || (cmp == 0 && bi->operation < bi2->operation))
+            br->unsorted = TRUE;
     }
 
-    InsertHeadList(&br->items, &bi->list_entry);
+    InsertTailList(&br->items, &bi->list_entry);
 
     return STATUS_SUCCESS;
 }
@@ -7245,6 +7258,10 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
     while (le != &Vcb->trees) {
         tree* t = CONTAINING_RECORD(le, tree, list_entry);
 
+        // itemlist may no longer match the array it was loaded into
+        if (t->write)
+            t->item_array = NULL;
+
         t->write = FALSE;
 
         le = le->Flink;
@@ -7255,6 +7272,10 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
     while (!IsListEmpty(&Vcb->drop_roots)) {
         root* r = CONTAINING_RECORD(RemoveHeadList(&Vcb->drop_roots), root, list_entry);
 
+        acquire_fcb_lock_exclusive(Vcb);
+        evict_fcbs(Vcb, r);
+        release_fcb_lock(Vcb);
+
         ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
         ExFreePool(r->nonpaged);
         ExFreePool(r);
@@ -7288,6 +7309,8 @@ NTSTATUS do_write(device_extension* Vcb, PIRP Irp) {
 #ifdef DEBUG_STATS
 static void print_stats(device_extension* Vcb) {
     LARGE_INTEGER freq;
+    ULONG num_comp_contexts;
+    UINT64 comp_contexts_mem;
 
     ERR("READ STATS:\n");
     ERR("number of reads: %llu\n", Vcb->stats.num_reads);
@@ -7312,6 +7335,21 @@ static void print_stats(device_extension* Vcb) {
     ERR("time spent waiting for fcb_lock: %llu\n", Vcb->stats.fcb_lock_time);
     ERR("total time taken: %llu\n", Vcb->stats.create_total_time);
 
+    ERR("TREE STATS:\n");
+    ERR("trees loaded: %llu\n", Vcb->stats.tree_loads);
+    ERR("readaheads issued: %llu\n", Vcb->stats.tree_readaheads);
+    ERR("readahead hits: %llu\n", Vcb->stats.tree_readahead_hits);
+    ERR("missing names found in negative cache: %llu\n", Vcb->stats.neg_lookup_hits);
+    ERR("missing names searched for: %llu\n", Vcb->stats.neg_lookup_misses);
+    ERR("closed fcbs revived: %llu\n", Vcb->stats.fcb_revives);
+
+    get_comp_context_stats(&num_comp_contexts, &comp_contexts_mem);
+
+    ERR("COMPRESSION STATS:\n");
+    ERR("decompressed extent cache hits: %llu\n", Vcb->stats.decomp_cache_hits);
+    ERR("compression contexts: %u\n", num_comp_contexts);
+    ERR("memory used by compression contexts: %llu bytes\n", comp_contexts_mem);
+
     RtlZeroMemory(&Vcb->stats, sizeof(debug_stats));
 }
 #endif
@@ -7335,6 +7373,15 @@ static void do_flush(device_extension* Vcb) {
     if (!NT_SUCCESS(Status))
         ERR("do_write returned %08x\n", Status);
 
+    // give back the memory used by closed fcbs and idle compression contexts if the system is running short
+    if (low_memory_event && KeReadStateEvent(low_memory_event)) {
+        acquire_fcb_lock_exclusive(Vcb);
+        evict_fcbs(Vcb, NULL);
+        release_fcb_lock(Vcb);
+
+        free_comp_contexts();
+    }
+
     ExReleaseResourceLite(&Vcb->tree_lock);
 }
 
@@ -7358,8 +7405,10 @@ void flush_thread(void* context) {
         if (!(devobj->Vpb->Flags & VPB_MOUNTED) || Vcb->removing)
             break;
 
-        if (!Vcb->locked)
+        if (!Vcb->locked) {
             do_flush(Vcb);
+            check_auto_compact(Vcb);
+        }
 
         KeSetTimer(&Vcb->flush_thread_timer, due_time, NULL);
     }
@@ -1140,6 +1140,7 @@ end:
 
         if (r) {
             RemoveEntryList(&r->list_entry);
+            RemoveEntryList(&r->list_entry_hash);
             InsertTailList(&Vcb->drop_roots, &r->list_entry);
         }
     }
@@ -2278,7 +2279,13 @@ static NTSTATUS lock_volume(device_extension* Vcb, PIRP Irp) {
         return STATUS_DEVICE_NOT_READY;
     }
 
+    // stop the flush thread from starting a compaction between our check and setting Vcb->locked
+    InterlockedIncrement(&Vcb->locks_pending);
+
+    stop_auto_compact(Vcb);
+
     if (Vcb->balance.thread) {
+        InterlockedDecrement(&Vcb->locks_pending);
         WARN("cannot lock while balance running\n");
         return STATUS_DEVICE_NOT_READY;
     }
@@ -2287,8 +2294,10 @@ static NTSTATUS lock_volume(device_extension* Vcb, PIRP Irp) {
 
     FsRtlNotifyVolumeEvent(IrpSp->FileObject, FSRTL_VOLUME_LOCK);
 
-    if (Vcb->locked)
+    if (Vcb->locked) {
+        InterlockedDecrement(&Vcb->locks_pending);
         return STATUS_SUCCESS;
+    }
 
     acquire_fcb_lock_exclusive(Vcb);
 
@@ -2348,6 +2357,8 @@ static NTSTATUS lock_volume(device_extension* Vcb, PIRP Irp) {
     Status = STATUS_SUCCESS;
 
 end:
+    InterlockedDecrement(&Vcb->locks_pending);
+
     if (!NT_SUCCESS(Status))
         FsRtlNotifyVolumeEvent(IrpSp->FileObject, FSRTL_VOLUME_LOCK_FAILED);
 
@@ -3727,6 +3738,226 @@ end:
     return Status;
 }
 
+// Receiving side of the ENCODED_WRITE send command. If the extent covers exactly the range being
+// written we store the compressed data as it is; otherwise we decompress it and write the part
+// that's wanted. As the data isn't checked in the first case, this needs the same privilege
+// as the other administrative FSCTLs.
+static NTSTATUS write_encoded(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG datalen, PIRP Irp) {
+    btrfs_write_encoded* bwe = (btrfs_write_encoded*)data;
+    fcb* fcb = FileObject ? FileObject->FsContext : NULL;
+    ccb* ccb = FileObject ? FileObject->FsContext2 : NULL;
+    NTSTATUS Status;
+    UINT8 compression;
+    UINT8* buf = NULL;
+    UINT32 lzo_type, ss;
+    LIST_ENTRY rollback;
+    LARGE_INTEGER time, offset, length;
+    BTRFS_TIME now;
+
+    if (!bwe || datalen < offsetof(btrfs_write_encoded, data[0]) || datalen < offsetof(btrfs_write_encoded, data[0]) + (UINT64)bwe->length)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_MANAGE_VOLUME_PRIVILEGE), Irp->RequestorMode))
+        return STATUS_PRIVILEGE_NOT_HELD;
+
+    if (Vcb->readonly)
+        return STATUS_MEDIA_WRITE_PROTECTED;
+
+    if (!fcb || !ccb || fcb == Vcb->volume_fcb)
+        return STATUS_INVALID_PARAMETER;
+
+    if (is_subvol_readonly(fcb->subvol, Irp))
+        return STATUS_ACCESS_DENIED;
+
+    if (Irp->RequestorMode == UserMode && !(ccb->access & FILE_WRITE_DATA)) {
+        WARN("insufficient privileges\n");
+        return STATUS_ACCESS_DENIED;
+    }
+
+    if (fcb->ads || fcb->type != BTRFS_TYPE_FILE)
+        return STATUS_INVALID_PARAMETER;
+
+    if (bwe->unencoded_file_len == 0)
+        return STATUS_SUCCESS;
+
+    ss = Vcb->superblock.sector_size;
+
+    if (bwe->length == 0 || bwe->unencoded_len > COMPRESSED_EXTENT_SIZE || bwe->unencoded_offset > bwe->unencoded_len ||
+        bwe->unencoded_file_len > bwe->unencoded_len - bwe->unencoded_offset || bwe->offset & (ss - 1) || bwe->offset + bwe->unencoded_len < bwe->offset) {
+        WARN("invalid parameters\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    lzo_type = BTRFS_ENCODED_IO_COMPRESSION_LZO_4K;
+    while (ss > 0x1000) {
+        lzo_type++;
+        ss >>= 1;
+    }
+
+    ss = Vcb->superblock.sector_size;
+
+    if (bwe->compression == BTRFS_ENCODED_IO_COMPRESSION_ZLIB)
+        compression = BTRFS_COMPRESSION_ZLIB;
+    else if (bwe->compression == BTRFS_ENCODED_IO_COMPRESSION_ZSTD)
+        compression = BTRFS_COMPRESSION_ZSTD;
+    else if (bwe->compression == lzo_type)
+        compression = BTRFS_COMPRESSION_LZO;
+    else {
+        WARN("unsupported compression type %x\n", bwe->compression);
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    InitializeListHead(&rollback);
+
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+
+    ExAcquireResourceExclusiveLite(fcb->Header.Resource, TRUE);
+
+    offset.QuadPart = bwe->offset;
+    length.QuadPart = sector_align(bwe->unencoded_file_len, ss);
+
+    if (!FsRtlFastCheckLockForWrite(&fcb->lock, &offset, &length, 0, FileObject, PsGetCurrentProcess())) {
+        Status = STATUS_FILE_LOCK_CONFLICT;
+        goto end;
+    }
+
+    // the sender extends the file before writing, so we don't have to deal with that here
+    if (bwe->offset + bwe->unencoded_file_len > sector_align(fcb->inode_item.st_size, ss)) {
+        Status = STATUS_NOT_SUPPORTED;
+        goto end;
+    }
+
+    // extending a small file will have given it an inline extent, which we need to turn into a regular one
+    if (fcb_is_inline(fcb)) {
+        ULONG buflen = (ULONG)sector_align(fcb->inode_item.st_size, ss);
+
+        buf = ExAllocatePoolWithTag(PagedPool, buflen, ALLOC_TAG);
+        if (!buf) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+
+        RtlZeroMemory(buf, buflen);
+
+        Status = read_file(fcb, buf, 0, fcb->inode_item.st_size, NULL, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("read_file returned %08x\n", Status);
+            goto end;
+        }
+
+        Status = excise_extents(Vcb, fcb, 0, fcb->inode_item.st_size, Irp, &rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("excise_extents returned %08x\n", Status);
+            goto end;
+        }
+
+        Status = do_write_file(fcb, 0, buflen, buf, Irp, FALSE, 0, &rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("do_write_file returned %08x\n", Status);
+            goto end;
+        }
+
+        ExFreePool(buf);
+        buf = NULL;
+    }
+
+    // only the end of the file can be partly covered by a sector
+    if (bwe->unencoded_file_len & (ss - 1) && bwe->offset + bwe->unencoded_file_len < fcb->inode_item.st_size) {
+        Status = STATUS_INVALID_PARAMETER;
+        goto end;
+    }
+
+    if (!(fcb->inode_item.flags & (BTRFS_INODE_NODATASUM | BTRFS_INODE_NODATACOW)) && bwe->unencoded_offset == 0 &&
+        sector_align(bwe->unencoded_file_len, ss) == bwe->unencoded_len && !(bwe->length & (ss - 1)) && bwe->length <= bwe->unencoded_len) {
+        Status = write_compressed_extent(fcb, bwe->offset, bwe->offset + bwe->unencoded_len, NULL, compression, bwe->data, bwe->length, Irp, &rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("write_compressed_extent returned %08x\n", Status);
+            goto end;
+        }
+    } else {
+        // do_write_file takes a whole number of sectors starting at unencoded_offset
+        ULONG buflen = (ULONG)(bwe->unencoded_offset + sector_align(bwe->unencoded_file_len, ss));
+
+        buflen = max(buflen, (ULONG)bwe->unencoded_len);
+
+        buf = ExAllocatePoolWithTag(PagedPool, buflen, ALLOC_TAG);
+        if (!buf) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+
+        RtlZeroMemory(buf, buflen);
+
+        if (compression == BTRFS_COMPRESSION_ZLIB) {
+            Status = zlib_decompress(bwe->data, bwe->length, buf, (UINT32)bwe->unencoded_len);
+            if (!NT_SUCCESS(Status))
+                ERR("zlib_decompress returned %08x\n", Status);
+        } else if (compression == BTRFS_COMPRESSION_LZO) {
+            if (bwe->length < sizeof(UINT32)) {
+                ERR("extent data was truncated\n");
+                Status = STATUS_INVALID_PARAMETER;
+            } else {
+                Status = lzo_decompress(bwe->data + sizeof(UINT32), bwe->length - sizeof(UINT32), buf, (UINT32)bwe->unencoded_len, sizeof(UINT32));
+                if (!NT_SUCCESS(Status))
+                    ERR("lzo_decompress returned %08x\n", Status);
+            }
+        } else {
+            Status = zstd_decompress(bwe->data, bwe->length, buf, (UINT32)bwe->unencoded_len);
+            if (!NT_SUCCESS(Status))
+                ERR("zstd_decompress returned %08x\n", Status);
+        }
+
+        if (!NT_SUCCESS(Status))
+            goto end;
+
+        Status = do_write_file(fcb, bwe->offset, bwe->offset + sector_align(bwe->unencoded_file_len, ss), buf + bwe->unencoded_offset, Irp, FALSE, 0, &rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("do_write_file returned %08x\n", Status);
+            goto end;
+        }
+    }
+
+    KeQuerySystemTime(&time);
+    win_time_to_unix(time, &now);
+
+    fcb->inode_item.sequence++;
+
+    if (!ccb->user_set_change_time)
+        fcb->inode_item.st_ctime = now;
+
+    if (!ccb->user_set_write_time) {
+        fcb->inode_item.st_mtime = now;
+        send_notification_fcb(ccb->fileref, FILE_NOTIFY_CHANGE_LAST_WRITE, FILE_ACTION_MODIFIED, NULL);
+    }
+
+    fcb->inode_item_changed = TRUE;
+    fcb->extents_changed = TRUE;
+
+    mark_fcb_dirty(fcb);
+
+    if (fcb->nonpaged->segment_object.DataSectionObject)
+        CcPurgeCacheSection(&fcb->nonpaged->segment_object, &offset, (ULONG)length.QuadPart, FALSE);
+
+    Status = STATUS_SUCCESS;
+
+end:
+    if (buf)
+        ExFreePool(buf);
+
+    if (NT_SUCCESS(Status))
+        clear_rollback(&rollback);
+    else
+        do_rollback(Vcb, &rollback);
+
+    ExReleaseResourceLite(fcb->Header.Resource);
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    return Status;
+}
+
 // based on functions in sys/sysmacros.h
 #define major(rdev) ((((rdev) >> 8) & 0xFFF) | ((UINT32)((rdev) >> 32) & ~0xFFF))
 #define minor(rdev) (((rdev) & 0xFF) | ((UINT32)((rdev) >> 12) & ~0xFF))
@@ -4269,8 +4500,9 @@ static NTSTATUS fsctl_set_xattr(device_extension* Vcb, PFILE_OBJECT FileObject,
             goto end;
         }
 
-        if (fcb->sd)
-            ExFreePool(fcb->sd);
+        release_sd(Vcb, fcb->sd, fcb->sd_interned);
+        fcb->sd = NULL;
+        fcb->sd_interned = FALSE;
 
         if (bsxa->valuelen > 0 && RtlValidRelativeSecurityDescriptor(bsxa->data + bsxa->namelen, bsxa->valuelen, 0)) {
             fcb->sd = ExAllocatePoolWithTag(PagedPool, bsxa->valuelen, ALLOC_TAG);
@@ -4281,8 +4513,7 @@ static NTSTATUS fsctl_set_xattr(device_extension* Vcb, PFILE_OBJECT FileObject,
             }
 
             RtlCopyMemory(fcb->sd, bsxa->data + bsxa->namelen, bsxa->valuelen);
-        } else if (fcb->sd)
-            fcb->sd = NULL;
+        }
 
         fcb->sd_dirty = TRUE;
 
@@ -4506,23 +4737,12 @@ static NTSTATUS reserve_subvol(device_extension* Vcb, PFILE_OBJECT FileObject, P
 }
 
 static NTSTATUS get_subvol_path(device_extension* Vcb, UINT64 id, WCHAR* out, ULONG outlen, PIRP Irp) {
-    LIST_ENTRY* le;
-    root* r = NULL;
+    root* r;
     NTSTATUS Status;
     file_ref* fr;
     UNICODE_STRING us;
 
-    le = Vcb->roots.Flink;
-    while (le != &Vcb->roots) {
-        root* r2 = CONTAINING_RECORD(le, root, list_entry);
-
-        if (r2->id == id) {
-            r = r2;
-            break;
-        }
-
-        le = le->Flink;
-    }
+    r = find_root(Vcb, id);
 
     if (!r) {
         ERR("couldn't find subvol %llx\n", id);
@@ -4697,7 +4917,7 @@ static NTSTATUS resize_device(device_extension* Vcb, void* data, ULONG len, PIRP
     if (Vcb->readonly)
         return STATUS_MEDIA_WRITE_PROTECTED;
 
-    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
+    stop_auto_compact_and_lock(Vcb);
 
     le = Vcb->devices.Flink;
     while (le != &Vcb->devices) {
@@ -4776,8 +4996,13 @@ static NTSTATUS resize_device(device_extension* Vcb, void* data, ULONG len, PIRP
             Vcb->balance.status = STATUS_SUCCESS;
             KeInitializeEvent(&Vcb->balance.event, NotificationEvent, !Vcb->balance.paused);
 
+            init_throttle(&Vcb->balance.throttle, NULL);
+
             space_list_subtract2(&dev->space, NULL, br->size, delta, NULL, NULL);
 
+            Vcb->balance.stopping = FALSE;
+            KeInitializeEvent(&Vcb->balance.finished, NotificationEvent, FALSE);
+
             Status = PsCreateSystemThread(&Vcb->balance.thread, 0, NULL, NULL, NULL, balance_thread, Vcb);
             if (!NT_SUCCESS(Status)) {
                 ERR("PsCreateSystemThread returned %08x\n", Status);
@@ -5401,6 +5626,18 @@ NTSTATUS fsctl_request(PDEVICE_OBJECT DeviceObject, PIRP* Pirp, UINT32 type) {
             Status = stop_balance(DeviceObject->DeviceExtension, Irp->RequestorMode);
             break;
 
+        case FSCTL_BTRFS_THROTTLE_BALANCE:
+            Status = throttle_balance(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer, IrpSp->Parameters.FileSystemControl.InputBufferLength, Irp->RequestorMode);
+            break;
+
+        case FSCTL_BTRFS_QUERY_COMPACT:
+            Status = query_compact(DeviceObject->DeviceExtension, map_user_buffer(Irp, NormalPagePriority), IrpSp->Parameters.FileSystemControl.OutputBufferLength);
+            break;
+
+        case FSCTL_BTRFS_WRITE_ENCODED:
+            Status = write_encoded(DeviceObject->DeviceExtension, IrpSp->FileObject, Irp->AssociatedIrp.SystemBuffer, IrpSp->Parameters.FileSystemControl.InputBufferLength, Irp);
+            break;
+
         case FSCTL_BTRFS_ADD_DEVICE:
             Status = add_device(DeviceObject->DeviceExtension, Irp, Irp->RequestorMode);
             break;
@@ -5414,7 +5651,8 @@ NTSTATUS fsctl_request(PDEVICE_OBJECT DeviceObject, PIRP* Pirp, UINT32 type) {
             break;
 
         case FSCTL_BTRFS_START_SCRUB:
-            Status = start_scrub(DeviceObject->DeviceExtension, Irp->RequestorMode);
+            Status = start_scrub(DeviceObject->DeviceExtension, IrpSp->Parameters.FileSystemControl.InputBufferLength > 0 ? Irp->AssociatedIrp.SystemBuffer : NULL,
+                                 IrpSp->Parameters.FileSystemControl.InputBufferLength, Irp->RequestorMode);
             break;
 
         case FSCTL_BTRFS_QUERY_SCRUB:
@@ -5433,6 +5671,10 @@ NTSTATUS fsctl_request(PDEVICE_OBJECT DeviceObject, PIRP* Pirp, UINT32 type) {
             Status = stop_scrub(DeviceObject->DeviceExtension, Irp->RequestorMode);
             break;
 
+        case FSCTL_BTRFS_THROTTLE_SCRUB:
+            Status = throttle_scrub(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer, IrpSp->Parameters.FileSystemControl.InputBufferLength, Irp->RequestorMode);
+            break;
+
         case FSCTL_BTRFS_RESET_STATS:
             Status = reset_stats(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer, IrpSp->Parameters.FileSystemControl.InputBufferLength, Irp->RequestorMode);
             break;
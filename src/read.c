@@ -53,6 +53,8 @@ typedef struct {
     BOOL tree;
     read_data_stripe* stripes;
     UINT8* va;
+    device_extension* Vcb;
+    LARGE_INTEGER start_time;
 } read_data_context;
 
 extern BOOL diskacc;
@@ -76,6 +78,9 @@ static NTSTATUS read_data_completion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOI
     else
         stripe->status = ReadDataStatus_Error;
 
+    if (context->start_time.QuadPart != 0)
+        record_fg_latency(context->Vcb, context->start_time);
+
     if (InterlockedDecrement(&context->stripes_left) == 0)
         KeSetEvent(&context->Event, 0, FALSE);
 
@@ -2561,6 +2566,12 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ UINT64 addr, _In_ UINT32 len
         time1 = KeQueryPerformanceCounter(NULL);
 #endif
 
+    // only reads on behalf of a user request count towards the foreground latency that
+    // scrub and balance back off from
+    context.Vcb = Vcb;
+    if (Irp)
+        context.start_time = KeQueryPerformanceCounter(NULL);
+
     need_to_wait = FALSE;
     for (i = 0; i < ci->num_stripes; i++) {
         if (context.stripes[i].status != ReadDataStatus_MissingDevice && context.stripes[i].status != ReadDataStatus_Skip) {
@@ -2700,6 +2711,146 @@ exit:
     return Status;
 }
 
+// Reading a few KB out of a compressed extent means decompressing everything up to that point, so
+// random reads of a compressed file would decompress the same extents over and over. We keep the
+// most recently used decompressed extents, keyed by their disk address. Anything which writes over
+// the address range has to call invalidate_decomp_cache, which write_data does.
+typedef struct {
+    LIST_ENTRY list_entry;
+    UINT64 address;
+    UINT64 size;
+    UINT32 length;
+    UINT8* data;
+} decomp_cache_entry;
+
+static BOOL get_decomp_cache(device_extension* Vcb, UINT64 address, UINT64 size, UINT64 off, UINT8* data, UINT32 length) {
+    LIST_ENTRY* le;
+
+    if (IsListEmpty(&Vcb->decomp_cache))
+        return FALSE;
+
+    ExAcquireResourceExclusiveLite(&Vcb->decomp_cache_lock, TRUE);
+
+    le = Vcb->decomp_cache.Flink;
+    while (le != &Vcb->decomp_cache) {
+        decomp_cache_entry* dce = CONTAINING_RECORD(le, decomp_cache_entry, list_entry);
+
+        if (dce->address == address && dce->size == size) {
+            if (off + length > dce->length)
+                break;
+
+            RtlCopyMemory(data, dce->data + off, length);
+
+            // move to the end of the list, so it's the last to be evicted
+            RemoveEntryList(&dce->list_entry);
+            InsertTailList(&Vcb->decomp_cache, &dce->list_entry);
+
+            ExReleaseResourceLite(&Vcb->decomp_cache_lock);
+
+#ifdef DEBUG_STATS
+            Vcb->stats.decomp_cache_hits++;
+#endif
+
+            return TRUE;
+        }
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->decomp_cache_lock);
+
+    return FALSE;
+}
+
+// takes ownership of data
+static void add_decomp_cache(device_extension* Vcb, UINT64 address, UINT64 size, UINT8* data, UINT32 length) {
+    decomp_cache_entry* dce;
+    LIST_ENTRY* le;
+
+    dce = ExAllocatePoolWithTag(PagedPool, sizeof(decomp_cache_entry), ALLOC_TAG);
+    if (!dce) {
+        ERR("out of memory\n");
+        ExFreePool(data);
+        return;
+    }
+
+    dce->address = address;
+    dce->size = size;
+    dce->length = length;
+    dce->data = data;
+
+    ExAcquireResourceExclusiveLite(&Vcb->decomp_cache_lock, TRUE);
+
+    // another thread may have got here first
+    le = Vcb->decomp_cache.Flink;
+    while (le != &Vcb->decomp_cache) {
+        decomp_cache_entry* dce2 = CONTAINING_RECORD(le, decomp_cache_entry, list_entry);
+
+        if (dce2->address == address) {
+            RemoveEntryList(&dce2->list_entry);
+            Vcb->num_decomp_cache--;
+
+            ExFreePool(dce2->data);
+            ExFreePool(dce2);
+            break;
+        }
+
+        le = le->Flink;
+    }
+
+    InsertTailList(&Vcb->decomp_cache, &dce->list_entry);
+    Vcb->num_decomp_cache++;
+
+    if (Vcb->num_decomp_cache > DECOMP_CACHE_MAX) {
+        decomp_cache_entry* victim = CONTAINING_RECORD(RemoveHeadList(&Vcb->decomp_cache), decomp_cache_entry, list_entry);
+
+        Vcb->num_decomp_cache--;
+
+        ExFreePool(victim->data);
+        ExFreePool(victim);
+    }
+
+    ExReleaseResourceLite(&Vcb->decomp_cache_lock);
+}
+
+void invalidate_decomp_cache(device_extension* Vcb, UINT64 address, UINT64 length) {
+    LIST_ENTRY* le;
+
+    if (IsListEmpty(&Vcb->decomp_cache))
+        return;
+
+    ExAcquireResourceExclusiveLite(&Vcb->decomp_cache_lock, TRUE);
+
+    le = Vcb->decomp_cache.Flink;
+    while (le != &Vcb->decomp_cache) {
+        LIST_ENTRY* le2 = le->Flink;
+        decomp_cache_entry* dce = CONTAINING_RECORD(le, decomp_cache_entry, list_entry);
+
+        if (dce->address < address + length && dce->address + dce->size > address) {
+            RemoveEntryList(&dce->list_entry);
+            Vcb->num_decomp_cache--;
+
+            ExFreePool(dce->data);
+            ExFreePool(dce);
+        }
+
+        le = le2;
+    }
+
+    ExReleaseResourceLite(&Vcb->decomp_cache_lock);
+}
+
+void free_decomp_cache(device_extension* Vcb) {
+    while (!IsListEmpty(&Vcb->decomp_cache)) {
+        decomp_cache_entry* dce = CONTAINING_RECORD(RemoveHeadList(&Vcb->decomp_cache), decomp_cache_entry, list_entry);
+
+        ExFreePool(dce->data);
+        ExFreePool(dce);
+    }
+
+    Vcb->num_decomp_cache = 0;
+}
+
 NTSTATUS read_stream(fcb* fcb, UINT8* data, UINT64 start, ULONG length, ULONG* pbr) {
     ULONG readlen;
 
@@ -2897,6 +3048,14 @@ NTSTATUS read_file(fcb* fcb, UINT8* data, UINT64 start, UINT64 length, ULONG* pb
                     read = (UINT32)(len - off);
                     if (read > length) read = (UINT32)length;
 
+                    if (ed->compression != BTRFS_COMPRESSION_NONE &&
+                        get_decomp_cache(fcb->Vcb, ed2->address, ed2->size, ed2->offset + off, data + bytes_read, (UINT32)min(read, ed2->num_bytes - off))) {
+                        bytes_read += read;
+                        length -= read;
+
+                        break;
+                    }
+
                     if (ed->compression == BTRFS_COMPRESSION_NONE) {
                         addr = ed2->address + ed2->offset + off;
                         to_read = (UINT32)sector_align(read, fcb->Vcb->superblock.sector_size);
@@ -2965,18 +3124,22 @@ NTSTATUS read_file(fcb* fcb, UINT8* data, UINT64 start, UINT64 length, ULONG* pb
                         UINT8 *decomp = NULL, *buf2;
                         ULONG outlen, inlen, off2;
                         UINT32 inpageoff = 0;
+                        BOOL cache;
 
                         off2 = (ULONG)(ed2->offset + off);
                         buf2 = buf;
                         inlen = (ULONG)ed2->size;
 
+                        // If the whole extent fits, decompress all of it so it can go in the cache
+                        cache = ed->decoded_size <= COMPRESSED_EXTENT_SIZE && ed2->offset + ed2->num_bytes <= ed->decoded_size;
+
                         if (ed->compression == BTRFS_COMPRESSION_LZO) {
                             ULONG inoff = sizeof(UINT32);
 
                             inlen -= sizeof(UINT32);
 
                             // If reading a few sectors in, skip to the interesting bit
-                            while (off2 > LINUX_PAGE_SIZE) {
+                            while (!cache && off2 > LINUX_PAGE_SIZE) {
                                 UINT32 partlen;
 
                                 if (inlen < sizeof(UINT32))
@@ -2999,8 +3162,8 @@ NTSTATUS read_file(fcb* fcb, UINT8* data, UINT64 start, UINT64 length, ULONG* pb
                             inpageoff = inoff % LINUX_PAGE_SIZE;
                         }
 
-                        if (off2 != 0) {
-                            outlen = off2 + min(read, (UINT32)(ed2->num_bytes - off));
+                        if (cache || off2 != 0) {
+                            outlen = cache ? (ULONG)ed->decoded_size : off2 + min(read, (UINT32)(ed2->num_bytes - off));
 
                             decomp = ExAllocatePoolWithTag(PagedPool, outlen, ALLOC_TAG);
                             if (!decomp) {
@@ -3062,7 +3225,11 @@ NTSTATUS read_file(fcb* fcb, UINT8* data, UINT64 start, UINT64 length, ULONG* pb
 
                         if (decomp) {
                             RtlCopyMemory(data + bytes_read, decomp + off2, (size_t)min(read, ed2->num_bytes - off));
-                            ExFreePool(decomp);
+
+                            if (cache)
+                                add_decomp_cache(fcb->Vcb, ed2->address, ed2->size, decomp, outlen);
+                            else
+                                ExFreePool(decomp);
                         }
                     }
 
@@ -37,7 +37,8 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     BTRFS_UUID* uuid = &Vcb->superblock.uuid;
     mount_options* options = &Vcb->options;
     UNICODE_STRING path, ignoreus, compressus, compressforceus, compresstypeus, readonlyus, zliblevelus, flushintervalus,
-                   maxinlineus, subvolidus, skipbalanceus, nobarrierus, notrimus, clearcacheus, allowdegradedus, zstdlevelus;
+                   maxinlineus, subvolidus, skipbalanceus, nobarrierus, notrimus, clearcacheus, allowdegradedus, zstdlevelus, scrubqueuedepthus,
+                   balanceconcurrencyus, autocompactus, autocompactbandwidthus;
     OBJECT_ATTRIBUTES oa;
     NTSTATUS Status;
     ULONG i, j, kvfilen, index, retlen;
@@ -57,6 +58,10 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     options->no_trim = mount_no_trim;
     options->clear_cache = mount_clear_cache;
     options->allow_degraded = mount_allow_degraded;
+    options->scrub_queue_depth = mount_scrub_queue_depth;
+    options->balance_concurrency = mount_balance_concurrency;
+    options->auto_compact = mount_auto_compact;
+    options->auto_compact_bandwidth = mount_auto_compact_bandwidth;
     options->subvol_id = 0;
 
     path.Length = path.MaximumLength = registry_path.Length + (37 * sizeof(WCHAR));
@@ -121,6 +126,10 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     RtlInitUnicodeString(&clearcacheus, L"ClearCache");
     RtlInitUnicodeString(&allowdegradedus, L"AllowDegraded");
     RtlInitUnicodeString(&zstdlevelus, L"ZstdLevel");
+    RtlInitUnicodeString(&scrubqueuedepthus, L"ScrubQueueDepth");
+    RtlInitUnicodeString(&balanceconcurrencyus, L"BalanceConcurrency");
+    RtlInitUnicodeString(&autocompactus, L"AutoCompact");
+    RtlInitUnicodeString(&autocompactbandwidthus, L"AutoCompactBandwidth");
 
     do {
         Status = ZwEnumerateValueKey(h, index, KeyValueFullInformation, kvfi, kvfilen, &retlen);
@@ -193,6 +202,22 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
                 DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
 
                 options->zstd_level = *val;
+            } else if (FsRtlAreNamesEqual(&scrubqueuedepthus, &us, TRUE, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
+
+                options->scrub_queue_depth = *val;
+            } else if (FsRtlAreNamesEqual(&balanceconcurrencyus, &us, TRUE, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
+
+                options->balance_concurrency = *val;
+            } else if (FsRtlAreNamesEqual(&autocompactus, &us, TRUE, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
+
+                options->auto_compact = *val;
+            } else if (FsRtlAreNamesEqual(&autocompactbandwidthus, &us, TRUE, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
+
+                options->auto_compact_bandwidth = *val;
             }
         } else if (Status != STATUS_NO_MORE_ENTRIES) {
             ERR("ZwEnumerateValueKey returned %08x\n", Status);
@@ -538,12 +563,7 @@ static void read_mappings(PUNICODE_STRING regpath) {
 
     const WCHAR mappings[] = L"\\Mappings";
 
-    while (!IsListEmpty(&uid_map_list)) {
-        uid_map* um = CONTAINING_RECORD(RemoveHeadList(&uid_map_list), uid_map, listentry);
-
-        if (um->sid) ExFreePool(um->sid);
-        ExFreePool(um);
-    }
+    clear_user_mappings();
 
     path = ExAllocatePoolWithTag(PagedPool, regpath->Length + (wcslen(mappings) * sizeof(WCHAR)), ALLOC_TAG);
     if (!path) {
@@ -616,12 +636,7 @@ static void read_group_mappings(PUNICODE_STRING regpath) {
 
     const WCHAR mappings[] = L"\\GroupMappings";
 
-    while (!IsListEmpty(&gid_map_list)) {
-        gid_map* gm = CONTAINING_RECORD(RemoveHeadList(&gid_map_list), gid_map, listentry);
-
-        if (gm->sid) ExFreePool(gm->sid);
-        ExFreePool(gm);
-    }
+    clear_group_mappings();
 
     path = ExAllocatePoolWithTag(PagedPool, regpath->Length + (wcslen(mappings) * sizeof(WCHAR)), ALLOC_TAG);
     if (!path) {
@@ -805,6 +820,10 @@ void read_registry(PUNICODE_STRING regpath, BOOL refresh) {
     get_registry_value(h, L"AllowDegraded", REG_DWORD, &mount_allow_degraded, sizeof(mount_allow_degraded));
     get_registry_value(h, L"Readonly", REG_DWORD, &mount_readonly, sizeof(mount_readonly));
     get_registry_value(h, L"ZstdLevel", REG_DWORD, &mount_zstd_level, sizeof(mount_zstd_level));
+    get_registry_value(h, L"ScrubQueueDepth", REG_DWORD, &mount_scrub_queue_depth, sizeof(mount_scrub_queue_depth));
+    get_registry_value(h, L"BalanceConcurrency", REG_DWORD, &mount_balance_concurrency, sizeof(mount_balance_concurrency));
+    get_registry_value(h, L"AutoCompact", REG_DWORD, &mount_auto_compact, sizeof(mount_auto_compact));
+    get_registry_value(h, L"AutoCompactBandwidth", REG_DWORD, &mount_auto_compact_bandwidth, sizeof(mount_auto_compact_bandwidth));
 
     if (!refresh)
         get_registry_value(h, L"NoPNP", REG_DWORD, &no_pnp, sizeof(no_pnp));
@@ -56,17 +56,7 @@ static void log_file_checksum_error(device_extension* Vcb, UINT64 addr, UINT64 d
     NTSTATUS Status;
     ULONG utf16len;
 
-    le = Vcb->roots.Flink;
-    while (le != &Vcb->roots) {
-        root* r2 = CONTAINING_RECORD(le, root, list_entry);
-
-        if (r2->id == subvol) {
-            r = r2;
-            break;
-        }
-
-        le = le->Flink;
-    }
+    r = find_root(Vcb, subvol);
 
     if (!r) {
         ERR("could not find subvol %llx\n", subvol);
@@ -119,19 +109,7 @@ static void log_file_checksum_error(device_extension* Vcb, UINT64 addr, UINT64 d
 
                 InsertTailList(&parts, &pp->list_entry);
 
-                r = NULL;
-
-                le = Vcb->roots.Flink;
-                while (le != &Vcb->roots) {
-                    root* r2 = CONTAINING_RECORD(le, root, list_entry);
-
-                    if (r2->id == tp.item->key.offset) {
-                        r = r2;
-                        break;
-                    }
-
-                    le = le->Flink;
-                }
+                r = find_root(Vcb, tp.item->key.offset);
 
                 if (!r) {
                     ERR("could not find subvol %llx\n", tp.item->key.offset);
@@ -1559,7 +1537,9 @@ static NTSTATUS scrub_extent(device_extension* Vcb, chunk* c, ULONG type, UINT64
 
             context.stripes_left++;
 
-            Vcb->scrub.data_scrubbed += context.stripes[i].length;
+            InterlockedExchangeAdd64((LONG64*)&Vcb->scrub.data_scrubbed, context.stripes[i].length);
+            InterlockedExchangeAdd64((LONG64*)&c->devices[i]->scrub_data, context.stripes[i].length);
+            throttle_charge(&Vcb->scrub.throttle, context.stripes[i].length, 1);
         }
     }
 
@@ -2728,7 +2708,9 @@ static NTSTATUS scrub_chunk_raid56_stripe_run(device_extension* Vcb, chunk* c, U
 
                 IoSetCompletionRoutine(context.stripes[i].Irp, scrub_read_completion_raid56, &context.stripes[i], TRUE, TRUE, TRUE);
 
-                Vcb->scrub.data_scrubbed += read_stripes * c->chunk_item->stripe_length;
+                InterlockedExchangeAdd64((LONG64*)&Vcb->scrub.data_scrubbed, read_stripes * c->chunk_item->stripe_length);
+                InterlockedExchangeAdd64((LONG64*)&c->devices[i]->scrub_data, read_stripes * c->chunk_item->stripe_length);
+                throttle_charge(&Vcb->scrub.throttle, read_stripes * c->chunk_item->stripe_length, 1);
                 need_wait = TRUE;
             } else {
                 context.stripes[i].Irp = NULL;
@@ -2895,7 +2877,7 @@ static NTSTATUS scrub_chunk_raid56(device_extension* Vcb, chunk* c, UINT64* offs
             num_extents++;
 
             // only do so much at a time
-            if (num_extents >= 64 || total_data >= 0x8000000) // 128 MB
+            if (num_extents >= 64 || total_data >= throttle_batch_size(&Vcb->scrub.throttle, 0x8000000)) // 128 MB unless throttled
                 break;
         }
 
@@ -3101,7 +3083,7 @@ static NTSTATUS scrub_chunk(device_extension* Vcb, chunk* c, UINT64* offset, BOO
             num_extents++;
 
             // only do so much at a time
-            if (num_extents >= 64 || total_data >= 0x8000000) // 128 MB
+            if (num_extents >= 64 || total_data >= throttle_batch_size(&Vcb->scrub.throttle, 0x8000000)) // 128 MB unless throttled
                 break;
         }
 
@@ -3127,19 +3109,350 @@ end:
     return Status;
 }
 
+typedef struct _scrub_worker {
+    device_extension* Vcb;
+    HANDLE thread;
+    KEVENT finished;
+    chunk* c;
+    UINT64 offset;
+} scrub_worker;
+
+#define SCRUB_CHECKPOINT_INTERVAL 600000000 // 60 seconds
+
+// The checkpoint is a persistent item in the dev tree. Linux only ever looks its dev stats up there by
+// device ID, so it won't see it - unlike an item in the root tree, which would get in the way of its
+// search for a free subvolume ID.
+static NTSTATUS load_scrub_item(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, SCRUB_ITEM** psi) {
+    KEY searchkey;
+    traverse_ptr tp;
+    NTSTATUS Status;
+    SCRUB_ITEM* si;
+
+    searchkey.obj_id = 0;
+    searchkey.obj_type = TYPE_DEV_STATS;
+    searchkey.offset = SCRUB_ITEM_ID;
+
+    Status = find_item(Vcb, Vcb->dev_root, &tp, &searchkey, FALSE, NULL);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08x\n", Status);
+        return Status;
+    }
+
+    if (keycmp(tp.item->key, searchkey)) {
+        TRACE("no scrub item found\n");
+        return STATUS_NOT_FOUND;
+    }
+
+    si = (SCRUB_ITEM*)tp.item->data;
+
+    if (tp.item->size < offsetof(SCRUB_ITEM, chunks) || tp.item->size < offsetof(SCRUB_ITEM, chunks) + (si->num_chunks * sizeof(SCRUB_ITEM_CHUNK))) {
+        WARN("(%llx,%x,%llx) was %u bytes, expected at least %u\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset,
+             tp.item->size, offsetof(SCRUB_ITEM, chunks));
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    *psi = ExAllocatePoolWithTag(PagedPool, tp.item->size, ALLOC_TAG);
+    if (!*psi) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlCopyMemory(*psi, si, tp.item->size);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS write_scrub_item(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, SCRUB_ITEM* si, UINT16 size) {
+    KEY searchkey;
+    traverse_ptr tp;
+    NTSTATUS Status;
+
+    searchkey.obj_id = 0;
+    searchkey.obj_type = TYPE_DEV_STATS;
+    searchkey.offset = SCRUB_ITEM_ID;
+
+    Status = find_item(Vcb, Vcb->dev_root, &tp, &searchkey, FALSE, NULL);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08x\n", Status);
+        return Status;
+    }
+
+    if (!keycmp(tp.item->key, searchkey)) {
+        Status = delete_tree_item(Vcb, &tp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("delete_tree_item returned %08x\n", Status);
+            return Status;
+        }
+    }
+
+    if (si) {
+        Status = insert_tree_item(Vcb, Vcb->dev_root, 0, TYPE_DEV_STATS, SCRUB_ITEM_ID, si, size, NULL, NULL);
+        if (!NT_SUCCESS(Status)) {
+            ERR("insert_tree_item returned %08x\n", Status);
+            return Status;
+        }
+    }
+
+    Vcb->need_write = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+// Records how far we've got, so that the scrub can carry on after a dismount or a reboot. Chunks
+// aren't done in address order, so what we store is a low-water mark below which everything has
+// been scrubbed, plus the position within each chunk that's currently being worked on. Anything
+// finished above the mark will be scrubbed again on resume, which is harmless. The item gets
+// written to disk by the next flush.
+static void scrub_checkpoint(device_extension* Vcb, BOOL cancelled) {
+    NTSTATUS Status;
+    SCRUB_ITEM* si;
+    ULONG size, max_chunks, i;
+    LIST_ENTRY* le;
+    LARGE_INTEGER time;
+
+    max_chunks = (Vcb->superblock.node_size - sizeof(tree_header) - sizeof(leaf_node) - offsetof(SCRUB_ITEM, chunks)) / sizeof(SCRUB_ITEM_CHUNK);
+    max_chunks = min(max_chunks, max(Vcb->scrub.num_workers, 1));
+
+    si = ExAllocatePoolWithTag(PagedPool, offsetof(SCRUB_ITEM, chunks) + (max_chunks * sizeof(SCRUB_ITEM_CHUNK)), ALLOC_TAG);
+    if (!si) {
+        ERR("out of memory\n");
+        return;
+    }
+
+    ExAcquireResourceSharedLite(&Vcb->scrub.stats_lock, TRUE);
+
+    si->flags = cancelled ? SCRUB_FLAGS_CANCELLED : 0;
+    si->start_time = Vcb->scrub.start_time.QuadPart;
+    si->duration = Vcb->scrub.duration.QuadPart;
+
+    if (!Vcb->scrub.paused) {
+        KeQuerySystemTime(&time);
+        si->duration += time.QuadPart - Vcb->scrub.resume_time.QuadPart;
+    }
+
+    si->data_scrubbed = Vcb->scrub.data_scrubbed;
+    si->num_errors = Vcb->scrub.num_errors + Vcb->scrub.previous_errors;
+    si->position = 0xffffffffffffffff;
+    si->num_chunks = 0;
+
+    le = Vcb->scrub.chunks.Flink;
+    while (le != &Vcb->scrub.chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry_balance);
+
+        si->position = min(si->position, c->offset);
+
+        le = le->Flink;
+    }
+
+    for (i = 0; i < Vcb->scrub.num_workers; i++) {
+        scrub_worker* sw = &Vcb->scrub.workers[i];
+
+        if (sw->c) {
+            si->position = min(si->position, sw->c->offset);
+
+            if (si->num_chunks < max_chunks) {
+                si->chunks[si->num_chunks].chunk = sw->c->offset;
+                si->chunks[si->num_chunks].offset = sw->offset;
+                si->num_chunks++;
+            }
+        }
+    }
+
+    ExReleaseResourceLite(&Vcb->scrub.stats_lock);
+
+    size = offsetof(SCRUB_ITEM, chunks) + (si->num_chunks * sizeof(SCRUB_ITEM_CHUNK));
+
+    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
+
+    if (!Vcb->readonly) {
+        Status = write_scrub_item(Vcb, si, (UINT16)size);
+        if (!NT_SUCCESS(Status)) {
+            ERR("write_scrub_item returned %08x\n", Status);
+            ExFreePool(si);
+        }
+    } else
+        ExFreePool(si);
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+}
+
+static UINT64 get_scrub_start_offset(device_extension* Vcb, chunk* c) {
+    ULONG i;
+
+    if (!Vcb->scrub.resume)
+        return c->offset;
+
+    for (i = 0; i < Vcb->scrub.resume->num_chunks; i++) {
+        if (Vcb->scrub.resume->chunks[i].chunk == c->offset)
+            return min(max(Vcb->scrub.resume->chunks[i].offset, c->offset), c->offset + c->chunk_item->size);
+    }
+
+    return c->offset;
+}
+
+// Called with stats_lock held exclusively. Prefers a chunk whose devices are idle, so that each
+// device gets its own stream of reads rather than all workers piling onto the same disk.
+static chunk* get_next_scrub_chunk(device_extension* Vcb) {
+    LIST_ENTRY* le;
+    chunk* best = NULL;
+    ULONG best_active = 0xffffffff;
+    UINT16 i;
+
+    le = Vcb->scrub.chunks.Flink;
+    while (le != &Vcb->scrub.chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry_balance);
+        ULONG active = 0;
+
+        for (i = 0; i < c->chunk_item->num_stripes; i++) {
+            if (c->devices[i] && c->devices[i]->scrub_active > active)
+                active = c->devices[i]->scrub_active;
+        }
+
+        if (active < best_active) {
+            best = c;
+            best_active = active;
+
+            if (active == 0)
+                break;
+        }
+
+        le = le->Flink;
+    }
+
+    if (!best)
+        return NULL;
+
+    RemoveEntryList(&best->list_entry_balance);
+
+    for (i = 0; i < best->chunk_item->num_stripes; i++) {
+        if (best->devices[i])
+            best->devices[i]->scrub_active++;
+    }
+
+    return best;
+}
+
+static void scrub_chunks(scrub_worker* sw) {
+    device_extension* Vcb = sw->Vcb;
+    NTSTATUS Status;
+
+    while (TRUE) {
+        chunk* c;
+        UINT64 offset;
+        BOOL changed;
+        UINT16 i;
+
+        ExAcquireResourceExclusiveLite(&Vcb->scrub.stats_lock, TRUE);
+
+        c = Vcb->scrub.stopping ? NULL : get_next_scrub_chunk(Vcb);
+
+        if (c) {
+            sw->c = c;
+            sw->offset = get_scrub_start_offset(Vcb, c);
+        }
+
+        ExReleaseResourceLite(&Vcb->scrub.stats_lock);
+
+        if (!c)
+            break;
+
+        offset = sw->offset;
+        c->reloc = TRUE;
+
+        KeWaitForSingleObject(&Vcb->scrub.event, Executive, KernelMode, FALSE, NULL);
+
+        if (!Vcb->scrub.stopping) {
+            do {
+                LARGE_INTEGER time;
+                BOOL checkpoint = FALSE;
+
+                changed = FALSE;
+
+                Status = scrub_chunk(Vcb, c, &offset, &changed);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("scrub_chunk returned %08x\n", Status);
+                    Vcb->scrub.stopping = TRUE;
+                    Vcb->scrub.error = Status;
+                    break;
+                }
+
+                KeQuerySystemTime(&time);
+
+                ExAcquireResourceExclusiveLite(&Vcb->scrub.stats_lock, TRUE);
+
+                sw->offset = offset;
+
+                if (time.QuadPart - Vcb->scrub.last_checkpoint.QuadPart >= SCRUB_CHECKPOINT_INTERVAL) {
+                    Vcb->scrub.last_checkpoint = time;
+                    checkpoint = TRUE;
+                }
+
+                ExReleaseResourceLite(&Vcb->scrub.stats_lock);
+
+                if (checkpoint)
+                    scrub_checkpoint(Vcb, FALSE);
+
+                throttle_wait(Vcb, &Vcb->scrub.throttle, &Vcb->scrub.stopping);
+
+                if (offset == c->offset + c->chunk_item->size || Vcb->scrub.stopping)
+                    break;
+
+                KeWaitForSingleObject(&Vcb->scrub.event, Executive, KernelMode, FALSE, NULL);
+            } while (changed);
+        }
+
+        // leave sw->c set, so that the final checkpoint knows where we got to
+        if (Vcb->scrub.stopping)
+            break;
+
+        ExAcquireResourceExclusiveLite(&Vcb->scrub.stats_lock, TRUE);
+
+        Vcb->scrub.chunks_left--;
+
+        for (i = 0; i < c->chunk_item->num_stripes; i++) {
+            if (c->devices[i])
+                c->devices[i]->scrub_active--;
+        }
+
+        sw->c = NULL;
+
+        ExReleaseResource(&Vcb->scrub.stats_lock);
+
+        c->reloc = FALSE;
+        c->list_entry_balance.Flink = NULL;
+    }
+}
+
+_Function_class_(KSTART_ROUTINE)
+static void scrub_worker_thread(void* context) {
+    scrub_worker* sw = context;
+
+    scrub_chunks(sw);
+
+    KeSetEvent(&sw->finished, 0, FALSE);
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
 _Function_class_(KSTART_ROUTINE)
 static void scrub_thread(void* context) {
     device_extension* Vcb = context;
-    LIST_ENTRY chunks, *le;
+    LIST_ENTRY* le;
     NTSTATUS Status;
     LARGE_INTEGER time;
-
-    KeInitializeEvent(&Vcb->scrub.finished, NotificationEvent, FALSE);
-
-    InitializeListHead(&chunks);
+    ULONG num_devices = 0, num_workers, i;
+    scrub_worker* workers;
+    SCRUB_ITEM* resume = Vcb->scrub.resume;
 
     ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
 
+    // a new scrub replaces any checkpoint left by an old one
+    if (!resume) {
+        Status = write_scrub_item(Vcb, NULL, 0);
+        if (!NT_SUCCESS(Status))
+            WARN("write_scrub_item returned %08x\n", Status);
+    }
+
     if (Vcb->need_write && !Vcb->readonly)
         Status = do_write(Vcb, NULL);
     else
@@ -3158,20 +3471,43 @@ static void scrub_thread(void* context) {
 
     ExAcquireResourceExclusiveLite(&Vcb->scrub.stats_lock, TRUE);
 
-    KeQuerySystemTime(&Vcb->scrub.start_time);
+    KeQuerySystemTime(&Vcb->scrub.resume_time);
+    Vcb->scrub.last_checkpoint = Vcb->scrub.resume_time;
     Vcb->scrub.finish_time.QuadPart = 0;
-    Vcb->scrub.resume_time.QuadPart = Vcb->scrub.start_time.QuadPart;
-    Vcb->scrub.duration.QuadPart = 0;
     Vcb->scrub.total_chunks = 0;
     Vcb->scrub.chunks_left = 0;
-    Vcb->scrub.data_scrubbed = 0;
     Vcb->scrub.num_errors = 0;
 
+    if (resume) {
+        Vcb->scrub.start_time.QuadPart = resume->start_time;
+        Vcb->scrub.duration.QuadPart = resume->duration;
+        Vcb->scrub.data_scrubbed = resume->data_scrubbed;
+        Vcb->scrub.previous_errors = (ULONG)resume->num_errors;
+    } else {
+        Vcb->scrub.start_time.QuadPart = Vcb->scrub.resume_time.QuadPart;
+        Vcb->scrub.duration.QuadPart = 0;
+        Vcb->scrub.data_scrubbed = 0;
+        Vcb->scrub.previous_errors = 0;
+    }
+
     while (!IsListEmpty(&Vcb->scrub.errors)) {
         scrub_error* err = CONTAINING_RECORD(RemoveHeadList(&Vcb->scrub.errors), scrub_error, list_entry);
         ExFreePool(err);
     }
 
+    le = Vcb->devices.Flink;
+    while (le != &Vcb->devices) {
+        device* dev = CONTAINING_RECORD(le, device, list_entry);
+
+        dev->scrub_data = 0;
+        dev->scrub_active = 0;
+
+        if (dev->devobj)
+            num_devices++;
+
+        le = le->Flink;
+    }
+
     ExAcquireResourceSharedLite(&Vcb->chunk_lock, TRUE);
 
     le = Vcb->chunks.Flink;
@@ -3181,9 +3517,12 @@ static void scrub_thread(void* context) {
         ExAcquireResourceExclusiveLite(&c->lock, TRUE);
 
         if (!c->readonly) {
-            InsertTailList(&chunks, &c->list_entry_balance);
             Vcb->scrub.total_chunks++;
-            Vcb->scrub.chunks_left++;
+
+            if (!resume || c->offset >= resume->position) {
+                InsertTailList(&Vcb->scrub.chunks, &c->list_entry_balance);
+                Vcb->scrub.chunks_left++;
+            }
         }
 
         ExReleaseResourceLite(&c->lock);
@@ -3193,64 +3532,137 @@ static void scrub_thread(void* context) {
 
     ExReleaseResourceLite(&Vcb->chunk_lock);
 
-    ExReleaseResource(&Vcb->scrub.stats_lock);
+    // one stream per device, times the queue depth
 
-    ExReleaseResourceLite(&Vcb->tree_lock);
+    num_workers = max(num_devices, 1) * max(Vcb->options.scrub_queue_depth, 1);
 
-    while (!IsListEmpty(&chunks)) {
-        chunk* c = CONTAINING_RECORD(RemoveHeadList(&chunks), chunk, list_entry_balance);
-        UINT64 offset = c->offset;
-        BOOL changed;
+    if ((UINT64)num_workers > Vcb->scrub.chunks_left)
+        num_workers = (ULONG)max(Vcb->scrub.chunks_left, 1);
 
-        c->reloc = TRUE;
+    workers = ExAllocatePoolWithTag(NonPagedPool, sizeof(scrub_worker) * num_workers, ALLOC_TAG);
+    if (!workers) {
+        ERR("out of memory\n");
+        ExReleaseResource(&Vcb->scrub.stats_lock);
+        ExReleaseResourceLite(&Vcb->tree_lock);
+        Vcb->scrub.error = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
 
-        KeWaitForSingleObject(&Vcb->scrub.event, Executive, KernelMode, FALSE, NULL);
+    for (i = 0; i < num_workers; i++) {
+        workers[i].Vcb = Vcb;
+        workers[i].thread = NULL;
+        workers[i].c = NULL;
+        KeInitializeEvent(&workers[i].finished, NotificationEvent, FALSE);
+    }
 
-        if (!Vcb->scrub.stopping) {
-            do {
-                changed = FALSE;
+    Vcb->scrub.workers = workers;
+    Vcb->scrub.num_workers = num_workers;
 
-                Status = scrub_chunk(Vcb, c, &offset, &changed);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("scrub_chunk returned %08x\n", Status);
-                    Vcb->scrub.stopping = TRUE;
-                    Vcb->scrub.error = Status;
-                    break;
-                }
+    ExReleaseResource(&Vcb->scrub.stats_lock);
 
-                if (offset == c->offset + c->chunk_item->size || Vcb->scrub.stopping)
-                    break;
+    ExReleaseResourceLite(&Vcb->tree_lock);
 
-                KeWaitForSingleObject(&Vcb->scrub.event, Executive, KernelMode, FALSE, NULL);
-            } while (changed);
+    // this thread runs the first stream itself
+
+    for (i = 1; i < num_workers; i++) {
+        Status = PsCreateSystemThread(&workers[i].thread, 0, NULL, NULL, NULL, scrub_worker_thread, &workers[i]);
+        if (!NT_SUCCESS(Status)) {
+            ERR("PsCreateSystemThread returned %08x\n", Status);
+            workers[i].thread = NULL;
+            break;
         }
+    }
 
-        ExAcquireResourceExclusiveLite(&Vcb->scrub.stats_lock, TRUE);
+    scrub_chunks(&workers[0]);
 
-        if (!Vcb->scrub.stopping)
-            Vcb->scrub.chunks_left--;
+    for (i = 1; i < num_workers; i++) {
+        if (workers[i].thread) {
+            KeWaitForSingleObject(&workers[i].finished, Executive, KernelMode, FALSE, NULL);
+            ZwClose(workers[i].thread);
+        }
+    }
 
-        if (IsListEmpty(&chunks))
-            KeQuerySystemTime(&Vcb->scrub.finish_time);
+    // Keep a checkpoint if we were stopped - it's resumed automatically at the next mount if we
+    // were interrupted by a dismount, otherwise only if asked for.
+    if (Vcb->scrub.stopping)
+        scrub_checkpoint(Vcb, !Vcb->removing || !NT_SUCCESS(Vcb->scrub.error));
+    else {
+        ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
 
-        ExReleaseResource(&Vcb->scrub.stats_lock);
+        Status = write_scrub_item(Vcb, NULL, 0);
+        if (!NT_SUCCESS(Status))
+            WARN("write_scrub_item returned %08x\n", Status);
+
+        ExReleaseResourceLite(&Vcb->tree_lock);
+    }
+
+    ExAcquireResourceExclusiveLite(&Vcb->scrub.stats_lock, TRUE);
+
+    for (i = 0; i < num_workers; i++) {
+        if (workers[i].c) {
+            workers[i].c->reloc = FALSE;
+            workers[i].c->list_entry_balance.Flink = NULL;
+        }
+    }
+
+    while (!IsListEmpty(&Vcb->scrub.chunks)) {
+        chunk* c = CONTAINING_RECORD(RemoveHeadList(&Vcb->scrub.chunks), chunk, list_entry_balance);
 
-        c->reloc = FALSE;
         c->list_entry_balance.Flink = NULL;
     }
 
+    Vcb->scrub.workers = NULL;
+    Vcb->scrub.num_workers = 0;
+
+    KeQuerySystemTime(&Vcb->scrub.finish_time);
+
+    ExReleaseResource(&Vcb->scrub.stats_lock);
+
+    ExFreePool(workers);
+
     KeQuerySystemTime(&time);
     Vcb->scrub.duration.QuadPart += time.QuadPart - Vcb->scrub.resume_time.QuadPart;
 
 end:
+    if (Vcb->scrub.resume) {
+        ExFreePool(Vcb->scrub.resume);
+        Vcb->scrub.resume = NULL;
+    }
+
     ZwClose(Vcb->scrub.thread);
     Vcb->scrub.thread = NULL;
 
     KeSetEvent(&Vcb->scrub.finished, 0, FALSE);
 }
 
-NTSTATUS start_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode) {
+static NTSTATUS spawn_scrub_thread(device_extension* Vcb, btrfs_throttle* throttle, SCRUB_ITEM* resume) {
+    NTSTATUS Status;
+
+    Vcb->scrub.stopping = FALSE;
+    Vcb->scrub.error = STATUS_SUCCESS;
+    Vcb->scrub.resume = resume;
+    KeInitializeEvent(&Vcb->scrub.event, NotificationEvent, !Vcb->scrub.paused);
+    KeInitializeEvent(&Vcb->scrub.finished, NotificationEvent, FALSE);
+
+    init_throttle(&Vcb->scrub.throttle, throttle);
+
+    Status = PsCreateSystemThread(&Vcb->scrub.thread, 0, NULL, NULL, NULL, scrub_thread, Vcb);
+    if (!NT_SUCCESS(Status)) {
+        ERR("PsCreateSystemThread returned %08x\n", Status);
+        Vcb->scrub.resume = NULL;
+        return Status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS start_scrub(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode) {
     NTSTATUS Status;
+    btrfs_start_scrub* bss = (btrfs_start_scrub*)data;
+    SCRUB_ITEM* resume = NULL;
+
+    if (data && length < sizeof(btrfs_start_scrub))
+        return STATUS_INVALID_PARAMETER;
 
     if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_MANAGE_VOLUME_PRIVILEGE), processor_mode))
         return STATUS_PRIVILEGE_NOT_HELD;
@@ -3260,27 +3672,73 @@ NTSTATUS start_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode) {
         return STATUS_DEVICE_NOT_READY;
     }
 
+    if (Vcb->readonly)
+        return STATUS_MEDIA_WRITE_PROTECTED;
+
+    stop_auto_compact_and_lock(Vcb);
+
     if (Vcb->balance.thread) {
+        ExReleaseResourceLite(&Vcb->tree_lock);
         WARN("cannot start scrub while balance running\n");
         return STATUS_DEVICE_NOT_READY;
     }
 
     if (Vcb->scrub.thread) {
+        ExReleaseResourceLite(&Vcb->tree_lock);
         WARN("scrub already running\n");
         return STATUS_DEVICE_NOT_READY;
     }
 
-    if (Vcb->readonly)
-        return STATUS_MEDIA_WRITE_PROTECTED;
+    if (bss && bss->resume) {
+        Status = load_scrub_item(Vcb, &resume);
+
+        if (Status == STATUS_NOT_FOUND)
+            resume = NULL; // nothing to resume, so start from scratch
+        else if (!NT_SUCCESS(Status)) {
+            ExReleaseResourceLite(&Vcb->tree_lock);
+            ERR("load_scrub_item returned %08x\n", Status);
+            return Status;
+        }
+    }
 
-    Vcb->scrub.stopping = FALSE;
     Vcb->scrub.paused = FALSE;
-    Vcb->scrub.error = STATUS_SUCCESS;
-    KeInitializeEvent(&Vcb->scrub.event, NotificationEvent, !Vcb->scrub.paused);
 
-    Status = PsCreateSystemThread(&Vcb->scrub.thread, 0, NULL, NULL, NULL, scrub_thread, Vcb);
+    Status = spawn_scrub_thread(Vcb, bss ? &bss->throttle : NULL, resume);
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
     if (!NT_SUCCESS(Status)) {
-        ERR("PsCreateSystemThread returned %08x\n", Status);
+        if (resume)
+            ExFreePool(resume);
+
+        return Status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS look_for_scrub_item(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb) {
+    NTSTATUS Status;
+    SCRUB_ITEM* resume;
+
+    if (Vcb->readonly || Vcb->balance.thread)
+        return STATUS_SUCCESS;
+
+    Status = load_scrub_item(Vcb, &resume);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    // cancelled by the user, so leave it until we're asked to resume
+    if (resume->flags & SCRUB_FLAGS_CANCELLED) {
+        ExFreePool(resume);
+        return STATUS_SUCCESS;
+    }
+
+    Vcb->scrub.paused = Vcb->options.skip_balance;
+
+    Status = spawn_scrub_thread(Vcb, NULL, resume);
+    if (!NT_SUCCESS(Status)) {
+        ExFreePool(resume);
         return Status;
     }
 
@@ -3289,7 +3747,7 @@ NTSTATUS start_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode) {
 
 NTSTATUS query_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode, void* data, ULONG length) {
     btrfs_query_scrub* bqs = (btrfs_query_scrub*)data;
-    ULONG len;
+    ULONG len, off;
     NTSTATUS Status;
     LIST_ENTRY* le;
     btrfs_scrub_error* bse = NULL;
@@ -3300,6 +3758,7 @@ NTSTATUS query_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode, void
     if (length < offsetof(btrfs_query_scrub, errors))
         return STATUS_BUFFER_TOO_SMALL;
 
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
     ExAcquireResourceSharedLite(&Vcb->scrub.stats_lock, TRUE);
 
     if (Vcb->scrub.thread && Vcb->scrub.chunks_left > 0)
@@ -3324,7 +3783,13 @@ NTSTATUS query_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode, void
 
     bqs->error = Vcb->scrub.error;
 
+    get_throttle_state(Vcb, &Vcb->scrub.throttle, &bqs->throttle);
+
+    bqs->previous_errors = Vcb->scrub.previous_errors;
+
     bqs->num_errors = Vcb->scrub.num_errors;
+    bqs->num_devices = 0;
+    bqs->devices_offset = 0;
 
     len = length - offsetof(btrfs_query_scrub, errors);
 
@@ -3379,10 +3844,38 @@ NTSTATUS query_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode, void
         le = le->Flink;
     }
 
+    // per-device totals go after the errors, aligned to 8 bytes
+
+    off = (ULONG)sector_align(length - len, sizeof(UINT64));
+
+    le = Vcb->devices.Flink;
+    while (le != &Vcb->devices) {
+        device* dev = CONTAINING_RECORD(le, device, list_entry);
+        btrfs_scrub_device* bsd;
+
+        if (off + sizeof(btrfs_scrub_device) > length) {
+            Status = STATUS_BUFFER_OVERFLOW;
+            goto end;
+        }
+
+        bsd = (btrfs_scrub_device*)((UINT8*)bqs + off);
+        bsd->dev_id = dev->devitem.dev_id;
+        bsd->data_scrubbed = dev->scrub_data;
+
+        if (bqs->num_devices == 0)
+            bqs->devices_offset = off;
+
+        bqs->num_devices++;
+        off += sizeof(btrfs_scrub_device);
+
+        le = le->Flink;
+    }
+
     Status = STATUS_SUCCESS;
 
 end:
     ExReleaseResourceLite(&Vcb->scrub.stats_lock);
+    ExReleaseResourceLite(&Vcb->tree_lock);
 
     return Status;
 }
@@ -3439,3 +3932,18 @@ NTSTATUS stop_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode) {
 
     return STATUS_SUCCESS;
 }
+
+NTSTATUS throttle_scrub(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode) {
+    if (!data || length < sizeof(btrfs_throttle))
+        return STATUS_INVALID_PARAMETER;
+
+    if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_MANAGE_VOLUME_PRIVILEGE), processor_mode))
+        return STATUS_PRIVILEGE_NOT_HELD;
+
+    if (!Vcb->scrub.thread)
+        return STATUS_DEVICE_NOT_READY;
+
+    set_throttle(&Vcb->scrub.throttle, (btrfs_throttle*)data);
+
+    return STATUS_SUCCESS;
+}
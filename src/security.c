@@ -51,8 +51,57 @@ static dacl def_dacls[] = {
 };
 
 extern LIST_ENTRY uid_map_list, gid_map_list;
+extern LIST_ENTRY uid_map_hash[MAPPING_HASH_SIZE], uid_map_sid_hash[MAPPING_HASH_SIZE], gid_map_sid_hash[MAPPING_HASH_SIZE];
 extern ERESOURCE mapping_lock;
 
+static UINT32 hash_sid(PSID sid) {
+    sid_header* sh = sid;
+    UINT32* nums = (UINT32*)&sh->nums[0];
+    UINT32 hash = sh->elements;
+    UINT8 i;
+
+    for (i = 0; i < 6; i++) {
+        hash = (hash * 31) + sh->auth[i];
+    }
+
+    for (i = 0; i < sh->elements; i++) {
+        hash = (hash * 31) + nums[i];
+    }
+
+    return hash;
+}
+
+void clear_user_mappings() {
+    ULONG i;
+
+    while (!IsListEmpty(&uid_map_list)) {
+        uid_map* um = CONTAINING_RECORD(RemoveHeadList(&uid_map_list), uid_map, listentry);
+
+        if (um->sid) ExFreePool(um->sid);
+        ExFreePool(um);
+    }
+
+    for (i = 0; i < MAPPING_HASH_SIZE; i++) {
+        InitializeListHead(&uid_map_hash[i]);
+        InitializeListHead(&uid_map_sid_hash[i]);
+    }
+}
+
+void clear_group_mappings() {
+    ULONG i;
+
+    while (!IsListEmpty(&gid_map_list)) {
+        gid_map* gm = CONTAINING_RECORD(RemoveHeadList(&gid_map_list), gid_map, listentry);
+
+        if (gm->sid) ExFreePool(gm->sid);
+        ExFreePool(gm);
+    }
+
+    for (i = 0; i < MAPPING_HASH_SIZE; i++) {
+        InitializeListHead(&gid_map_sid_hash[i]);
+    }
+}
+
 void add_user_mapping(WCHAR* sidstring, ULONG sidstringlength, UINT32 uid) {
     unsigned int i, np;
     UINT8 numdashes;
@@ -137,9 +186,12 @@ void add_user_mapping(WCHAR* sidstring, ULONG sidstringlength, UINT32 uid) {
     }
 
     um->sid = sid;
+    um->sid_hash = hash_sid(sid);
     um->uid = uid;
 
     InsertTailList(&uid_map_list, &um->listentry);
+    InsertTailList(&uid_map_hash[uid % MAPPING_HASH_SIZE], &um->list_entry_uid_hash);
+    InsertTailList(&uid_map_sid_hash[um->sid_hash % MAPPING_HASH_SIZE], &um->list_entry_sid_hash);
 }
 
 void add_group_mapping(WCHAR* sidstring, ULONG sidstringlength, UINT32 gid) {
@@ -221,21 +273,24 @@ void add_group_mapping(WCHAR* sidstring, ULONG sidstringlength, UINT32 gid) {
     }
 
     gm->sid = sid;
+    gm->sid_hash = hash_sid(sid);
     gm->gid = gid;
 
     InsertTailList(&gid_map_list, &gm->listentry);
+    InsertTailList(&gid_map_sid_hash[gm->sid_hash % MAPPING_HASH_SIZE], &gm->list_entry_sid_hash);
 }
 
 NTSTATUS uid_to_sid(UINT32 uid, PSID* sid) {
+    LIST_ENTRY* head = &uid_map_hash[uid % MAPPING_HASH_SIZE];
     LIST_ENTRY* le;
     sid_header* sh;
     UCHAR els;
 
     ExAcquireResourceSharedLite(&mapping_lock, TRUE);
 
-    le = uid_map_list.Flink;
-    while (le != &uid_map_list) {
-        uid_map* um = CONTAINING_RECORD(le, uid_map, listentry);
+    le = head->Flink;
+    while (le != head) {
+        uid_map* um = CONTAINING_RECORD(le, uid_map, list_entry_uid_hash);
 
         if (um->uid == uid) {
             *sid = ExAllocatePoolWithTag(PagedPool, RtlLengthSid(um->sid), ALLOC_TAG);
@@ -308,16 +363,20 @@ NTSTATUS uid_to_sid(UINT32 uid, PSID* sid) {
 }
 
 UINT32 sid_to_uid(PSID sid) {
+    LIST_ENTRY* head;
     LIST_ENTRY* le;
     sid_header* sh = sid;
+    UINT32 hash = hash_sid(sid);
+
+    head = &uid_map_sid_hash[hash % MAPPING_HASH_SIZE];
 
     ExAcquireResourceSharedLite(&mapping_lock, TRUE);
 
-    le = uid_map_list.Flink;
-    while (le != &uid_map_list) {
-        uid_map* um = CONTAINING_RECORD(le, uid_map, listentry);
+    le = head->Flink;
+    while (le != head) {
+        uid_map* um = CONTAINING_RECORD(le, uid_map, list_entry_sid_hash);
 
-        if (RtlEqualSid(sid, um->sid)) {
+        if (um->sid_hash == hash && RtlEqualSid(sid, um->sid)) {
             ExReleaseResourceLite(&mapping_lock);
             return um->uid;
         }
@@ -550,6 +609,98 @@ void fcb_get_sd(fcb* fcb, struct _fcb* parent, BOOL look_for_xattr, PIRP Irp) {
     ExFreePool(groupsid);
 }
 
+// Most files on a volume share one of a handful of security descriptors, so rather than
+// keeping a copy per fcb we keep one refcounted copy of each in Vcb->sd_hash.
+typedef struct {
+    LIST_ENTRY list_entry;
+    UINT32 hash;
+    LONG refcount;
+    ULONG length;
+    UINT8 data[1];
+} interned_sd;
+
+void fcb_intern_sd(fcb* fcb) {
+    device_extension* Vcb = fcb->Vcb;
+    ULONG len;
+    UINT32 hash;
+    LIST_ENTRY* head;
+    LIST_ENTRY* le;
+    interned_sd* isd;
+
+    if (!fcb->sd || fcb->sd_interned)
+        return;
+
+    len = RtlLengthSecurityDescriptor(fcb->sd);
+    if (len == 0)
+        return;
+
+    hash = calc_crc32c(0xffffffff, (UINT8*)fcb->sd, len);
+    head = &Vcb->sd_hash[hash % SD_HASH_SIZE];
+
+    ExAcquireResourceExclusiveLite(&Vcb->sd_hash_lock, TRUE);
+
+    le = head->Flink;
+    while (le != head) {
+        isd = CONTAINING_RECORD(le, interned_sd, list_entry);
+
+        if (isd->hash == hash && isd->length == len && RtlCompareMemory(isd->data, fcb->sd, len) == len) {
+            isd->refcount++;
+            goto found;
+        }
+
+        le = le->Flink;
+    }
+
+    isd = ExAllocatePoolWithTag(PagedPool, offsetof(interned_sd, data[0]) + len, ALLOC_TAG);
+    if (!isd) {
+        ERR("out of memory\n");
+        ExReleaseResourceLite(&Vcb->sd_hash_lock);
+        return; // not fatal - the fcb just keeps its own copy
+    }
+
+    isd->hash = hash;
+    isd->refcount = 1;
+    isd->length = len;
+    RtlCopyMemory(isd->data, fcb->sd, len);
+
+    InsertTailList(head, &isd->list_entry);
+
+found:
+    ExReleaseResourceLite(&Vcb->sd_hash_lock);
+
+    ExFreePool(fcb->sd);
+    fcb->sd = (SECURITY_DESCRIPTOR*)isd->data;
+    fcb->sd_interned = TRUE;
+}
+
+void release_sd(device_extension* Vcb, SECURITY_DESCRIPTOR* sd, BOOL interned) {
+    interned_sd* isd;
+
+    if (!sd)
+        return;
+
+    if (!interned) {
+        ExFreePool(sd);
+        return;
+    }
+
+    isd = CONTAINING_RECORD(sd, interned_sd, data);
+
+    ExAcquireResourceExclusiveLite(&Vcb->sd_hash_lock, TRUE);
+
+    isd->refcount--;
+
+    if (isd->refcount == 0)
+        RemoveEntryList(&isd->list_entry);
+    else
+        isd = NULL;
+
+    ExReleaseResourceLite(&Vcb->sd_hash_lock);
+
+    if (isd)
+        ExFreePool(isd);
+}
+
 static NTSTATUS get_file_security(PFILE_OBJECT FileObject, SECURITY_DESCRIPTOR* relsd, ULONG* buflen, SECURITY_INFORMATION flags) {
     NTSTATUS Status;
     fcb* fcb = FileObject->FsContext;
@@ -705,6 +856,8 @@ static NTSTATUS set_file_security(device_extension* Vcb, PFILE_OBJECT FileObject
 
     oldsd = fcb->sd;
 
+    // SeSetSecurityDescriptorInfo leaves the old SD alone and allocates a new one, so this is safe
+    // even if oldsd is shared with other fcbs
     Status = SeSetSecurityDescriptorInfo(NULL, flags, sd, (void**)&fcb->sd, PagedPool, IoGetFileObjectGenericMapping());
 
     if (!NT_SUCCESS(Status)) {
@@ -712,7 +865,8 @@ static NTSTATUS set_file_security(device_extension* Vcb, PFILE_OBJECT FileObject
         goto end;
     }
 
-    ExFreePool(oldsd);
+    release_sd(Vcb, oldsd, fcb->sd_interned);
+    fcb->sd_interned = FALSE;
 
     KeQuerySystemTime(&time);
     win_time_to_unix(time, &now);
@@ -821,13 +975,17 @@ end:
 }
 
 static BOOL search_for_gid(fcb* fcb, PSID sid) {
+    LIST_ENTRY* head;
     LIST_ENTRY* le;
+    UINT32 hash = hash_sid(sid);
+
+    head = &gid_map_sid_hash[hash % MAPPING_HASH_SIZE];
 
-    le = gid_map_list.Flink;
-    while (le != &gid_map_list) {
-        gid_map* gm = CONTAINING_RECORD(le, gid_map, listentry);
+    le = head->Flink;
+    while (le != head) {
+        gid_map* gm = CONTAINING_RECORD(le, gid_map, list_entry_sid_hash);
 
-        if (RtlEqualSid(sid, gm->sid)) {
+        if (gm->sid_hash == hash && RtlEqualSid(sid, gm->sid)) {
             fcb->inode_item.st_gid = gm->gid;
             return TRUE;
         }
@@ -64,10 +64,19 @@ typedef struct {
     EXTENT_DATA data;
 } send_ext;
 
+typedef struct {
+    UINT8* data;
+    ULONG datalen;
+    ULONG offset;
+    LIST_ENTRY list_entry;
+} send_buffer;
+
 typedef struct {
     device_extension* Vcb;
     root* root;
     root* parent;
+    UINT32 version;
+    send_buffer* buffer;
     UINT8* data;
     ULONG datalen;
     ULONG num_clones;
@@ -75,9 +84,13 @@ typedef struct {
     LIST_ENTRY orphans;
     LIST_ENTRY dirs;
     LIST_ENTRY pending_rmdirs;
-    KEVENT buffer_event;
     send_dir* root_dir;
     send_info* send;
+    LIST_ENTRY prefetches;
+    ULONG prefetch_size;
+    LIST_ENTRY* prefetch_cursor;
+    LIST_ENTRY* prefetch_cursor2;
+    UINT64 prefetch_off;
 
     struct {
         UINT64 inode;
@@ -106,11 +119,105 @@ typedef struct {
     } lastinode;
 } send_context;
 
+typedef struct {
+    device_extension* Vcb;
+    send_ext* se;
+    UINT64 off;
+    UINT64 address;
+    UINT32 length;
+    ULONG skip_start;
+    UINT32* csum;
+    UINT8 compression;
+    UINT8* compbuf;
+    UINT8* data;
+    ULONG size;
+    NTSTATUS Status;
+    KEVENT event;
+    WORK_QUEUE_ITEM item;
+    LIST_ENTRY list_entry;
+} send_prefetch;
+
 #define MAX_SEND_WRITE 0xc000 // 48 KB
 #define SEND_BUFFER_LENGTH 0x100000 // 1 MB
+#define SEND_BUFFERS 4
+#define SEND_PREFETCH_PIECE (16 * MAX_SEND_WRITE) // 768 KB
+#define SEND_PREFETCH_WINDOW 0x800000 // 8 MB
+
+static send_buffer* alloc_send_buffer() {
+    send_buffer* sb;
+
+    // the header is touched under the spinlock, so can't be paged
+    sb = ExAllocatePoolWithTag(NonPagedPool, sizeof(send_buffer), ALLOC_TAG);
+    if (!sb) {
+        ERR("out of memory\n");
+        return NULL;
+    }
+
+    // give ourselves some wiggle room - enough for a write or an encoded write after we've gone over the limit
+    sb->data = ExAllocatePoolWithTag(PagedPool, SEND_BUFFER_LENGTH + (2 * MAX_SEND_WRITE) + COMPRESSED_EXTENT_SIZE, ALLOC_TAG);
+    if (!sb->data) {
+        ERR("out of memory\n");
+        ExFreePool(sb);
+        return NULL;
+    }
+
+    sb->datalen = 0;
+    sb->offset = 0;
+
+    return sb;
+}
+
+static void free_send_buffer(send_buffer* sb) {
+    ExFreePool(sb->data);
+    ExFreePool(sb);
+}
+
+// The stream is generated into a ring of buffers, so that we can carry on while read_send_buffer
+// is copying out the earlier ones. This queues up the current buffer to be read, and switches
+// to an empty one. If they're all full it returns FALSE, leaving the current buffer as it is,
+// and the caller needs to release tree_lock and call wait_for_send_buffer.
+static BOOL next_send_buffer(send_context* context) {
+    send_info* send = context->send;
+    send_buffer* sb;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&send->buffer_lock, &irql);
+
+    if (IsListEmpty(&send->free_buffers)) {
+        KeReleaseSpinLock(&send->buffer_lock, irql);
+        return FALSE;
+    }
+
+    sb = CONTAINING_RECORD(RemoveHeadList(&send->free_buffers), send_buffer, list_entry);
+
+    context->buffer->datalen = context->datalen;
+    context->buffer->offset = 0;
+    InsertTailList(&send->full_buffers, &context->buffer->list_entry);
+    KeSetEvent(&send->buffer_event, 0, FALSE);
+
+    KeReleaseSpinLock(&send->buffer_lock, irql);
+
+    context->buffer = sb;
+    context->data = sb->data;
+    context->datalen = 0;
+
+    return TRUE;
+}
+
+static void wait_for_send_buffer(send_context* context) {
+    while (!context->send->cancelling) {
+        KeClearEvent(&context->send->cleared_event);
+
+        if (next_send_buffer(context))
+            return;
+
+        KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, FALSE, NULL);
+    }
+}
 
 static NTSTATUS find_send_dir(send_context* context, UINT64 dir, UINT64 generation, send_dir** psd, BOOL* added_dummy);
 static NTSTATUS wait_for_flush(send_context* context, traverse_ptr* tp1, traverse_ptr* tp2);
+static void wait_for_prefetches(send_context* context);
 
 static void send_command(send_context* context, UINT16 cmd) {
     btrfs_send_command* bsc = (btrfs_send_command*)&context->data[context->datalen];
@@ -140,6 +247,23 @@ static void send_add_tlv(send_context* context, UINT16 type, void* data, UINT16
     context->datalen += sizeof(btrfs_send_tlv) + length;
 }
 
+// In v2 streams the data attribute has no length, and runs to the end of the command,
+// so it always has to be the last thing added.
+static void send_add_data(send_context* context, void* data, ULONG length) {
+    if (context->version < 2) {
+        send_add_tlv(context, BTRFS_SEND_TLV_DATA, data, (UINT16)length);
+        return;
+    }
+
+    *(UINT16*)&context->data[context->datalen] = BTRFS_SEND_TLV_DATA;
+    context->datalen += sizeof(UINT16);
+
+    if (length > 0 && data)
+        RtlCopyMemory(&context->data[context->datalen], data, length);
+
+    context->datalen += length;
+}
+
 static char* uint64_to_char(UINT64 num, char* buf) {
     char *tmp, tmp2[20];
 
@@ -1602,17 +1726,20 @@ static NTSTATUS wait_for_flush(send_context* context, traverse_ptr* tp1, travers
     NTSTATUS Status;
     KEY key1, key2;
 
+    if (next_send_buffer(context))
+        return STATUS_SUCCESS;
+
     if (tp1)
         key1 = tp1->item->key;
 
     if (tp2)
         key2 = tp2->item->key;
 
+    wait_for_prefetches(context);
+
     ExReleaseResourceLite(&context->Vcb->tree_lock);
 
-    KeClearEvent(&context->send->cleared_event);
-    KeSetEvent(&context->buffer_event, 0, TRUE);
-    KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, FALSE, NULL);
+    wait_for_send_buffer(context);
 
     ExAcquireResourceSharedLite(&context->Vcb->tree_lock, TRUE);
 
@@ -2123,58 +2250,329 @@ static BOOL try_clone(send_context* context, send_ext* se) {
     return FALSE;
 }
 
-static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse_ptr* tp2) {
+static BOOL send_ext_unchanged(send_ext* se, send_ext* se2) {
+    if (se->data.type == EXTENT_TYPE_INLINE && se2->data.type == EXTENT_TYPE_INLINE &&
+        RtlCompareMemory(se->data.data, se2->data.data, (ULONG)se->data.decoded_size) == (ULONG)se->data.decoded_size)
+        return TRUE;
+
+    if (se->data.type == EXTENT_TYPE_REGULAR && se2->data.type == EXTENT_TYPE_REGULAR) {
+        EXTENT_DATA2 *ed2a, *ed2b;
+
+        ed2a = (EXTENT_DATA2*)se->data.data;
+        ed2b = (EXTENT_DATA2*)se2->data.data;
+
+        if (RtlCompareMemory(ed2a, ed2b, sizeof(EXTENT_DATA2)) == sizeof(EXTENT_DATA2))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+// Whether a compressed extent can go into the stream as it is, rather than being decompressed
+// into WRITE commands. As on Linux, this is only worth it if the compressed data is no bigger than
+// the part of the file that it covers.
+static BOOL send_ext_encoded(send_context* context, send_ext* se) {
+    EXTENT_DATA2* ed2 = (EXTENT_DATA2*)se->data.data;
+
+    if (context->version < 2 || se->data.type != EXTENT_TYPE_REGULAR || se->data.compression == BTRFS_COMPRESSION_NONE || ed2->size == 0)
+        return FALSE;
+
+    if (se->offset >= context->lastinode.size)
+        return FALSE;
+
+    return ed2->size <= min(ed2->num_bytes, context->lastinode.size - se->offset);
+}
+
+_Function_class_(WORKER_THREAD_ROUTINE)
+static void send_prefetch_thread(void* ctx) {
+    send_prefetch* sp = ctx;
     NTSTATUS Status;
 
-    if ((IsListEmpty(&context->lastinode.exts) && IsListEmpty(&context->lastinode.oldexts)) || context->lastinode.size == 0)
-        return STATUS_SUCCESS;
+    // The send thread holds tree_lock for as long as we're in flight, so the extent can't move under us.
+
+    Status = read_data(sp->Vcb, sp->address, sp->length, sp->csum, FALSE, sp->compbuf ? sp->compbuf : sp->data, NULL, NULL, NULL, 0, FALSE, NormalPagePriority);
+    if (!NT_SUCCESS(Status))
+        ERR("read_data returned %08x\n", Status);
+    else if (sp->compbuf) {
+        if (sp->compression == BTRFS_COMPRESSION_ZLIB) {
+            Status = zlib_decompress(sp->compbuf, sp->length, sp->data, sp->size);
+            if (!NT_SUCCESS(Status))
+                ERR("zlib_decompress returned %08x\n", Status);
+        } else if (sp->compression == BTRFS_COMPRESSION_LZO) {
+            Status = lzo_decompress(&sp->compbuf[sizeof(UINT32)], sp->length, sp->data, sp->size, sizeof(UINT32));
+            if (!NT_SUCCESS(Status))
+                ERR("lzo_decompress returned %08x\n", Status);
+        } else if (sp->compression == BTRFS_COMPRESSION_ZSTD) {
+            Status = zstd_decompress(sp->compbuf, sp->length, sp->data, sp->size);
+            if (!NT_SUCCESS(Status))
+                ERR("zstd_decompress returned %08x\n", Status);
+        }
+    }
 
-    if (context->parent) {
-        Status = add_ext_holes(&context->lastinode.exts, context->lastinode.size);
-        if (!NT_SUCCESS(Status)) {
-            ERR("add_ext_holes returned %08x\n", Status);
-            return Status;
+    if (sp->compbuf) {
+        ExFreePool(sp->compbuf);
+        sp->compbuf = NULL;
+    }
+
+    if (sp->csum) {
+        ExFreePool(sp->csum);
+        sp->csum = NULL;
+    }
+
+    sp->Status = Status;
+
+    KeSetEvent(&sp->event, 0, FALSE);
+}
+
+static BOOL needs_prefetch(send_ext* se, send_ext* se2) {
+    EXTENT_DATA2* ed2 = (EXTENT_DATA2*)se->data.data;
+
+    if (se->data.type == EXTENT_TYPE_INLINE || ed2->size == 0)
+        return FALSE;
+
+    return !se2 || !send_ext_unchanged(se, se2);
+}
+
+static void advance_prefetch_cursor(send_context* context) {
+    context->prefetch_cursor = context->prefetch_cursor->Flink;
+
+    if (context->parent)
+        context->prefetch_cursor2 = context->prefetch_cursor2->Flink;
+
+    context->prefetch_off = 0;
+}
+
+static NTSTATUS queue_prefetch(send_context* context, send_ext* se) {
+    device_extension* Vcb = context->Vcb;
+    EXTENT_DATA2* ed2 = (EXTENT_DATA2*)se->data.data;
+    send_prefetch* sp;
+    ULONG csum_len;
+    NTSTATUS Status;
+
+    sp = ExAllocatePoolWithTag(NonPagedPool, sizeof(send_prefetch), ALLOC_TAG);
+    if (!sp) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    sp->Vcb = Vcb;
+    sp->se = se;
+    sp->compression = se->data.compression;
+    sp->csum = NULL;
+    sp->compbuf = NULL;
+
+    if (se->data.compression == BTRFS_COMPRESSION_NONE) {
+        UINT64 length = min(ed2->num_bytes - context->prefetch_off, SEND_PREFETCH_PIECE);
+
+        sp->off = ed2->offset + context->prefetch_off;
+        sp->address = ed2->address + sp->off;
+        sp->skip_start = sp->address % Vcb->superblock.sector_size;
+        sp->address -= sp->skip_start;
+        sp->length = (UINT32)sector_align(length + sp->skip_start, Vcb->superblock.sector_size);
+        sp->size = sp->length;
+
+        context->prefetch_off += length;
+    } else {
+        sp->off = 0;
+        sp->address = ed2->address;
+        sp->skip_start = 0;
+        sp->length = (UINT32)ed2->size;
+
+        context->prefetch_off = ed2->num_bytes;
+
+        if (send_ext_encoded(context, se))
+            sp->size = sp->length; // going into the stream compressed, so we don't decompress it
+        else {
+            sp->size = (ULONG)se->data.decoded_size;
+
+            sp->compbuf = ExAllocatePoolWithTag(PagedPool, sp->length, ALLOC_TAG);
+            if (!sp->compbuf) {
+                ERR("out of memory\n");
+                ExFreePool(sp);
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
         }
+    }
 
-        Status = add_ext_holes(&context->lastinode.oldexts, context->lastinode.size);
+    sp->data = ExAllocatePoolWithTag(PagedPool, sp->size, ALLOC_TAG);
+    if (!sp->data) {
+        ERR("out of memory\n");
+        if (sp->compbuf) ExFreePool(sp->compbuf);
+        ExFreePool(sp);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (se->data.compression == BTRFS_COMPRESSION_NONE)
+        csum_len = sp->length / Vcb->superblock.sector_size;
+    else {
+        if (sp->compbuf)
+            RtlZeroMemory(sp->data, sp->size);
+
+        csum_len = (ULONG)(ed2->size / Vcb->superblock.sector_size);
+    }
+
+    // the checksums come from the csum tree, so have to be loaded here while we have tree_lock
+    if (!(context->lastinode.flags & BTRFS_INODE_NODATASUM)) {
+        sp->csum = ExAllocatePoolWithTag(PagedPool, csum_len * sizeof(UINT32), ALLOC_TAG);
+        if (!sp->csum) {
+            ERR("out of memory\n");
+            ExFreePool(sp->data);
+            if (sp->compbuf) ExFreePool(sp->compbuf);
+            ExFreePool(sp);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        Status = load_csum(Vcb, sp->csum, sp->address, csum_len, NULL);
         if (!NT_SUCCESS(Status)) {
-            ERR("add_ext_holes returned %08x\n", Status);
+            ERR("load_csum returned %08x\n", Status);
+            ExFreePool(sp->csum);
+            ExFreePool(sp->data);
+            if (sp->compbuf) ExFreePool(sp->compbuf);
+            ExFreePool(sp);
             return Status;
         }
+    }
 
-        Status = sync_ext_cutoff_points(context);
+    sp->Status = STATUS_PENDING;
+    KeInitializeEvent(&sp->event, NotificationEvent, FALSE);
+
+    InsertTailList(&context->prefetches, &sp->list_entry);
+    context->prefetch_size += sp->size;
+
+    ExInitializeWorkItem(&sp->item, send_prefetch_thread, sp);
+    ExQueueWorkItem(&sp->item, DelayedWorkQueue);
+
+    return STATUS_SUCCESS;
+}
+
+// Walks ahead of flush_extents through the inode's extent list, keeping up to SEND_PREFETCH_WINDOW
+// of reads and decompression in flight. Extents that might turn out to be clones are read too;
+// if try_clone succeeds, the data is thrown away by discard_prefetches.
+static NTSTATUS queue_prefetches(send_context* context) {
+    NTSTATUS Status;
+
+    while (context->prefetch_cursor != &context->lastinode.exts) {
+        send_ext* se = CONTAINING_RECORD(context->prefetch_cursor, send_ext, list_entry);
+        send_ext* se2 = context->parent ? CONTAINING_RECORD(context->prefetch_cursor2, send_ext, list_entry) : NULL;
+
+        if (!needs_prefetch(se, se2)) {
+            advance_prefetch_cursor(context);
+            continue;
+        }
+
+        if (!IsListEmpty(&context->prefetches) && context->prefetch_size >= SEND_PREFETCH_WINDOW)
+            break;
+
+        Status = queue_prefetch(context, se);
         if (!NT_SUCCESS(Status)) {
-            ERR("sync_ext_cutoff_points returned %08x\n", Status);
+            ERR("queue_prefetch returned %08x\n", Status);
             return Status;
         }
+
+        if (context->prefetch_off >= ((EXTENT_DATA2*)se->data.data)->num_bytes)
+            advance_prefetch_cursor(context);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static void free_prefetch(send_context* context, send_prefetch* sp) {
+    KeWaitForSingleObject(&sp->event, Executive, KernelMode, FALSE, NULL);
+
+    context->prefetch_size -= sp->size;
+
+    ExFreePool(sp->data);
+    ExFreePool(sp);
+}
+
+// Returns the prefetched data for the piece of se starting at off, waiting for it if necessary.
+static NTSTATUS get_prefetch(send_context* context, send_ext* se, UINT64 off, send_prefetch** psp) {
+    send_prefetch* sp;
+    NTSTATUS Status;
+
+    Status = queue_prefetches(context);
+    if (!NT_SUCCESS(Status)) {
+        ERR("queue_prefetches returned %08x\n", Status);
+        return Status;
+    }
+
+    if (IsListEmpty(&context->prefetches)) {
+        ERR("no prefetch queued for extent at %llx\n", se->offset);
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    sp = CONTAINING_RECORD(context->prefetches.Flink, send_prefetch, list_entry);
+
+    if (sp->se != se || sp->off != off) {
+        ERR("prefetch out of order (expected %llx,%llx, found %llx,%llx)\n", se->offset, off, sp->se->offset, sp->off);
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    RemoveEntryList(&sp->list_entry);
+
+    KeWaitForSingleObject(&sp->event, Executive, KernelMode, FALSE, NULL);
+
+    if (!NT_SUCCESS(sp->Status)) {
+        Status = sp->Status;
+        free_prefetch(context, sp);
+        return Status;
+    }
+
+    *psp = sp;
+
+    return STATUS_SUCCESS;
+}
+
+static void discard_prefetches(send_context* context, send_ext* se) {
+    while (!IsListEmpty(&context->prefetches)) {
+        send_prefetch* sp = CONTAINING_RECORD(context->prefetches.Flink, send_prefetch, list_entry);
+
+        if (sp->se != se)
+            break;
+
+        RemoveEntryList(&sp->list_entry);
+        free_prefetch(context, sp);
+    }
+
+    if (context->prefetch_cursor == &se->list_entry)
+        advance_prefetch_cursor(context);
+}
+
+// Reads in flight have to finish before tree_lock is released, as balance could move the extents.
+static void wait_for_prefetches(send_context* context) {
+    LIST_ENTRY* le = context->prefetches.Flink;
+
+    while (le != &context->prefetches) {
+        send_prefetch* sp = CONTAINING_RECORD(le, send_prefetch, list_entry);
+
+        KeWaitForSingleObject(&sp->event, Executive, KernelMode, FALSE, NULL);
+
+        le = le->Flink;
     }
+}
+
+static NTSTATUS write_extents(send_context* context, traverse_ptr* tp1, traverse_ptr* tp2) {
+    NTSTATUS Status;
 
     while (!IsListEmpty(&context->lastinode.exts)) {
-        send_ext* se = CONTAINING_RECORD(RemoveHeadList(&context->lastinode.exts), send_ext, list_entry);
-        send_ext* se2 = context->parent ? CONTAINING_RECORD(RemoveHeadList(&context->lastinode.oldexts), send_ext, list_entry) : NULL;
+        send_ext *se, *se2;
         ULONG pos;
         EXTENT_DATA2* ed2;
 
-        if (se2) {
-            if (se->data.type == EXTENT_TYPE_INLINE && se2->data.type == EXTENT_TYPE_INLINE &&
-                RtlCompareMemory(se->data.data, se2->data.data, (ULONG)se->data.decoded_size) == (ULONG)se->data.decoded_size) {
-                ExFreePool(se);
-                ExFreePool(se2);
-                continue;
-            }
-
-            if (se->data.type == EXTENT_TYPE_REGULAR && se2->data.type == EXTENT_TYPE_REGULAR) {
-                EXTENT_DATA2 *ed2a, *ed2b;
+        // also moves the prefetch cursor on from anything we're about to free
+        Status = queue_prefetches(context);
+        if (!NT_SUCCESS(Status)) {
+            ERR("queue_prefetches returned %08x\n", Status);
+            return Status;
+        }
 
-                ed2a = (EXTENT_DATA2*)se->data.data;
-                ed2b = (EXTENT_DATA2*)se2->data.data;
+        se = CONTAINING_RECORD(RemoveHeadList(&context->lastinode.exts), send_ext, list_entry);
+        se2 = context->parent ? CONTAINING_RECORD(RemoveHeadList(&context->lastinode.oldexts), send_ext, list_entry) : NULL;
 
-                if (RtlCompareMemory(ed2a, ed2b, sizeof(EXTENT_DATA2)) == sizeof(EXTENT_DATA2)) {
-                    ExFreePool(se);
-                    ExFreePool(se2);
-                    continue;
-                }
-            }
+        if (se2 && send_ext_unchanged(se, se2)) {
+            ExFreePool(se);
+            ExFreePool(se2);
+            continue;
         }
 
         if (se->data.type == EXTENT_TYPE_INLINE) {
@@ -2186,11 +2584,11 @@ static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse
             send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &se->offset, sizeof(UINT64));
 
             if (se->data.compression == BTRFS_COMPRESSION_NONE)
-                send_add_tlv(context, BTRFS_SEND_TLV_DATA, se->data.data, (UINT16)se->data.decoded_size);
+                send_add_data(context, se->data.data, (ULONG)se->data.decoded_size);
             else if (se->data.compression == BTRFS_COMPRESSION_ZLIB || se->data.compression == BTRFS_COMPRESSION_LZO || se->data.compression == BTRFS_COMPRESSION_ZSTD) {
                 ULONG inlen = se->datalen - (ULONG)offsetof(EXTENT_DATA, data[0]);
 
-                send_add_tlv(context, BTRFS_SEND_TLV_DATA, NULL, (UINT16)se->data.decoded_size);
+                send_add_data(context, NULL, (ULONG)se->data.decoded_size);
                 RtlZeroMemory(&context->data[context->datalen - se->data.decoded_size], (ULONG)se->data.decoded_size);
 
                 if (se->data.compression == BTRFS_COMPRESSION_ZLIB) {
@@ -2244,6 +2642,7 @@ static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse
 
         if (ed2->size != 0 && (context->parent || context->num_clones > 0)) {
             if (try_clone(context, se)) {
+                discard_prefetches(context, se);
                 ExFreePool(se);
                 if (se2) ExFreePool(se2);
                 continue;
@@ -2281,91 +2680,111 @@ static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse
                 offset = se->offset + off;
                 send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &offset, sizeof(UINT64));
 
-                send_add_tlv(context, BTRFS_SEND_TLV_DATA, NULL, length);
+                send_add_data(context, NULL, length);
                 RtlZeroMemory(&context->data[context->datalen - length], length);
 
                 send_command_finish(context, pos);
             }
-        } else if (se->data.compression == BTRFS_COMPRESSION_NONE) {
-            UINT64 off, offset;
-            UINT8* buf;
+        } else if (send_ext_encoded(context, se)) {
+            UINT64 offset, file_len, unencoded_offset;
+            UINT32 compression;
+            send_prefetch* sp;
 
-            buf = ExAllocatePoolWithTag(NonPagedPool, MAX_SEND_WRITE + (2 * context->Vcb->superblock.sector_size), ALLOC_TAG);
-            if (!buf) {
-                ERR("out of memory\n");
+            if (context->datalen > SEND_BUFFER_LENGTH) {
+                Status = wait_for_flush(context, tp1, tp2);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("wait_for_flush returned %08x\n", Status);
+                    ExFreePool(se);
+                    if (se2) ExFreePool(se2);
+                    return Status;
+                }
+
+                if (context->send->cancelling) {
+                    ExFreePool(se);
+                    if (se2) ExFreePool(se2);
+                    return STATUS_SUCCESS;
+                }
+            }
+
+            Status = get_prefetch(context, se, 0, &sp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("get_prefetch returned %08x\n", Status);
                 ExFreePool(se);
                 if (se2) ExFreePool(se2);
-                return STATUS_INSUFFICIENT_RESOURCES;
+                return Status;
+            }
+
+            if (se->data.compression == BTRFS_COMPRESSION_ZLIB)
+                compression = BTRFS_ENCODED_IO_COMPRESSION_ZLIB;
+            else if (se->data.compression == BTRFS_COMPRESSION_ZSTD)
+                compression = BTRFS_ENCODED_IO_COMPRESSION_ZSTD;
+            else { // LZO is split into sector-sized pieces, which the receiver needs to know about
+                UINT32 ss = context->Vcb->superblock.sector_size;
+
+                compression = BTRFS_ENCODED_IO_COMPRESSION_LZO_4K;
+
+                while (ss > 0x1000) {
+                    compression++;
+                    ss >>= 1;
+                }
             }
 
+            offset = se->offset;
+            file_len = min(ed2->num_bytes, context->lastinode.size - se->offset);
+            unencoded_offset = ed2->offset;
+
+            pos = context->datalen;
+
+            send_command(context, BTRFS_SEND_CMD_ENCODED_WRITE);
+
+            send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (UINT16)strlen(context->lastinode.path) : 0);
+            send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &offset, sizeof(UINT64));
+            send_add_tlv(context, BTRFS_SEND_TLV_UNENCODED_FILE_LEN, &file_len, sizeof(UINT64));
+            send_add_tlv(context, BTRFS_SEND_TLV_UNENCODED_LEN, &se->data.decoded_size, sizeof(UINT64));
+            send_add_tlv(context, BTRFS_SEND_TLV_UNENCODED_OFFSET, &unencoded_offset, sizeof(UINT64));
+            send_add_tlv(context, BTRFS_SEND_TLV_COMPRESSION, &compression, sizeof(UINT32));
+            send_add_data(context, sp->data, sp->size);
+
+            send_command_finish(context, pos);
+
+            free_prefetch(context, sp);
+        } else if (se->data.compression == BTRFS_COMPRESSION_NONE) {
+            UINT64 off, offset;
+            send_prefetch* sp = NULL;
+
             for (off = ed2->offset; off < ed2->offset + ed2->num_bytes; off += MAX_SEND_WRITE) {
                 UINT16 length = (UINT16)min(ed2->offset + ed2->num_bytes - off, MAX_SEND_WRITE);
-                ULONG skip_start;
-                UINT64 addr = ed2->address + off;
-                UINT32* csum;
 
                 if (context->datalen > SEND_BUFFER_LENGTH) {
                     Status = wait_for_flush(context, tp1, tp2);
                     if (!NT_SUCCESS(Status)) {
                         ERR("wait_for_flush returned %08x\n", Status);
-                        ExFreePool(buf);
+                        if (sp) free_prefetch(context, sp);
                         ExFreePool(se);
                         if (se2) ExFreePool(se2);
                         return Status;
                     }
 
                     if (context->send->cancelling) {
-                        ExFreePool(buf);
+                        if (sp) free_prefetch(context, sp);
                         ExFreePool(se);
                         if (se2) ExFreePool(se2);
                         return STATUS_SUCCESS;
                     }
                 }
 
-                skip_start = addr % context->Vcb->superblock.sector_size;
-                addr -= skip_start;
-
-                if (context->lastinode.flags & BTRFS_INODE_NODATASUM)
-                    csum = NULL;
-                else {
-                    UINT32 len;
+                if (!sp || off >= sp->off + SEND_PREFETCH_PIECE) {
+                    if (sp) free_prefetch(context, sp);
 
-                    len = (UINT32)sector_align(length + skip_start, context->Vcb->superblock.sector_size) / context->Vcb->superblock.sector_size;
-
-                    csum = ExAllocatePoolWithTag(PagedPool, len * sizeof(UINT32), ALLOC_TAG);
-                    if (!csum) {
-                        ERR("out of memory\n");
-                        ExFreePool(buf);
-                        ExFreePool(se);
-                        if (se2) ExFreePool(se2);
-                        return STATUS_INSUFFICIENT_RESOURCES;
-                    }
-
-                    Status = load_csum(context->Vcb, csum, addr, len, NULL);
+                    Status = get_prefetch(context, se, off, &sp);
                     if (!NT_SUCCESS(Status)) {
-                        ERR("load_csum returned %08x\n", Status);
-                        ExFreePool(csum);
-                        ExFreePool(buf);
+                        ERR("get_prefetch returned %08x\n", Status);
                         ExFreePool(se);
                         if (se2) ExFreePool(se2);
-                        return STATUS_INSUFFICIENT_RESOURCES;
+                        return Status;
                     }
                 }
 
-                Status = read_data(context->Vcb, addr, (UINT32)sector_align(length + skip_start, context->Vcb->superblock.sector_size),
-                                   csum, FALSE, buf, NULL, NULL, NULL, 0, FALSE, NormalPagePriority);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("read_data returned %08x\n", Status);
-                    ExFreePool(buf);
-                    ExFreePool(se);
-                    if (se2) ExFreePool(se2);
-                    if (csum) ExFreePool(csum);
-                    return Status;
-                }
-
-                if (csum)
-                    ExFreePool(csum);
-
                 pos = context->datalen;
 
                 send_command(context, BTRFS_SEND_CMD_WRITE);
@@ -2376,111 +2795,25 @@ static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse
                 send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &offset, sizeof(UINT64));
 
                 length = (UINT16)min(context->lastinode.size - se->offset - off, length);
-                send_add_tlv(context, BTRFS_SEND_TLV_DATA, buf + skip_start, length);
+                send_add_data(context, sp->data + sp->skip_start + off - sp->off, length);
 
                 send_command_finish(context, pos);
             }
 
-            ExFreePool(buf);
+            if (sp)
+                free_prefetch(context, sp);
         } else {
-            UINT8 *buf, *compbuf;
             UINT64 off;
-            UINT32* csum;
-
-            buf = ExAllocatePoolWithTag(PagedPool, (ULONG)se->data.decoded_size, ALLOC_TAG);
-            if (!buf) {
-                ERR("out of memory\n");
-                ExFreePool(se);
-                if (se2) ExFreePool(se2);
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
+            send_prefetch* sp;
 
-            compbuf = ExAllocatePoolWithTag(PagedPool, (ULONG)ed2->size, ALLOC_TAG);
-            if (!compbuf) {
-                ERR("out of memory\n");
-                ExFreePool(buf);
-                ExFreePool(se);
-                if (se2) ExFreePool(se2);
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
-
-            if (context->lastinode.flags & BTRFS_INODE_NODATASUM)
-                csum = NULL;
-            else {
-                UINT32 len;
-
-                len = (UINT32)(ed2->size / context->Vcb->superblock.sector_size);
-
-                csum = ExAllocatePoolWithTag(PagedPool, len * sizeof(UINT32), ALLOC_TAG);
-                if (!csum) {
-                    ERR("out of memory\n");
-                    ExFreePool(compbuf);
-                    ExFreePool(buf);
-                    ExFreePool(se);
-                    if (se2) ExFreePool(se2);
-                    return STATUS_INSUFFICIENT_RESOURCES;
-                }
-
-                Status = load_csum(context->Vcb, csum, ed2->address, len, NULL);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("load_csum returned %08x\n", Status);
-                    ExFreePool(csum);
-                    ExFreePool(compbuf);
-                    ExFreePool(buf);
-                    ExFreePool(se);
-                    if (se2) ExFreePool(se2);
-                    return Status;
-                }
-            }
-
-            Status = read_data(context->Vcb, ed2->address, (UINT32)ed2->size, csum, FALSE, compbuf, NULL, NULL, NULL, 0, FALSE, NormalPagePriority);
+            Status = get_prefetch(context, se, 0, &sp);
             if (!NT_SUCCESS(Status)) {
-                ERR("read_data returned %08x\n", Status);
-                ExFreePool(compbuf);
-                ExFreePool(buf);
+                ERR("get_prefetch returned %08x\n", Status);
                 ExFreePool(se);
                 if (se2) ExFreePool(se2);
-                if (csum) ExFreePool(csum);
                 return Status;
             }
 
-            if (csum)
-                ExFreePool(csum);
-
-            if (se->data.compression == BTRFS_COMPRESSION_ZLIB) {
-                Status = zlib_decompress(compbuf, (UINT32)ed2->size, buf, (UINT32)se->data.decoded_size);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("zlib_decompress returned %08x\n", Status);
-                    ExFreePool(compbuf);
-                    ExFreePool(buf);
-                    ExFreePool(se);
-                    if (se2) ExFreePool(se2);
-                    return Status;
-                }
-            } else if (se->data.compression == BTRFS_COMPRESSION_LZO) {
-                Status = lzo_decompress(&compbuf[sizeof(UINT32)], (UINT32)ed2->size, buf, (UINT32)se->data.decoded_size, sizeof(UINT32));
-                if (!NT_SUCCESS(Status)) {
-                    ERR("lzo_decompress returned %08x\n", Status);
-                    ExFreePool(compbuf);
-                    ExFreePool(buf);
-                    ExFreePool(se);
-                    if (se2) ExFreePool(se2);
-                    return Status;
-                }
-            } else if (se->data.compression == BTRFS_COMPRESSION_ZSTD) {
-                Status = zstd_decompress(compbuf, (UINT32)ed2->size, buf, (UINT32)se->data.decoded_size);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("zstd_decompress returned %08x\n", Status);
-                    ExFreePool(compbuf);
-                    ExFreePool(buf);
-                    ExFreePool(se);
-                    if (se2) ExFreePool(se2);
-                    return Status;
-                }
-            }
-
-            ExFreePool(compbuf);
-
             for (off = ed2->offset; off < ed2->offset + ed2->num_bytes; off += MAX_SEND_WRITE) {
                 UINT16 length = (UINT16)min(ed2->offset + ed2->num_bytes - off, MAX_SEND_WRITE);
                 UINT64 offset;
@@ -2489,14 +2822,14 @@ static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse
                     Status = wait_for_flush(context, tp1, tp2);
                     if (!NT_SUCCESS(Status)) {
                         ERR("wait_for_flush returned %08x\n", Status);
-                        ExFreePool(buf);
+                        free_prefetch(context, sp);
                         ExFreePool(se);
                         if (se2) ExFreePool(se2);
                         return Status;
                     }
 
                     if (context->send->cancelling) {
-                        ExFreePool(buf);
+                        free_prefetch(context, sp);
                         ExFreePool(se);
                         if (se2) ExFreePool(se2);
                         return STATUS_SUCCESS;
@@ -2513,12 +2846,12 @@ static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse
                 send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &offset, sizeof(UINT64));
 
                 length = (UINT16)min(context->lastinode.size - se->offset - off, length);
-                send_add_tlv(context, BTRFS_SEND_TLV_DATA, &buf[off], length);
+                send_add_data(context, &sp->data[off], length);
 
                 send_command_finish(context, pos);
             }
 
-            ExFreePool(buf);
+            free_prefetch(context, sp);
         }
 
         ExFreePool(se);
@@ -2528,6 +2861,46 @@ static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse_ptr* tp2) {
+    NTSTATUS Status;
+
+    if ((IsListEmpty(&context->lastinode.exts) && IsListEmpty(&context->lastinode.oldexts)) || context->lastinode.size == 0)
+        return STATUS_SUCCESS;
+
+    if (context->parent) {
+        Status = add_ext_holes(&context->lastinode.exts, context->lastinode.size);
+        if (!NT_SUCCESS(Status)) {
+            ERR("add_ext_holes returned %08x\n", Status);
+            return Status;
+        }
+
+        Status = add_ext_holes(&context->lastinode.oldexts, context->lastinode.size);
+        if (!NT_SUCCESS(Status)) {
+            ERR("add_ext_holes returned %08x\n", Status);
+            return Status;
+        }
+
+        Status = sync_ext_cutoff_points(context);
+        if (!NT_SUCCESS(Status)) {
+            ERR("sync_ext_cutoff_points returned %08x\n", Status);
+            return Status;
+        }
+    }
+
+    context->prefetch_cursor = context->lastinode.exts.Flink;
+    context->prefetch_cursor2 = context->lastinode.oldexts.Flink;
+    context->prefetch_off = 0;
+
+    Status = write_extents(context, tp1, tp2);
+
+    while (!IsListEmpty(&context->prefetches)) {
+        send_prefetch* sp = CONTAINING_RECORD(RemoveHeadList(&context->prefetches), send_prefetch, list_entry);
+        free_prefetch(context, sp);
+    }
+
+    return Status;
+}
+
 static NTSTATUS finish_inode(send_context* context, traverse_ptr* tp1, traverse_ptr* tp2) {
     LIST_ENTRY* le;
 
@@ -3030,14 +3403,12 @@ static void send_thread(void* ctx) {
         do {
             traverse_ptr next_tp;
 
-            if (context->datalen > SEND_BUFFER_LENGTH) {
+            if (context->datalen > SEND_BUFFER_LENGTH && !next_send_buffer(context)) {
                 KEY key1 = tp.item->key, key2 = tp2.item->key;
 
                 ExReleaseResourceLite(&context->Vcb->tree_lock);
 
-                KeClearEvent(&context->send->cleared_event);
-                KeSetEvent(&context->buffer_event, 0, TRUE);
-                KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, FALSE, NULL);
+                wait_for_send_buffer(context);
 
                 if (context->send->cancelling)
                     goto end;
@@ -3409,14 +3780,12 @@ static void send_thread(void* ctx) {
         do {
             traverse_ptr next_tp;
 
-            if (context->datalen > SEND_BUFFER_LENGTH) {
+            if (context->datalen > SEND_BUFFER_LENGTH && !next_send_buffer(context)) {
                 KEY key = tp.item->key;
 
                 ExReleaseResourceLite(&context->Vcb->tree_lock);
 
-                KeClearEvent(&context->send->cleared_event);
-                KeSetEvent(&context->buffer_event, 0, TRUE);
-                KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, FALSE, NULL);
+                wait_for_send_buffer(context);
 
                 if (context->send->cancelling)
                     goto end;
@@ -3521,15 +3890,32 @@ static void send_thread(void* ctx) {
     } else
         ExReleaseResourceLite(&context->Vcb->tree_lock);
 
-    KeClearEvent(&context->send->cleared_event);
-    KeSetEvent(&context->buffer_event, 0, TRUE);
-    KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, FALSE, NULL);
+    // queue up what's left, and wait for everything to be read
+    wait_for_send_buffer(context);
+
+    while (!context->send->cancelling) {
+        KIRQL irql;
+        BOOL empty;
+
+        KeClearEvent(&context->send->cleared_event);
+
+        KeAcquireSpinLock(&context->send->buffer_lock, &irql);
+        empty = IsListEmpty(&context->send->full_buffers);
+        KeReleaseSpinLock(&context->send->buffer_lock, irql);
+
+        if (empty)
+            break;
+
+        KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, FALSE, NULL);
+    }
 
     Status = STATUS_SUCCESS;
 
 end:
+    // wake up read_send_buffer, so that it lets go of send_load_lock
+    KeSetEvent(&context->send->buffer_event, 0, FALSE);
+
     if (!NT_SUCCESS(Status)) {
-        KeSetEvent(&context->buffer_event, 0, FALSE);
 
         if (context->send->ccb)
             context->send->ccb->send_status = Status;
@@ -3563,8 +3949,20 @@ end:
         context->send->ccb->send = NULL;
 
     RemoveEntryList(&context->send->list_entry);
+
+    free_send_buffer(context->buffer);
+
+    while (!IsListEmpty(&context->send->full_buffers)) {
+        send_buffer* sb = CONTAINING_RECORD(RemoveHeadList(&context->send->full_buffers), send_buffer, list_entry);
+        free_send_buffer(sb);
+    }
+
+    while (!IsListEmpty(&context->send->free_buffers)) {
+        send_buffer* sb = CONTAINING_RECORD(RemoveHeadList(&context->send->free_buffers), send_buffer, list_entry);
+        free_send_buffer(sb);
+    }
+
     ExFreePool(context->send);
-    ExFreePool(context->data);
 
     InterlockedDecrement(&context->Vcb->running_sends);
     InterlockedDecrement(&context->root->send_ops);
@@ -3596,7 +3994,7 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
     root* parsubvol = NULL;
     send_context* context;
     send_info* send;
-    ULONG num_clones = 0;
+    ULONG num_clones = 0, flags = 0, i;
     root** clones = NULL;
 
     if (!FileObject || !FileObject->FsContext || !FileObject->FsContext2 || FileObject->FsContext == Vcb->volume_fcb)
@@ -3627,8 +4025,10 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
 
             parent = Handle32ToHandle(bss32->parent);
 
-            if (datalen >= offsetof(btrfs_send_subvol32, clones[0]))
+            if (datalen >= offsetof(btrfs_send_subvol32, clones[0])) {
                 num_clones = bss32->num_clones;
+                flags = bss32->flags;
+            }
 
             if (datalen < offsetof(btrfs_send_subvol32, clones[0]) + (num_clones * sizeof(UINT32)))
                 return STATUS_INVALID_PARAMETER;
@@ -3639,8 +4039,10 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
 
             parent = bss->parent;
 
-            if (datalen >= offsetof(btrfs_send_subvol, clones[0]))
+            if (datalen >= offsetof(btrfs_send_subvol, clones[0])) {
                 num_clones = bss->num_clones;
+                flags = bss->flags;
+            }
 
             if (datalen < offsetof(btrfs_send_subvol, clones[0]) + (num_clones * sizeof(HANDLE)))
                 return STATUS_INVALID_PARAMETER;
@@ -3757,9 +4159,12 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
     context->Vcb = Vcb;
     context->root = fcb->subvol;
     context->parent = parsubvol;
+    context->version = flags & BTRFS_SEND_FLAG_COMPRESSED ? 2 : 1;
     InitializeListHead(&context->orphans);
     InitializeListHead(&context->dirs);
     InitializeListHead(&context->pending_rmdirs);
+    InitializeListHead(&context->prefetches);
+    context->prefetch_size = 0;
     context->lastinode.inode = 0;
     context->lastinode.path = NULL;
     context->lastinode.sd = NULL;
@@ -3771,23 +4176,22 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
     InitializeListHead(&context->lastinode.exts);
     InitializeListHead(&context->lastinode.oldexts);
 
-    context->data = ExAllocatePoolWithTag(PagedPool, SEND_BUFFER_LENGTH + (2 * MAX_SEND_WRITE), ALLOC_TAG); // give ourselves some wiggle room
-    if (!context->data) {
+    context->buffer = alloc_send_buffer();
+    if (!context->buffer) {
         ExFreePool(context);
         ExReleaseResourceLite(&Vcb->send_load_lock);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    context->data = context->buffer->data;
     context->datalen = 0;
 
     send_subvol_header(context, fcb->subvol, ccb->fileref); // FIXME - fileref needs some sort of lock here
 
-    KeInitializeEvent(&context->buffer_event, NotificationEvent, FALSE);
-
     send = ExAllocatePoolWithTag(NonPagedPool, sizeof(send_info), ALLOC_TAG);
     if (!send) {
         ERR("out of memory\n");
-        ExFreePool(context->data);
+        free_send_buffer(context->buffer);
         ExFreePool(context);
 
         if (clones)
@@ -3798,6 +4202,33 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
     }
 
     KeInitializeEvent(&send->cleared_event, NotificationEvent, FALSE);
+    KeInitializeEvent(&send->buffer_event, NotificationEvent, FALSE);
+    KeInitializeSpinLock(&send->buffer_lock);
+    InitializeListHead(&send->full_buffers);
+    InitializeListHead(&send->free_buffers);
+
+    for (i = 1; i < SEND_BUFFERS; i++) {
+        send_buffer* sb = alloc_send_buffer();
+
+        if (!sb) {
+            while (!IsListEmpty(&send->free_buffers)) {
+                sb = CONTAINING_RECORD(RemoveHeadList(&send->free_buffers), send_buffer, list_entry);
+                free_send_buffer(sb);
+            }
+
+            ExFreePool(send);
+            free_send_buffer(context->buffer);
+            ExFreePool(context);
+
+            if (clones)
+                ExFreePool(clones);
+
+            ExReleaseResourceLite(&Vcb->send_load_lock);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        InsertTailList(&send->free_buffers, &sb->list_entry);
+    }
 
     send->context = context;
     context->send = send;
@@ -3815,8 +4246,13 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
         ERR("PsCreateSystemThread returned %08x\n", Status);
         ccb->send = NULL;
         InterlockedDecrement(&Vcb->running_sends);
+        while (!IsListEmpty(&send->free_buffers)) {
+            send_buffer* sb = CONTAINING_RECORD(RemoveHeadList(&send->free_buffers), send_buffer, list_entry);
+            free_send_buffer(sb);
+        }
+
         ExFreePool(send);
-        ExFreePool(context->data);
+        free_send_buffer(context->buffer);
         ExFreePool(context);
 
         if (clones)
@@ -3834,7 +4270,7 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
 
 NTSTATUS read_send_buffer(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG datalen, ULONG_PTR* retlen, KPROCESSOR_MODE processor_mode) {
     ccb* ccb;
-    send_context* context;
+    send_info* send;
 
     ccb = FileObject ? FileObject->FsContext2 : NULL;
     if (!ccb)
@@ -3850,30 +4286,59 @@ NTSTATUS read_send_buffer(device_extension* Vcb, PFILE_OBJECT FileObject, void*
         return !NT_SUCCESS(ccb->send_status) ? ccb->send_status : STATUS_END_OF_FILE;
     }
 
-    context = (send_context*)ccb->send->context;
+    send = ccb->send;
 
-    KeWaitForSingleObject(&context->buffer_event, Executive, KernelMode, FALSE, NULL);
+    KeWaitForSingleObject(&send->buffer_event, Executive, KernelMode, FALSE, NULL);
 
     if (datalen == 0) {
         ExReleaseResourceLite(&Vcb->send_load_lock);
         return STATUS_SUCCESS;
     }
 
-    RtlCopyMemory(data, context->data, min(datalen, context->datalen));
+    *retlen = 0;
 
-    if (datalen < context->datalen) { // not empty yet
-        *retlen = datalen;
-        RtlMoveMemory(context->data, &context->data[datalen], context->datalen - datalen);
-        context->datalen -= datalen;
-        ExReleaseResourceLite(&Vcb->send_load_lock);
-    } else {
-        *retlen = context->datalen;
-        context->datalen = 0;
-        ExReleaseResourceLite(&Vcb->send_load_lock);
+    // Only the send thread adds to full_buffers, and only we remove from it, so the head
+    // buffer can be copied from without holding the spinlock.
+    while (*retlen < datalen) {
+        send_buffer* sb;
+        ULONG len;
+        KIRQL irql;
+
+        KeAcquireSpinLock(&send->buffer_lock, &irql);
+
+        if (IsListEmpty(&send->full_buffers)) {
+            KeReleaseSpinLock(&send->buffer_lock, irql);
+            break;
+        }
 
-        KeClearEvent(&context->buffer_event);
-        KeSetEvent(&ccb->send->cleared_event, 0, FALSE);
+        sb = CONTAINING_RECORD(send->full_buffers.Flink, send_buffer, list_entry);
+
+        KeReleaseSpinLock(&send->buffer_lock, irql);
+
+        len = min(datalen - (ULONG)*retlen, sb->datalen - sb->offset);
+
+        RtlCopyMemory((UINT8*)data + *retlen, &sb->data[sb->offset], len);
+
+        sb->offset += len;
+        *retlen += len;
+
+        if (sb->offset == sb->datalen) {
+            KeAcquireSpinLock(&send->buffer_lock, &irql);
+
+            RemoveEntryList(&sb->list_entry);
+            sb->datalen = 0;
+            InsertTailList(&send->free_buffers, &sb->list_entry);
+
+            if (IsListEmpty(&send->full_buffers))
+                KeClearEvent(&send->buffer_event);
+
+            KeReleaseSpinLock(&send->buffer_lock, irql);
+
+            KeSetEvent(&send->cleared_event, 0, FALSE);
+        }
     }
 
+    ExReleaseResourceLite(&Vcb->send_load_lock);
+
     return STATUS_SUCCESS;
 }
@@ -70,6 +70,7 @@ void BtrfsBalance::StartBalance(HWND hwndDlg) {
     RtlCopyMemory(&bsb.opts[0], &data_opts, sizeof(btrfs_balance_opts));
     RtlCopyMemory(&bsb.opts[1], &metadata_opts, sizeof(btrfs_balance_opts));
     RtlCopyMemory(&bsb.opts[2], &system_opts, sizeof(btrfs_balance_opts));
+    RtlZeroMemory(&bsb.throttle, sizeof(btrfs_throttle));
 
     if (IsDlgButtonChecked(hwndDlg, IDC_DATA) == BST_CHECKED)
         bsb.opts[0].flags |= BTRFS_BALANCE_OPTS_ENABLED;
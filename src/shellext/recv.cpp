@@ -148,6 +148,16 @@ bool BtrfsRecv::find_tlv(uint8_t* data, ULONG datalen, uint16_t type, void** val
         btrfs_send_tlv* tlv = (btrfs_send_tlv*)(data + off);
         uint8_t* payload = data + off + sizeof(btrfs_send_tlv);
 
+        // in v2 streams the data attribute has no length, and runs to the end of the command
+        if (version >= 2 && off + sizeof(uint16_t) <= datalen && tlv->type == BTRFS_SEND_TLV_DATA) {
+            if (type != BTRFS_SEND_TLV_DATA)
+                return false;
+
+            *value = data + off + sizeof(uint16_t);
+            *len = datalen - off - sizeof(uint16_t);
+            return true;
+        }
+
         if (off + sizeof(btrfs_send_tlv) + tlv->length > datalen) // file is truncated
             return false;
 
@@ -1022,6 +1032,57 @@ bool BtrfsRecv::cmd_removexattr(HWND hwnd, btrfs_send_command* cmd, uint8_t* dat
     return true;
 }
 
+// Writes to the same file come one after the other, so we keep the handle open between them.
+bool BtrfsRecv::open_write_file(const wstring& pathu, HANDLE* h) {
+    if (lastwritepath != pathu) {
+        FILE_BASIC_INFO fbi;
+
+        if (lastwriteatt & FILE_ATTRIBUTE_READONLY) {
+            if (!SetFileAttributesW((subvolpath + lastwritepath).c_str(), lastwriteatt)) {
+                ShowRecvError(IDS_RECV_SETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+                return false;
+            }
+        }
+
+        CloseHandle(lastwritefile);
+
+        lastwriteatt = GetFileAttributesW((subvolpath + pathu).c_str());
+        if (lastwriteatt == INVALID_FILE_ATTRIBUTES) {
+            ShowRecvError(IDS_RECV_GETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+            return false;
+        }
+
+        if (lastwriteatt & FILE_ATTRIBUTE_READONLY) {
+            if (!SetFileAttributesW((subvolpath + pathu).c_str(), lastwriteatt & ~FILE_ATTRIBUTE_READONLY)) {
+                ShowRecvError(IDS_RECV_SETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+                return false;
+            }
+        }
+
+        *h = CreateFileW((subvolpath + pathu).c_str(), FILE_WRITE_DATA | FILE_READ_ATTRIBUTES | FILE_WRITE_ATTRIBUTES, 0, nullptr, OPEN_EXISTING,
+                         FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_POSIX_SEMANTICS, nullptr);
+        if (*h == INVALID_HANDLE_VALUE) {
+            ShowRecvError(IDS_RECV_CANT_OPEN_FILE, funcname, pathu.c_str(), GetLastError(), format_message(GetLastError()).c_str());
+            return false;
+        }
+
+        lastwritepath = pathu;
+        lastwritefile = *h;
+
+        memset(&fbi, 0, sizeof(FILE_BASIC_INFO));
+
+        fbi.LastWriteTime.QuadPart = -1;
+
+        if (!SetFileInformationByHandle(*h, FileBasicInfo, &fbi, sizeof(FILE_BASIC_INFO))) {
+            ShowRecvError(IDS_RECV_SETFILEINFO_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+            return false;
+        }
+    } else
+        *h = lastwritefile;
+
+    return true;
+}
+
 bool BtrfsRecv::cmd_write(HWND hwnd, btrfs_send_command* cmd, uint8_t* data) {
     uint64_t* offset;
     uint8_t* writedata;
@@ -1058,61 +1119,162 @@ bool BtrfsRecv::cmd_write(HWND hwnd, btrfs_send_command* cmd, uint8_t* data) {
         return false;
     }
 
-    if (lastwritepath != pathu) {
-        FILE_BASIC_INFO fbi;
+    if (!open_write_file(pathu, &h))
+        return false;
 
-        if (lastwriteatt & FILE_ATTRIBUTE_READONLY) {
-            if (!SetFileAttributesW((subvolpath + lastwritepath).c_str(), lastwriteatt)) {
-                ShowRecvError(IDS_RECV_SETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
-                return false;
-            }
-        }
+    offli.QuadPart = *offset;
 
-        CloseHandle(lastwritefile);
+    if (SetFilePointer(h, offli.LowPart, &offli.HighPart, FILE_BEGIN) == INVALID_SET_FILE_POINTER) {
+        ShowRecvError(IDS_RECV_SETFILEPOINTER_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+        return false;
+    }
 
-        lastwriteatt = GetFileAttributesW((subvolpath + pathu).c_str());
-        if (lastwriteatt == INVALID_FILE_ATTRIBUTES) {
-            ShowRecvError(IDS_RECV_GETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    if (!WriteFile(h, writedata, datalen, nullptr, nullptr)) {
+        ShowRecvError(IDS_RECV_WRITEFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool BtrfsRecv::cmd_encoded_write(HWND hwnd, btrfs_send_command* cmd, uint8_t* data) {
+    uint64_t *offset, *file_len, *unencoded_len, *unencoded_offset;
+    uint32_t *compression, *encryption;
+    uint8_t* writedata;
+    ULONG offsetlen, file_len_len, unencoded_len_len, unencoded_offset_len, compressionlen, encryptionlen, datalen, bwelen;
+    wstring pathu;
+    HANDLE h;
+    LARGE_INTEGER filesize;
+    btrfs_write_encoded* bwe;
+    NTSTATUS Status;
+    IO_STATUS_BLOCK iosb;
+
+    {
+        char* path;
+        ULONG pathlen;
+
+        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen)) {
+            ShowRecvError(IDS_RECV_MISSING_PARAM, funcname, L"path");
             return false;
         }
 
-        if (lastwriteatt & FILE_ATTRIBUTE_READONLY) {
-            if (!SetFileAttributesW((subvolpath + pathu).c_str(), lastwriteatt & ~FILE_ATTRIBUTE_READONLY)) {
-                ShowRecvError(IDS_RECV_SETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
-                return false;
-            }
+        if (!utf8_to_utf16(hwnd, string(path, pathlen), pathu))
+            return false;
+    }
+
+    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_OFFSET, (void**)&offset, &offsetlen)) {
+        ShowRecvError(IDS_RECV_MISSING_PARAM, funcname, L"offset");
+        return false;
+    }
+
+    if (offsetlen < sizeof(uint64_t)) {
+        ShowRecvError(IDS_RECV_SHORT_PARAM, funcname, L"offset", offsetlen, sizeof(uint64_t));
+        return false;
+    }
+
+    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_UNENCODED_FILE_LEN, (void**)&file_len, &file_len_len)) {
+        ShowRecvError(IDS_RECV_MISSING_PARAM, funcname, L"unencoded_file_len");
+        return false;
+    }
+
+    if (file_len_len < sizeof(uint64_t)) {
+        ShowRecvError(IDS_RECV_SHORT_PARAM, funcname, L"unencoded_file_len", file_len_len, sizeof(uint64_t));
+        return false;
+    }
+
+    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_UNENCODED_LEN, (void**)&unencoded_len, &unencoded_len_len)) {
+        ShowRecvError(IDS_RECV_MISSING_PARAM, funcname, L"unencoded_len");
+        return false;
+    }
+
+    if (unencoded_len_len < sizeof(uint64_t)) {
+        ShowRecvError(IDS_RECV_SHORT_PARAM, funcname, L"unencoded_len", unencoded_len_len, sizeof(uint64_t));
+        return false;
+    }
+
+    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_UNENCODED_OFFSET, (void**)&unencoded_offset, &unencoded_offset_len)) {
+        ShowRecvError(IDS_RECV_MISSING_PARAM, funcname, L"unencoded_offset");
+        return false;
+    }
+
+    if (unencoded_offset_len < sizeof(uint64_t)) {
+        ShowRecvError(IDS_RECV_SHORT_PARAM, funcname, L"unencoded_offset", unencoded_offset_len, sizeof(uint64_t));
+        return false;
+    }
+
+    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_COMPRESSION, (void**)&compression, &compressionlen)) {
+        ShowRecvError(IDS_RECV_MISSING_PARAM, funcname, L"compression");
+        return false;
+    }
+
+    if (compressionlen < sizeof(uint32_t)) {
+        ShowRecvError(IDS_RECV_SHORT_PARAM, funcname, L"compression", compressionlen, sizeof(uint32_t));
+        return false;
+    }
+
+    if (find_tlv(data, cmd->length, BTRFS_SEND_TLV_ENCRYPTION, (void**)&encryption, &encryptionlen)) {
+        if (encryptionlen < sizeof(uint32_t)) {
+            ShowRecvError(IDS_RECV_SHORT_PARAM, funcname, L"encryption", encryptionlen, sizeof(uint32_t));
+            return false;
         }
 
-        h = CreateFileW((subvolpath + pathu).c_str(), FILE_WRITE_DATA | FILE_WRITE_ATTRIBUTES, 0, nullptr, OPEN_EXISTING,
-                        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_POSIX_SEMANTICS, nullptr);
-        if (h == INVALID_HANDLE_VALUE) {
-            ShowRecvError(IDS_RECV_CANT_OPEN_FILE, funcname, pathu.c_str(), GetLastError(), format_message(GetLastError()).c_str());
+        if (*encryption != 0) {
+            ShowRecvError(IDS_RECV_WRITE_ENCODED_FAILED, STATUS_NOT_SUPPORTED, format_ntstatus(STATUS_NOT_SUPPORTED).c_str());
             return false;
         }
+    }
 
-        lastwritepath = pathu;
-        lastwritefile = h;
+    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_DATA, (void**)&writedata, &datalen)) {
+        ShowRecvError(IDS_RECV_MISSING_PARAM, funcname, L"data");
+        return false;
+    }
 
-        memset(&fbi, 0, sizeof(FILE_BASIC_INFO));
+    if (!open_write_file(pathu, &h))
+        return false;
 
-        fbi.LastWriteTime.QuadPart = -1;
+    // the driver won't extend the file for us
+    if (!GetFileSizeEx(h, &filesize)) {
+        ShowRecvError(IDS_RECV_GETFILESIZEEX_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+        return false;
+    }
 
-        if (!SetFileInformationByHandle(h, FileBasicInfo, &fbi, sizeof(FILE_BASIC_INFO))) {
-            ShowRecvError(IDS_RECV_SETFILEINFO_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    if ((uint64_t)filesize.QuadPart < *offset + *file_len) {
+        LARGE_INTEGER sizeli;
+
+        sizeli.QuadPart = *offset + *file_len;
+
+        if (SetFilePointer(h, sizeli.LowPart, &sizeli.HighPart, FILE_BEGIN) == INVALID_SET_FILE_POINTER) {
+            ShowRecvError(IDS_RECV_SETFILEPOINTER_FAILED, GetLastError(), format_message(GetLastError()).c_str());
             return false;
         }
-    } else
-        h = lastwritefile;
 
-    offli.QuadPart = *offset;
+        if (!SetEndOfFile(h)) {
+            ShowRecvError(IDS_RECV_SETENDOFFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+            return false;
+        }
+    }
 
-    if (SetFilePointer(h, offli.LowPart, &offli.HighPart, FILE_BEGIN) == INVALID_SET_FILE_POINTER) {
-        ShowRecvError(IDS_RECV_SETFILEPOINTER_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    bwelen = offsetof(btrfs_write_encoded, data[0]) + datalen;
+    bwe = (btrfs_write_encoded*)malloc(bwelen);
+    if (!bwe) {
+        ShowRecvError(IDS_OUT_OF_MEMORY);
         return false;
     }
 
-    if (!WriteFile(h, writedata, datalen, nullptr, nullptr)) {
-        ShowRecvError(IDS_RECV_WRITEFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    bwe->offset = *offset;
+    bwe->unencoded_file_len = *file_len;
+    bwe->unencoded_len = *unencoded_len;
+    bwe->unencoded_offset = *unencoded_offset;
+    bwe->compression = *compression;
+    bwe->length = datalen;
+    memcpy(bwe->data, writedata, datalen);
+
+    Status = NtFsControlFile(h, nullptr, nullptr, nullptr, &iosb, FSCTL_BTRFS_WRITE_ENCODED, bwe, bwelen, nullptr, 0);
+
+    free(bwe);
+
+    if (!NT_SUCCESS(Status)) {
+        ShowRecvError(IDS_RECV_WRITE_ENCODED_FAILED, Status, format_ntstatus(Status).c_str());
         return false;
     }
 
@@ -1627,11 +1789,13 @@ bool BtrfsRecv::do_recv(const win_handle& f, uint64_t* pos, uint64_t size, const
         return false;
     }
 
-    if (header.version > 1) {
+    if (header.version > 2) {
         ShowRecvError(IDS_RECV_UNSUPPORTED_VERSION, header.version);
         return false;
     }
 
+    version = header.version;
+
     SendMessageW(GetDlgItem(hwnd, IDC_RECV_PROGRESS), PBM_SETRANGE32, 0, (LPARAM)65536);
 
     lastwritefile = INVALID_HANDLE_VALUE;
@@ -1700,7 +1864,7 @@ bool BtrfsRecv::do_recv(const win_handle& f, uint64_t* pos, uint64_t size, const
             break;
         }
 
-        if (lastwritefile != INVALID_HANDLE_VALUE && cmd.cmd != BTRFS_SEND_CMD_WRITE) {
+        if (lastwritefile != INVALID_HANDLE_VALUE && cmd.cmd != BTRFS_SEND_CMD_WRITE && cmd.cmd != BTRFS_SEND_CMD_ENCODED_WRITE) {
             if (lastwriteatt & FILE_ATTRIBUTE_READONLY) {
                 if (!SetFileAttributesW((subvolpath + lastwritepath).c_str(), lastwriteatt)) {
                     ShowRecvError(IDS_RECV_SETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
@@ -1761,6 +1925,10 @@ bool BtrfsRecv::do_recv(const win_handle& f, uint64_t* pos, uint64_t size, const
                 b = cmd_write(hwnd, &cmd, data);
             break;
 
+            case BTRFS_SEND_CMD_ENCODED_WRITE:
+                b = cmd_encoded_write(hwnd, &cmd, data);
+            break;
+
             case BTRFS_SEND_CMD_CLONE:
                 b = cmd_clone(hwnd, &cmd, data);
             break;
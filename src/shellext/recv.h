@@ -38,6 +38,7 @@ public:
         cancelling = false;
         stransid = 0;
         num_received = 0;
+        version = 1;
         hwnd = nullptr;
         cache.clear();
     }
@@ -61,6 +62,7 @@ private:
     bool cmd_setxattr(HWND hwnd, btrfs_send_command* cmd, uint8_t* data);
     bool cmd_removexattr(HWND hwnd, btrfs_send_command* cmd, uint8_t* data);
     bool cmd_write(HWND hwnd, btrfs_send_command* cmd, uint8_t* data);
+    bool cmd_encoded_write(HWND hwnd, btrfs_send_command* cmd, uint8_t* data);
     bool cmd_clone(HWND hwnd, btrfs_send_command* cmd, uint8_t* data);
     bool cmd_truncate(HWND hwnd, btrfs_send_command* cmd, uint8_t* data);
     bool cmd_chmod(HWND hwnd, btrfs_send_command* cmd, uint8_t* data);
@@ -70,6 +72,7 @@ private:
     bool utf8_to_utf16(HWND hwnd, const string& utf8, wstring& utf16);
     void ShowRecvError(int resid, ...);
     bool find_tlv(uint8_t* data, ULONG datalen, uint16_t type, void** value, ULONG* len);
+    bool open_write_file(const wstring& pathu, HANDLE* h);
     bool do_recv(const win_handle& f, uint64_t* pos, uint64_t size, const win_handle& parent);
 
     HANDLE dir, master, thread, lastwritefile;
@@ -77,6 +80,7 @@ private:
     wstring streamfile, dirpath, subvolpath, lastwritepath;
     DWORD lastwriteatt;
     ULONG num_received;
+    uint32_t version;
     uint64_t stransid;
     BTRFS_UUID subvol_uuid;
     bool running, cancelling;
@@ -197,6 +197,7 @@
 #define IDS_BALANCE_COMPLETE_SHRINK     279
 #define IDS_BALANCE_FAILED_SHRINK       280
 #define IDS_COMPRESS_ZSTD               281
+#define IDS_RECV_WRITE_ENCODED_FAILED   282
 #define IDC_UID                         1001
 #define IDC_GID                         1002
 #define IDC_USERR                       1003
@@ -321,6 +322,7 @@
 #define IDC_RESIZE_CURSIZE              1071
 #define IDC_RESIZE_SLIDER               1072
 #define IDC_RESIZE_NEWSIZE              1073
+#define IDC_SEND_COMPRESSED             1074
 
 // Next default values for new objects
 // 
@@ -328,7 +330,7 @@
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NEXT_RESOURCE_VALUE        174
 #define _APS_NEXT_COMMAND_VALUE         40001
-#define _APS_NEXT_CONTROL_VALUE         1073
+#define _APS_NEXT_CONTROL_VALUE         1075
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
 #endif
@@ -80,6 +80,7 @@ DWORD BtrfsSend::Thread() {
         bss->parent = nullptr;
 
     bss->num_clones = clones.size();
+    bss->flags = compressed ? BTRFS_SEND_FLAG_COMPRESSED : 0;
 
     for (i = 0; i < bss->num_clones; i++) {
         HANDLE h;
@@ -151,7 +152,7 @@ DWORD BtrfsSend::Thread() {
     }
 
     memcpy(header.magic, BTRFS_SEND_MAGIC, sizeof(header.magic));
-    header.version = 1;
+    header.version = compressed ? 2 : 1;
 
     if (!WriteFile(stream, &header, sizeof(header), nullptr, nullptr)) {
         ShowSendError(IDS_SEND_WRITEFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
@@ -254,6 +255,8 @@ void BtrfsSend::StartSend(HWND hwnd) {
     EnableWindow(GetDlgItem(hwnd, IDC_STREAM_DEST), false);
     EnableWindow(GetDlgItem(hwnd, IDC_BROWSE), false);
 
+    compressed = IsDlgButtonChecked(hwnd, IDC_SEND_COMPRESSED);
+
     clones.clear();
 
     cl = GetDlgItem(hwnd, IDC_CLONE_LIST);
@@ -567,7 +570,7 @@ void CALLBACK SendSubvolGUIW(HWND hwnd, HINSTANCE hinst, LPWSTR lpszCmdLine, int
     bs.Open(hwnd, lpszCmdLine);
 }
 
-static void send_subvol(const wstring& subvol, const wstring& file, const wstring& parent, const vector<wstring>& clones) {
+static void send_subvol(const wstring& subvol, const wstring& file, const wstring& parent, const vector<wstring>& clones, bool compressed) {
     char* buf;
     win_handle dirh, stream;
     ULONG bss_size, i;
@@ -604,6 +607,7 @@ static void send_subvol(const wstring& subvol, const wstring& file, const wstrin
         bss->parent = nullptr;
 
     bss->num_clones = clones.size();
+    bss->flags = compressed ? BTRFS_SEND_FLAG_COMPRESSED : 0;
 
     for (i = 0; i < bss->num_clones; i++) {
         HANDLE h;
@@ -635,7 +639,7 @@ static void send_subvol(const wstring& subvol, const wstring& file, const wstrin
         goto end2;
 
     memcpy(header.magic, BTRFS_SEND_MAGIC, sizeof(header.magic));
-    header.version = 1;
+    header.version = compressed ? 2 : 1;
 
     if (!WriteFile(stream, &header, sizeof(header), nullptr, nullptr))
         goto end2;
@@ -678,6 +682,7 @@ void CALLBACK SendSubvolW(HWND hwnd, HINSTANCE hinst, LPWSTR lpszCmdLine, int nC
     vector<wstring> args;
     wstring subvol = L"", parent = L"", file = L"";
     vector<wstring> clones;
+    bool compressed = false;
 
     command_line_to_args(lpszCmdLine, args);
 
@@ -703,7 +708,9 @@ void CALLBACK SendSubvolW(HWND hwnd, HINSTANCE hinst, LPWSTR lpszCmdLine, int nC
         }
 
         for (unsigned int i = 0; i < args.size(); i++) {
-            if (args[i][0] == '-') {
+            if (args[i] == L"--compressed-data")
+                compressed = true;
+            else if (args[i][0] == '-') {
                 if (args[i][2] == 0 && i < args.size() - 1) {
                     if (args[i][1] == 'p') {
                         parent = args[i+1];
@@ -722,6 +729,6 @@ void CALLBACK SendSubvolW(HWND hwnd, HINSTANCE hinst, LPWSTR lpszCmdLine, int nC
         }
 
         if (subvol != L"" && file != L"")
-            send_subvol(subvol, file, parent, clones);
+            send_subvol(subvol, file, parent, clones, compressed);
     }
 }
@@ -29,6 +29,7 @@ public:
         subvol = L"";
         buf = nullptr;
         incremental = false;
+        compressed = false;
     }
 
     ~BtrfsSend() {
@@ -50,6 +51,7 @@ private:
 
     bool started;
     bool incremental;
+    bool compressed;
     WCHAR file[MAX_PATH], closetext[255];
     HANDLE thread, dirh, stream;
     HWND hwnd;
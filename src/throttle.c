@@ -0,0 +1,183 @@
+/* Copyright (c) The WinBtrfs contributors 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// Token buckets for the background operations (scrub and balance). Each bucket holds at most
+// one second's worth of tokens; I/O is charged against it as it's issued, and the thread then
+// sleeps off any deficit at a point where it isn't holding tree_lock.
+
+#define THROTTLE_MAX_SLEEP      1000000    // 100 ms, so that pause and stop stay responsive
+#define THROTTLE_LATENCY_AGE    10000000   // ignore foreground latency samples older than a second
+#define THROTTLE_BACKOFF_MIN    10         // ms
+#define THROTTLE_BACKOFF_MAX    1000       // ms
+#define THROTTLE_MAX_BANDWIDTH  0x10000000000 // 1 TB/s, so the token arithmetic can't overflow
+
+static void refill_tokens(throttle_info* ti) {
+    LARGE_INTEGER time;
+    UINT64 elapsed;
+
+    KeQuerySystemTime(&time);
+
+    elapsed = min((UINT64)(time.QuadPart - ti->last_refill.QuadPart), 10000000);
+    ti->last_refill = time;
+
+    if (ti->limits.bandwidth != 0) {
+        ti->byte_tokens += ti->limits.bandwidth * elapsed / 10000000;
+
+        if (ti->byte_tokens > (LONG64)ti->limits.bandwidth)
+            ti->byte_tokens = ti->limits.bandwidth;
+    }
+
+    if (ti->limits.iops != 0) {
+        ti->io_tokens += ti->limits.iops * elapsed / 10000000;
+
+        if (ti->io_tokens > (LONG64)ti->limits.iops)
+            ti->io_tokens = ti->limits.iops;
+    }
+}
+
+void set_throttle(throttle_info* ti, btrfs_throttle* limits) {
+    ExAcquireResourceExclusiveLite(&ti->lock, TRUE);
+
+    if (limits)
+        RtlCopyMemory(&ti->limits, limits, sizeof(btrfs_throttle));
+    else
+        RtlZeroMemory(&ti->limits, sizeof(btrfs_throttle));
+
+    ti->limits.bandwidth = min(ti->limits.bandwidth, THROTTLE_MAX_BANDWIDTH);
+
+    KeQuerySystemTime(&ti->last_refill);
+    ti->byte_tokens = ti->limits.bandwidth;
+    ti->io_tokens = ti->limits.iops;
+    ti->backoff = 0;
+
+    ExReleaseResourceLite(&ti->lock);
+}
+
+void init_throttle(throttle_info* ti, btrfs_throttle* limits) {
+    set_throttle(ti, limits);
+
+    ti->time_throttled = 0;
+}
+
+void throttle_charge(throttle_info* ti, UINT64 bytes, ULONG ios) {
+    if (ti->limits.bandwidth == 0 && ti->limits.iops == 0)
+        return;
+
+    ExAcquireResourceExclusiveLite(&ti->lock, TRUE);
+
+    refill_tokens(ti);
+
+    if (ti->limits.bandwidth != 0)
+        ti->byte_tokens -= bytes;
+
+    if (ti->limits.iops != 0)
+        ti->io_tokens -= ios;
+
+    ExReleaseResourceLite(&ti->lock);
+}
+
+// Never sleep under tree_lock - everything else would queue up behind us.
+void throttle_wait(device_extension* Vcb, throttle_info* ti, BOOL* stopping) {
+    LARGE_INTEGER time;
+    UINT64 delay = 0;
+    UINT32 latency;
+
+    ExAcquireResourceExclusiveLite(&ti->lock, TRUE);
+
+    refill_tokens(ti);
+
+    if (ti->limits.bandwidth != 0 && ti->byte_tokens < 0)
+        delay = max(delay, (UINT64)-ti->byte_tokens * 10000000 / ti->limits.bandwidth);
+
+    if (ti->limits.iops != 0 && ti->io_tokens < 0)
+        delay = max(delay, (UINT64)-ti->io_tokens * 10000000 / ti->limits.iops);
+
+    KeQuerySystemTime(&time);
+
+    if (time.QuadPart - Vcb->fg_latency_time < THROTTLE_LATENCY_AGE)
+        latency = (UINT32)Vcb->fg_latency;
+    else
+        latency = 0;
+
+    // multiplicative backoff while foreground I/O is suffering, halving again once it recovers
+    if (ti->limits.latency_target != 0 && latency > ti->limits.latency_target)
+        ti->backoff = ti->backoff == 0 ? THROTTLE_BACKOFF_MIN : min(ti->backoff * 2, THROTTLE_BACKOFF_MAX);
+    else
+        ti->backoff /= 2;
+
+    delay += (UINT64)ti->backoff * 10000;
+
+    ti->time_throttled += delay;
+
+    ExReleaseResourceLite(&ti->lock);
+
+    while (delay > 0 && !*stopping) {
+        LARGE_INTEGER timeout;
+
+        timeout.QuadPart = -(LONGLONG)min(delay, THROTTLE_MAX_SLEEP);
+        KeDelayExecutionThread(KernelMode, FALSE, &timeout);
+
+        delay -= min(delay, THROTTLE_MAX_SLEEP);
+    }
+}
+
+// How much to do under one acquisition of tree_lock - a tenth of a second's worth, so that
+// the throttled operation doesn't hold the lock for a long burst and then sleep.
+UINT64 throttle_batch_size(throttle_info* ti, UINT64 def) {
+    if (ti->limits.bandwidth == 0)
+        return def;
+
+    return max(min(def, ti->limits.bandwidth / 10), 0x100000);
+}
+
+void get_throttle_state(device_extension* Vcb, throttle_info* ti, btrfs_throttle_state* state) {
+    LARGE_INTEGER time;
+
+    ExAcquireResourceSharedLite(&ti->lock, TRUE);
+
+    RtlCopyMemory(&state->limits, &ti->limits, sizeof(btrfs_throttle));
+    state->backing_off = ti->backoff != 0;
+    state->time_throttled = ti->time_throttled;
+
+    ExReleaseResourceLite(&ti->lock);
+
+    KeQuerySystemTime(&time);
+
+    state->foreground_latency = time.QuadPart - Vcb->fg_latency_time < THROTTLE_LATENCY_AGE ? (UINT32)Vcb->fg_latency : 0;
+}
+
+// Called from the read and write completion routines, so may be at DISPATCH_LEVEL.
+void record_fg_latency(device_extension* Vcb, LARGE_INTEGER start) {
+    LARGE_INTEGER now, freq, time;
+    LONG sample, old;
+
+    now = KeQueryPerformanceCounter(&freq);
+
+    if (freq.QuadPart == 0)
+        return;
+
+    sample = (LONG)min((now.QuadPart - start.QuadPart) * 1000000 / freq.QuadPart, MAXLONG);
+
+    // exponentially-weighted moving average, weight 1/8 - races just lose a sample
+    old = Vcb->fg_latency;
+    InterlockedExchange(&Vcb->fg_latency, old - (old / 8) + (sample / 8));
+
+    KeQuerySystemTime(&time);
+    InterlockedExchange64(&Vcb->fg_latency_time, time.QuadPart);
+}
@@ -17,30 +17,248 @@
 
 #include "btrfs_drv.h"
 
-NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT64 generation, PIRP Irp) {
+_Function_class_(WORKER_THREAD_ROUTINE)
+static void tree_readahead_thread(void* context) {
+    tree_readahead* tr = context;
+    device_extension* Vcb = tr->Vcb;
+    NTSTATUS Status;
+
+    // Readahead is only opportunistic - if somebody has the tree lock exclusively, we give up rather than wait.
+
+    if (ExAcquireResourceSharedLite(&Vcb->tree_lock, FALSE)) {
+        Status = read_data(Vcb, tr->address, Vcb->superblock.node_size, NULL, TRUE, tr->buf, NULL, NULL, NULL, tr->generation, FALSE, NormalPagePriority);
+        ExReleaseResourceLite(&Vcb->tree_lock);
+    } else
+        Status = STATUS_DEVICE_BUSY;
+
+    ExAcquireResourceExclusiveLite(&Vcb->tree_readahead_lock, TRUE);
+
+    if (!NT_SUCCESS(Status)) {
+        ExFreePool(tr->buf);
+        tr->buf = NULL;
+    }
+
+    tr->Status = Status;
+    tr->done = TRUE;
+
+    // nobody wants a failed read, and an abandoned one has already been loaded synchronously
+    if (tr->abandoned || !tr->buf) {
+        if (!tr->abandoned) {
+            RemoveEntryList(&tr->list_entry);
+            Vcb->num_tree_readaheads--;
+        }
+
+        if (tr->buf)
+            ExFreePool(tr->buf);
+
+        ExFreePool(tr);
+    }
+
+    Vcb->tree_readaheads_pending--;
+
+    if (Vcb->tree_readaheads_pending == 0)
+        KeSetEvent(&Vcb->tree_readaheads_finished, 0, FALSE);
+
+    ExReleaseResourceLite(&Vcb->tree_readahead_lock);
+}
+
+static void add_tree_readahead(device_extension* Vcb, UINT64 address, UINT64 generation) {
+    LIST_ENTRY* le;
+    tree_readahead* tr;
+
+    ExAcquireResourceExclusiveLite(&Vcb->tree_readahead_lock, TRUE);
+
+    le = Vcb->tree_readaheads.Flink;
+    while (le != &Vcb->tree_readaheads) {
+        tr = CONTAINING_RECORD(le, tree_readahead, list_entry);
+
+        if (tr->address == address)
+            goto end;
+
+        le = le->Flink;
+    }
+
+    // if we're full, make room by throwing away the oldest node that's been read but not used
+    if (Vcb->num_tree_readaheads >= TREE_READAHEAD_MAX) {
+        le = Vcb->tree_readaheads.Flink;
+        while (le != &Vcb->tree_readaheads) {
+            tr = CONTAINING_RECORD(le, tree_readahead, list_entry);
+
+            if (tr->done) {
+                RemoveEntryList(&tr->list_entry);
+                Vcb->num_tree_readaheads--;
+
+                if (tr->buf)
+                    ExFreePool(tr->buf);
+
+                ExFreePool(tr);
+                break;
+            }
+
+            le = le->Flink;
+        }
+
+        if (Vcb->num_tree_readaheads >= TREE_READAHEAD_MAX)
+            goto end;
+    }
+
+    tr = ExAllocatePoolWithTag(NonPagedPool, sizeof(tree_readahead), ALLOC_TAG);
+    if (!tr) {
+        ERR("out of memory\n");
+        goto end;
+    }
+
+    tr->buf = ExAllocatePoolWithTag(PagedPool, Vcb->superblock.node_size, ALLOC_TAG);
+    if (!tr->buf) {
+        ERR("out of memory\n");
+        ExFreePool(tr);
+        goto end;
+    }
+
+    tr->address = address;
+    tr->generation = generation;
+    tr->Status = STATUS_PENDING;
+    tr->done = FALSE;
+    tr->abandoned = FALSE;
+    tr->Vcb = Vcb;
+
+    InsertTailList(&Vcb->tree_readaheads, &tr->list_entry);
+    Vcb->num_tree_readaheads++;
+
+    if (Vcb->tree_readaheads_pending == 0)
+        KeClearEvent(&Vcb->tree_readaheads_finished);
+
+    Vcb->tree_readaheads_pending++;
+
+#ifdef DEBUG_STATS
+    Vcb->stats.tree_readaheads++;
+#endif
+
+    ExInitializeWorkItem(&tr->item, tree_readahead_thread, tr);
+    ExQueueWorkItem(&tr->item, DelayedWorkQueue);
+
+end:
+    ExReleaseResourceLite(&Vcb->tree_readahead_lock);
+}
+
+// Returns the buffer from a completed readahead of this node, if there is one. If the read
+// is still in flight we don't wait for it, as its thread might need the tree lock we're holding -
+// instead we mark it as abandoned, so that it frees itself rather than taking up a slot.
+static UINT8* get_tree_readahead(device_extension* Vcb, UINT64 address, UINT64 generation) {
+    LIST_ENTRY* le;
+    UINT8* buf = NULL;
+
+    ExAcquireResourceExclusiveLite(&Vcb->tree_readahead_lock, TRUE);
+
+    le = Vcb->tree_readaheads.Flink;
+    while (le != &Vcb->tree_readaheads) {
+        tree_readahead* tr = CONTAINING_RECORD(le, tree_readahead, list_entry);
+
+        if (tr->address == address) {
+            if (tr->done) {
+                RemoveEntryList(&tr->list_entry);
+                Vcb->num_tree_readaheads--;
+
+                if (tr->buf) {
+                    if (tr->generation == generation)
+                        buf = tr->buf;
+                    else
+                        ExFreePool(tr->buf);
+                }
+
+                ExFreePool(tr);
+            } else {
+                RemoveEntryList(&tr->list_entry);
+                Vcb->num_tree_readaheads--;
+
+                tr->abandoned = TRUE;
+            }
+
+            break;
+        }
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->tree_readahead_lock);
+
+    return buf;
+}
+
+void free_tree_readaheads(device_extension* Vcb, BOOL wait) {
+    LIST_ENTRY* le;
+
+    if (wait)
+        KeWaitForSingleObject(&Vcb->tree_readaheads_finished, Executive, KernelMode, FALSE, NULL);
+
+    ExAcquireResourceExclusiveLite(&Vcb->tree_readahead_lock, TRUE);
+
+    le = Vcb->tree_readaheads.Flink;
+    while (le != &Vcb->tree_readaheads) {
+        LIST_ENTRY* le2 = le->Flink;
+        tree_readahead* tr = CONTAINING_RECORD(le, tree_readahead, list_entry);
+
+        if (tr->done) {
+            RemoveEntryList(&tr->list_entry);
+            Vcb->num_tree_readaheads--;
+
+            if (tr->buf)
+                ExFreePool(tr->buf);
+
+            ExFreePool(tr);
+        }
+
+        le = le2;
+    }
+
+    ExReleaseResourceLite(&Vcb->tree_readahead_lock);
+}
+
+static NTSTATUS read_tree_node(device_extension* Vcb, UINT64 addr, UINT64 generation, UINT8** pbuf, PIRP Irp) {
     UINT8* buf;
     NTSTATUS Status;
+    chunk* c;
+
+#ifdef DEBUG_STATS
+    Vcb->stats.tree_loads++;
+#endif
+
+    buf = get_tree_readahead(Vcb, addr, generation);
+
+    if (buf) {
+#ifdef DEBUG_STATS
+        Vcb->stats.tree_readahead_hits++;
+#endif
+    } else {
+        buf = ExAllocatePoolWithTag(PagedPool, Vcb->superblock.node_size, ALLOC_TAG);
+        if (!buf) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        Status = read_data(Vcb, addr, Vcb->superblock.node_size, NULL, TRUE, buf, NULL, &c, Irp, generation, FALSE, NormalPagePriority);
+        if (!NT_SUCCESS(Status)) {
+            ERR("read_data returned 0x%08x\n", Status);
+            ExFreePool(buf);
+            return Status;
+        }
+    }
+
+    *pbuf = buf;
+
+    return STATUS_SUCCESS;
+}
+
+// takes ownership of buf, whether or not it succeeds
+static NTSTATUS parse_tree(device_extension* Vcb, UINT64 addr, root* r, UINT8* buf, tree** pt) {
     tree_header* th;
     tree* t;
     tree_data* td;
-    chunk* c;
+    tree_data_array* tda;
     UINT8 h;
     BOOL inserted;
     LIST_ENTRY* le;
 
-    buf = ExAllocatePoolWithTag(PagedPool, Vcb->superblock.node_size, ALLOC_TAG);
-    if (!buf) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    Status = read_data(Vcb, addr, Vcb->superblock.node_size, NULL, TRUE, buf, NULL, &c, Irp, generation, FALSE, NormalPagePriority);
-    if (!NT_SUCCESS(Status)) {
-        ERR("read_data returned 0x%08x\n", Status);
-        ExFreePool(buf);
-        return Status;
-    }
-
     th = (tree_header*)buf;
 
     t = ExAllocatePoolWithTag(PagedPool, sizeof(tree), ALLOC_TAG);
@@ -63,28 +281,41 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
     t->updated_extents = FALSE;
     t->write = FALSE;
     t->uniqueness_determined = FALSE;
+    t->item_array = NULL;
 
     InitializeListHead(&t->itemlist);
 
+    // Rather than going to the lookaside list once per item, we allocate all the tree_datas for the
+    // node together. While the tree is unmodified, this also gives find_item_in_tree a sorted array to search.
+
+    if (t->header.num_items > 0) {
+        tda = ExAllocatePoolWithTag(PagedPool, offsetof(tree_data_array, items[0]) + (t->header.num_items * sizeof(tree_data)), ALLOC_TAG);
+        if (!tda) {
+            ERR("out of memory\n");
+            ExFreePool(t);
+            ExFreePool(buf);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        tda->refcount = t->header.num_items;
+        tda->num_items = t->header.num_items;
+    } else
+        tda = NULL;
+
     if (t->header.level == 0) { // leaf node
         leaf_node* ln = (leaf_node*)(buf + sizeof(tree_header));
         unsigned int i;
 
         if ((t->header.num_items * sizeof(leaf_node)) + sizeof(tree_header) > Vcb->superblock.node_size) {
             ERR("tree at %llx has more items than expected (%x)\n", t->header.num_items);
+            if (tda) ExFreePool(tda);
             ExFreePool(t);
             ExFreePool(buf);
             return STATUS_INSUFFICIENT_RESOURCES;
         }
 
         for (i = 0; i < t->header.num_items; i++) {
-            td = ExAllocateFromPagedLookasideList(&Vcb->tree_data_lookaside);
-            if (!td) {
-                ERR("out of memory\n");
-                ExFreePool(t);
-                ExFreePool(buf);
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
+            td = &tda->items[i];
 
             td->key = ln[i].key;
 
@@ -95,7 +326,7 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
 
             if (ln[i].size + sizeof(tree_header) + sizeof(leaf_node) > Vcb->superblock.node_size) {
                 ERR("overlarge item in tree %llx: %u > %u\n", addr, ln[i].size, Vcb->superblock.node_size - sizeof(tree_header) - sizeof(leaf_node));
-                ExFreeToPagedLookasideList(&t->Vcb->tree_data_lookaside, td);
+                ExFreePool(tda);
                 ExFreePool(t);
                 ExFreePool(buf);
                 return STATUS_INTERNAL_ERROR;
@@ -104,6 +335,7 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
             td->size = (UINT16)ln[i].size;
             td->ignore = FALSE;
             td->inserted = FALSE;
+            td->array = tda;
 
             InsertTailList(&t->itemlist, &td->list_entry);
 
@@ -118,19 +350,14 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
 
         if ((t->header.num_items * sizeof(internal_node)) + sizeof(tree_header) > Vcb->superblock.node_size) {
             ERR("tree at %llx has more items than expected (%x)\n", t->header.num_items);
+            if (tda) ExFreePool(tda);
             ExFreePool(t);
             ExFreePool(buf);
             return STATUS_INSUFFICIENT_RESOURCES;
         }
 
         for (i = 0; i < t->header.num_items; i++) {
-            td = ExAllocateFromPagedLookasideList(&Vcb->tree_data_lookaside);
-            if (!td) {
-                ERR("out of memory\n");
-                ExFreePool(t);
-                ExFreePool(buf);
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
+            td = &tda->items[i];
 
             td->key = in[i].key;
 
@@ -139,6 +366,7 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
             td->treeholder.tree = NULL;
             td->ignore = FALSE;
             td->inserted = FALSE;
+            td->array = tda;
 
             InsertTailList(&t->itemlist, &td->list_entry);
         }
@@ -148,6 +376,11 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
         ExFreePool(buf);
     }
 
+    t->item_array = tda;
+
+    // We may be loading trees for other roots at the same time, so the lists common to all roots need their own lock
+    ExAcquireResourceExclusiveLite(&Vcb->trees_lock, TRUE);
+
     InsertTailList(&Vcb->trees, &t->list_entry);
 
     h = t->hash >> 24;
@@ -190,6 +423,8 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
     if (!Vcb->trees_ptrs[h] || t->list_entry_hash.Flink == Vcb->trees_ptrs[h])
         Vcb->trees_ptrs[h] = &t->list_entry_hash;
 
+    ExReleaseResourceLite(&Vcb->trees_lock);
+
     TRACE("returning %p\n", t);
 
     *pt = t;
@@ -197,6 +432,27 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
     return STATUS_SUCCESS;
 }
 
+NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT64 generation, PIRP Irp) {
+    NTSTATUS Status;
+    UINT8* buf;
+
+    Status = read_tree_node(Vcb, addr, generation, &buf, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("read_tree_node returned %08x\n", Status);
+        return Status;
+    }
+
+    return parse_tree(Vcb, addr, r, buf, pt);
+}
+
+void free_tree_data(device_extension* Vcb, tree_data* td) {
+    if (td->array) {
+        if (InterlockedDecrement(&td->array->refcount) == 0)
+            ExFreePool(td->array);
+    } else
+        ExFreeToPagedLookasideList(&Vcb->tree_data_lookaside, td);
+}
+
 static tree* free_tree2(tree* t) {
     tree* par;
     root* r = t->root;
@@ -217,9 +473,11 @@ static tree* free_tree2(tree* t) {
         if (t->header.level == 0 && td->data && td->inserted)
             ExFreePool(td->data);
 
-        ExFreeToPagedLookasideList(&t->Vcb->tree_data_lookaside, td);
+        free_tree_data(t->Vcb, td);
     }
 
+    ExAcquireResourceExclusiveLite(&t->Vcb->trees_lock, TRUE);
+
     RemoveEntryList(&t->list_entry);
 
     if (r)
@@ -242,6 +500,8 @@ static tree* free_tree2(tree* t) {
         RemoveEntryList(&t->list_entry_hash);
     }
 
+    ExReleaseResourceLite(&t->Vcb->trees_lock);
+
     if (t->buf)
         ExFreePool(t->buf);
 
@@ -258,10 +518,31 @@ NTSTATUS do_load_tree(device_extension* Vcb, tree_holder* th, root* r, tree* t,
     if (!th->tree) {
         NTSTATUS Status;
         tree* nt;
+        UINT8* buf;
+
+        // Don't hold the root's lock while we're waiting for the disk, so that other
+        // threads can load different parts of the same tree in the meantime.
+
+        ExReleaseResourceLite(&r->nonpaged->load_tree_lock);
+
+        Status = read_tree_node(Vcb, th->address, th->generation, &buf, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("read_tree_node returned %08x\n", Status);
+            return Status;
+        }
+
+        ExAcquireResourceExclusiveLite(&r->nonpaged->load_tree_lock, TRUE);
 
-        Status = load_tree(Vcb, th->address, r, &nt, th->generation, Irp);
+        if (th->tree) { // somebody else got there first
+            ExFreePool(buf);
+            ExReleaseResourceLite(&r->nonpaged->load_tree_lock);
+            *loaded = FALSE;
+            return STATUS_SUCCESS;
+        }
+
+        Status = parse_tree(Vcb, th->address, r, buf, &nt);
         if (!NT_SUCCESS(Status)) {
-            ERR("load_tree returned %08x\n", Status);
+            ERR("parse_tree returned %08x\n", Status);
             ExReleaseResourceLite(&r->nonpaged->load_tree_lock);
             return Status;
         }
@@ -327,31 +608,78 @@ static __inline tree_data* next_item(tree* t, tree_data* td) {
     return CONTAINING_RECORD(le, tree_data, list_entry);
 }
 
-static NTSTATUS next_item2(device_extension* Vcb, tree* t, tree_data* td, traverse_ptr* tp) {
-    tree_data* td2 = next_item(t, td);
-    tree* t2;
+// issue reads for the next few children of internal node t after td, so that a sequential scan isn't waiting on each one in turn
+static void readahead_children(device_extension* Vcb, tree* t, tree_data* td) {
+    ULONG num = 0;
 
-    if (td2) {
-        tp->tree = t;
-        tp->item = td2;
-        return STATUS_SUCCESS;
+    td = next_item(t, td);
+
+    while (td && num < TREE_READAHEAD_NODES) {
+        if (!td->ignore && !td->treeholder.tree && td->treeholder.address != 0)
+            add_tree_readahead(Vcb, td->treeholder.address, td->treeholder.generation);
+
+        num++;
+        td = next_item(t, td);
     }
+}
 
-    t2 = t;
+// Moves a diff cursor on to the next item at its level, going up a level whenever it runs off
+// the end of a node. Returns FALSE once there's nothing left in the tree.
+static BOOL diff_next(tree** t, tree_data** td) {
+    tree_data* td2 = next_item(*t, *td);
 
-    do {
-        td2 = t2->paritem;
-        t2 = t2->parent;
-    } while (td2 && !next_item(t2, td2));
+    while (TRUE) {
+        while (td2 && td2->ignore)
+            td2 = next_item(*t, td2);
+
+        if (td2) {
+            *td = td2;
+            return TRUE;
+        }
+
+        if (!(*t)->parent)
+            return FALSE;
+
+        td2 = next_item((*t)->parent, (*t)->paritem);
+        *t = (*t)->parent;
+    }
+}
+
+// Moves a diff cursor down into the child its item points to - the only place we load anything.
+static NTSTATUS diff_descend(device_extension* Vcb, tree** t, tree_data** td, BOOL* ended) {
+    NTSTATUS Status;
+    tree_data* td2;
+
+    if (!(*td)->treeholder.tree) {
+        BOOL loaded;
+
+        Status = do_load_tree(Vcb, &(*td)->treeholder, (*t)->root, *t, *td, &loaded, NULL);
+        if (!NT_SUCCESS(Status)) {
+            ERR("do_load_tree returned %08x\n", Status);
+            return Status;
+        }
+    }
+
+    *t = (*td)->treeholder.tree;
 
-    if (!td2)
-        return STATUS_NOT_FOUND;
+    td2 = first_item(*t);
+    if (!td2) {
+        ERR("tree %llx was empty\n", (*t)->header.address);
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    *td = td2;
 
-    td2 = next_item(t2, td2);
+    if (td2->ignore && !diff_next(t, td))
+        *ended = TRUE;
 
-    return find_item_to_level(Vcb, t2->root, tp, &td2->key, FALSE, t->header.level, NULL);
+    return STATUS_SUCCESS;
 }
 
+// Called when tp and tp2 are in the same leaf. Moves both on to the first point where the trees
+// might differ, working from the paths we already have rather than searching again from the root.
+// Pointers in the internal nodes are compared before anything is loaded, so shared subtrees are
+// skipped without being read, and we only descend into children that differ.
 NTSTATUS skip_to_difference(device_extension* Vcb, traverse_ptr* tp, traverse_ptr* tp2, BOOL* ended1, BOOL* ended2) {
     NTSTATUS Status;
     tree *t1, *t2;
@@ -367,64 +695,102 @@ NTSTATUS skip_to_difference(device_extension* Vcb, traverse_ptr* tp, traverse_pt
         t2 = t2->parent;
     } while (t1 && t2 && t1->header.address == t2->header.address);
 
-    while (TRUE) {
-        traverse_ptr tp3, tp4;
+    // everything under td1 and td2 is shared
+    if (!t1 || !diff_next(&t1, &td1))
+        *ended1 = TRUE;
 
-        Status = next_item2(Vcb, t1, td1, &tp3);
-        if (Status == STATUS_NOT_FOUND)
-            *ended1 = TRUE;
-        else if (!NT_SUCCESS(Status)) {
-            ERR("next_item2 returned %08x\n", Status);
-            return Status;
-        }
+    if (!t2 || !diff_next(&t2, &td2))
+        *ended2 = TRUE;
 
-        Status = next_item2(Vcb, t2, td2, &tp4);
-        if (Status == STATUS_NOT_FOUND)
-            *ended2 = TRUE;
-        else if (!NT_SUCCESS(Status)) {
-            ERR("next_item2 returned %08x\n", Status);
-            return Status;
-        }
+    while (!*ended1 && !*ended2) {
+        if (t1->header.level == 0 && t2->header.level == 0)
+            break;
 
-        if (*ended1 || *ended2) {
-            if (!*ended1) {
-                Status = find_item(Vcb, t1->root, tp, &tp3.item->key, FALSE, NULL);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("find_item returned %08x\n", Status);
-                    return Status;
-                }
-            } else if (!*ended2) {
-                Status = find_item(Vcb, t2->root, tp2, &tp4.item->key, FALSE, NULL);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("find_item returned %08x\n", Status);
-                    return Status;
-                }
+        if (t1->header.level > t2->header.level) {
+            Status = diff_descend(Vcb, &t1, &td1, ended1);
+            if (!NT_SUCCESS(Status)) {
+                ERR("diff_descend returned %08x\n", Status);
+                return Status;
             }
+        } else if (t2->header.level > t1->header.level) {
+            Status = diff_descend(Vcb, &t2, &td2, ended2);
+            if (!NT_SUCCESS(Status)) {
+                ERR("diff_descend returned %08x\n", Status);
+                return Status;
+            }
+        } else if (td1->treeholder.address == td2->treeholder.address && td1->treeholder.generation == td2->treeholder.generation) {
+            if (!diff_next(&t1, &td1))
+                *ended1 = TRUE;
 
-            return STATUS_SUCCESS;
-        }
-
-        if (tp3.tree->header.address != tp4.tree->header.address) {
-            Status = find_item(Vcb, t1->root, tp, &tp3.item->key, FALSE, NULL);
+            if (!diff_next(&t2, &td2))
+                *ended2 = TRUE;
+        } else {
+            Status = diff_descend(Vcb, &t1, &td1, ended1);
             if (!NT_SUCCESS(Status)) {
-                ERR("find_item returned %08x\n", Status);
+                ERR("diff_descend returned %08x\n", Status);
                 return Status;
             }
 
-            Status = find_item(Vcb, t2->root, tp2, &tp4.item->key, FALSE, NULL);
+            Status = diff_descend(Vcb, &t2, &td2, ended2);
             if (!NT_SUCCESS(Status)) {
-                ERR("find_item returned %08x\n", Status);
+                ERR("diff_descend returned %08x\n", Status);
                 return Status;
             }
+        }
+    }
 
-            return STATUS_SUCCESS;
+    // if one side has run out, the caller walks the rest of the other item by item
+
+    while (!*ended1 && t1->header.level > 0) {
+        Status = diff_descend(Vcb, &t1, &td1, ended1);
+        if (!NT_SUCCESS(Status)) {
+            ERR("diff_descend returned %08x\n", Status);
+            return Status;
+        }
+    }
+
+    while (!*ended2 && t2->header.level > 0) {
+        Status = diff_descend(Vcb, &t2, &td2, ended2);
+        if (!NT_SUCCESS(Status)) {
+            ERR("diff_descend returned %08x\n", Status);
+            return Status;
         }
+    }
+
+    if (!*ended1) {
+        tp->tree = t1;
+        tp->item = td1;
+    }
 
-        t1 = tp3.tree;
-        td1 = tp3.item;
-        t2 = tp4.tree;
-        td2 = tp4.item;
+    if (!*ended2) {
+        tp2->tree = t2;
+        tp2->item = td2;
     }
+
+    return STATUS_SUCCESS;
+}
+
+// If the tree hasn't been changed since it was loaded, its items are still in the same order as
+// the array they were allocated in, so we can do a binary search rather than walking the list.
+static tree_data* find_item_in_array(tree_data_array* tda, const KEY* searchkey) {
+    ULONG start = 0, end = tda->num_items;
+    KEY key2 = *searchkey;
+
+    // find first item not less than searchkey
+
+    while (start < end) {
+        ULONG mid = start + ((end - start) / 2);
+
+        if (keycmp(tda->items[mid].key, key2) == -1)
+            start = mid + 1;
+        else
+            end = mid;
+    }
+
+    if (start < tda->num_items && !keycmp(tda->items[start].key, key2))
+        return &tda->items[start];
+
+    return start > 0 ? &tda->items[start - 1] : &tda->items[0];
 }
 
 static NTSTATUS find_item_in_tree(device_extension* Vcb, tree* t, traverse_ptr* tp, const KEY* searchkey, BOOL ignore, UINT8 level, PIRP Irp) {
@@ -432,6 +798,11 @@ static NTSTATUS find_item_in_tree(device_extension* Vcb, tree* t, traverse_ptr*
     tree_data *td, *lasttd;
     KEY key2;
 
+    if (t->item_array && !t->write) {
+        td = find_item_in_array(t->item_array, searchkey);
+        goto found;
+    }
+
     cmp = 1;
     td = first_item(t);
     lasttd = NULL;
@@ -469,6 +840,7 @@ static NTSTATUS find_item_in_tree(device_extension* Vcb, tree* t, traverse_ptr*
     if ((cmp == -1 || !td) && lasttd)
         td = lasttd;
 
+found:
     if (t->header.level == 0) {
         if (td->ignore && !ignore) {
             traverse_ptr oldtp;
@@ -623,6 +995,8 @@ BOOL find_next_item(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vc
     if (!t)
         return FALSE;
 
+    readahead_children(Vcb, t->parent, td);
+
     Status = do_load_tree(Vcb, &td->treeholder, t->parent->root, t->parent, td, &loaded, Irp);
     if (!NT_SUCCESS(Status)) {
         ERR("do_load_tree returned %08x\n", Status);
@@ -636,6 +1010,9 @@ BOOL find_next_item(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vc
 
         fi = first_item(t);
 
+        if (loaded)
+            readahead_children(Vcb, t, fi);
+
         Status = do_load_tree(Vcb, &fi->treeholder, t->parent->root, t, fi, &loaded, Irp);
         if (!NT_SUCCESS(Status)) {
             ERR("do_load_tree returned %08x\n", Status);
@@ -778,6 +1155,8 @@ void free_trees(device_extension* Vcb) {
     LIST_ENTRY* le;
     ULONG level;
 
+    free_tree_readaheads(Vcb, FALSE);
+
     for (level = 0; level <= 255; level++) {
         BOOL empty = TRUE;
 
@@ -911,6 +1290,7 @@ NTSTATUS insert_tree_item(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock)
     td->data = data;
     td->ignore = FALSE;
     td->inserted = TRUE;
+    td->array = NULL;
 
 #ifdef _DEBUG
     le = tp.tree->itemlist.Flink;
@@ -1524,6 +1904,7 @@ static NTSTATUS handle_batch_collision(device_extension* Vcb, batch_item* bi, tr
                                 td2->data = newdi;
                                 td2->ignore = FALSE;
                                 td2->inserted = TRUE;
+                                td2->array = NULL;
 
                                 InsertHeadList(td->list_entry.Blink, &td2->list_entry);
 
@@ -1611,6 +1992,7 @@ static NTSTATUS handle_batch_collision(device_extension* Vcb, batch_item* bi, tr
                                 td2->data = newir;
                                 td2->ignore = FALSE;
                                 td2->inserted = TRUE;
+                                td2->array = NULL;
 
                                 InsertHeadList(td->list_entry.Blink, &td2->list_entry);
 
@@ -1705,6 +2087,7 @@ static NTSTATUS handle_batch_collision(device_extension* Vcb, batch_item* bi, tr
                                 td2->data = newier;
                                 td2->ignore = FALSE;
                                 td2->inserted = TRUE;
+                                td2->array = NULL;
 
                                 InsertHeadList(td->list_entry.Blink, &td2->list_entry);
 
@@ -1776,6 +2159,7 @@ static NTSTATUS handle_batch_collision(device_extension* Vcb, batch_item* bi, tr
                                 td2->data = newdi;
                                 td2->ignore = FALSE;
                                 td2->inserted = TRUE;
+                                td2->array = NULL;
 
                                 InsertHeadList(td->list_entry.Blink, &td2->list_entry);
 
@@ -1831,12 +2215,87 @@ static NTSTATUS handle_batch_collision(device_extension* Vcb, batch_item* bi, tr
     return STATUS_SUCCESS;
 }
 
+static __inline int batch_item_cmp(batch_item* bi1, batch_item* bi2) {
+    int cmp = keycmp(bi1->key, bi2->key);
+
+    if (cmp != 0)
+        return cmp;
+
+    if (bi1->operation < bi2->operation)
+        return -1;
+    else if (bi1->operation > bi2->operation)
+        return 1;
+
+    return 0;
+}
+
+// stable merge sort, so items with the same key and operation stay in the order they were queued
+static void sort_batch_items(LIST_ENTRY* items, ULONG num_items) {
+    LIST_ENTRY second, *le;
+    ULONG half = num_items / 2, i;
+
+    if (num_items < 2)
+        return;
+
+    le = items->Flink;
+    for (i = 0; i < half; i++) {
+        le = le->Flink;
+    }
+
+    // split off second half
+
+    second.Flink = le;
+    second.Blink = items->Blink;
+    items->Blink = le->Blink;
+    items->Blink->Flink = items;
+    le->Blink = &second;
+    second.Blink->Flink = &second;
+
+    sort_batch_items(items, half);
+    sort_batch_items(&second, num_items - half);
+
+    // merge back in
+
+    le = items->Flink;
+    while (!IsListEmpty(&second)) {
+        batch_item* bi2 = CONTAINING_RECORD(second.Flink, batch_item, list_entry);
+
+        while (le != items && batch_item_cmp(CONTAINING_RECORD(le, batch_item, list_entry), bi2) <= 0) {
+            le = le->Flink;
+        }
+
+        if (le == items) { // rest of second list goes on the end
+            second.Flink->Blink = items->Blink;
+            items->Blink->Flink = second.Flink;
+            second.Blink->Flink = items;
+            items->Blink = second.Blink;
+            break;
+        }
+
+        RemoveEntryList(&bi2->list_entry);
+        InsertHeadList(le->Blink, &bi2->list_entry);
+    }
+}
+
 static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, batch_root* br, PIRP Irp) {
     LIST_ENTRY* le;
     NTSTATUS Status;
 
     TRACE("root: %llx\n", br->r->id);
 
+    if (br->unsorted) {
+        ULONG num_items = 0;
+
+        le = br->items.Flink;
+        while (le != &br->items) {
+            num_items++;
+            le = le->Flink;
+        }
+
+        sort_batch_items(&br->items, num_items);
+        br->unsorted = FALSE;
+    }
+
     le = br->items.Flink;
     while (le != &br->items) {
         batch_item* bi = CONTAINING_RECORD(le, batch_item, list_entry);
@@ -2072,6 +2531,7 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                 td->data = bi->data;
                 td->ignore = FALSE;
                 td->inserted = TRUE;
+                td->array = NULL;
             }
 
             cmp = keycmp(bi->key, tp.item->key);
@@ -2102,7 +2562,7 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                         ERR("handle_batch_collision returned %08x\n", Status);
 
                         if (td)
-                            ExFreeToPagedLookasideList(&Vcb->tree_data_lookaside, td);
+                            free_tree_data(Vcb, td);
 
                         return Status;
                     }
@@ -2161,6 +2621,7 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                         td->data = bi2->data;
                         td->ignore = FALSE;
                         td->inserted = TRUE;
+                        td->array = NULL;
                     }
 
                     le3 = &listhead->list_entry;
@@ -2207,6 +2668,7 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                         if (!ignore) {
                             tp.tree->header.num_items++;
                             tp.tree->size += bi2->datalen + sizeof(leaf_node);
+                            tp.tree->write = TRUE;
 
                             listhead = td;
                         }
@@ -1884,6 +1884,8 @@ NTSTATUS write_data(_In_ device_extension* Vcb, _In_ UINT64 address, _In_reads_b
 
     TRACE("(%p, %llx, %p, %x)\n", Vcb, address, data, length);
 
+    invalidate_decomp_cache(Vcb, address, length);
+
     if (!c) {
         c = get_chunk_from_address(Vcb, address);
         if (!c) {
@@ -2020,6 +2022,12 @@ NTSTATUS write_data(_In_ device_extension* Vcb, _In_ UINT64 address, _In_reads_b
             RtlZeroMemory(&stripe->iosb, sizeof(IO_STATUS_BLOCK));
             stripe->status = WriteDataStatus_Pending;
             stripe->mdl = stripes[i].mdl;
+            stripe->Vcb = Vcb;
+
+            if (Irp)
+                stripe->start_time = KeQueryPerformanceCounter(NULL);
+            else
+                stripe->start_time.QuadPart = 0;
 
             if (!Irp) {
                 stripe->Irp = IoAllocateIrp(stripe->device->devobj->StackSize, FALSE);
@@ -2256,6 +2264,9 @@ static NTSTATUS write_data_completion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVO
 
     stripe->iosb = Irp->IoStatus;
 
+    if (stripe->start_time.QuadPart != 0)
+        record_fg_latency(stripe->Vcb, stripe->start_time);
+
     if (NT_SUCCESS(Irp->IoStatus.Status)) {
         stripe->status = WriteDataStatus_Success;
     } else {
@@ -4086,44 +4097,95 @@ nextitem:
 
 NTSTATUS write_compressed(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
-    UINT64 i;
+    device_extension* Vcb = fcb->Vcb;
+    UINT64 i, num_parts, submitted = 0, window;
+    UINT8 type;
+    calc_job** parts;
+
+    num_parts = sector_align(end_data - start_data, COMPRESSED_EXTENT_SIZE) / COMPRESSED_EXTENT_SIZE;
+
+    // Not worth the context switch if there's only one extent to compress. Otherwise we hand the
+    // compression to the calc threads, a couple of extents per thread ahead of the one we're waiting
+    // for, and do the allocation and extent insertion here in order.
+    window = num_parts > 1 && Vcb->calcthreads.num_threads > 1 ? (Vcb->calcthreads.num_threads * 2) : 0;
+
+    parts = ExAllocatePoolWithTag(PagedPool, (ULONG)(sizeof(calc_job*) * num_parts), ALLOC_TAG);
+    if (!parts) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(parts, (ULONG)(sizeof(calc_job*) * num_parts));
 
-    for (i = 0; i < sector_align(end_data - start_data, COMPRESSED_EXTENT_SIZE) / COMPRESSED_EXTENT_SIZE; i++) {
+    type = get_compression_type(fcb);
+
+    for (i = 0; i < num_parts; i++) {
         UINT64 s2, e2;
-        BOOL compressed;
+        UINT8* comp_data;
+        UINT32 comp_length;
+
+        while (submitted < num_parts && submitted < i + window) {
+            s2 = start_data + (submitted * COMPRESSED_EXTENT_SIZE);
+            e2 = min(s2 + COMPRESSED_EXTENT_SIZE, end_data);
+
+            Status = add_calc_job_comp(Vcb, type, (UINT8*)data + (submitted * COMPRESSED_EXTENT_SIZE), (UINT32)(e2 - s2), &parts[submitted]);
+            if (!NT_SUCCESS(Status)) {
+                ERR("add_calc_job_comp returned %08x\n", Status);
+                parts[submitted] = NULL; // compress it on this thread instead
+            }
+
+            submitted++;
+        }
 
         s2 = start_data + (i * COMPRESSED_EXTENT_SIZE);
         e2 = min(s2 + COMPRESSED_EXTENT_SIZE, end_data);
 
-        Status = write_compressed_bit(fcb, s2, e2, (UINT8*)data + (i * COMPRESSED_EXTENT_SIZE), &compressed, Irp, rollback);
+        if (parts[i]) {
+            KeWaitForSingleObject(&parts[i]->event, Executive, KernelMode, FALSE, NULL);
+
+            Status = parts[i]->Status;
+            comp_data = parts[i]->out;
+            comp_length = parts[i]->outlen;
+
+            free_calc_job(parts[i]);
+            parts[i] = NULL;
+        } else
+            Status = compress_extent(Vcb, type, (UINT8*)data + (i * COMPRESSED_EXTENT_SIZE), (UINT32)(e2 - s2), &comp_data, &comp_length);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("compress_extent returned %08x\n", Status);
+            goto end;
+        }
+
+        Status = write_compressed_extent(fcb, s2, e2, (UINT8*)data + (i * COMPRESSED_EXTENT_SIZE), type, comp_data, comp_length, Irp, rollback);
+
+        if (comp_data)
+            ExFreePool(comp_data);
 
         if (!NT_SUCCESS(Status)) {
-            ERR("write_compressed_bit returned %08x\n", Status);
-            return Status;
+            ERR("write_compressed_extent returned %08x\n", Status);
+            goto end;
         }
+    }
 
-        // If the first 128 KB of a file is incompressible, we set the nocompress flag so we don't
-        // bother with the rest of it.
-        if (s2 == 0 && e2 == COMPRESSED_EXTENT_SIZE && !compressed && !fcb->Vcb->options.compress_force) {
-            fcb->inode_item.flags |= BTRFS_INODE_NOCOMPRESS;
-            fcb->inode_item_changed = TRUE;
-            mark_fcb_dirty(fcb);
+    Status = STATUS_SUCCESS;
 
-            // write subsequent data non-compressed
-            if (e2 < end_data) {
-                Status = do_write_file(fcb, e2, end_data, (UINT8*)data + e2, Irp, FALSE, 0, rollback);
+end:
+    // wait for any jobs still running, as they point into our buffer
+    for (i = 0; i < submitted; i++) {
+        if (parts[i]) {
+            KeWaitForSingleObject(&parts[i]->event, Executive, KernelMode, FALSE, NULL);
 
-                if (!NT_SUCCESS(Status)) {
-                    ERR("do_write_file returned %08x\n", Status);
-                    return Status;
-                }
-            }
+            if (parts[i]->out)
+                ExFreePool(parts[i]->out);
 
-            return STATUS_SUCCESS;
+            free_calc_job(parts[i]);
         }
     }
 
-    return STATUS_SUCCESS;
+    ExFreePool(parts);
+
+    return Status;
 }
 
 NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void* buf, ULONG* length, BOOLEAN paging_io, BOOLEAN no_cache,